@@ -6,11 +6,24 @@
 #include <math.h>
 #include "sdbf.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BF_X86_KERNELS
+#endif
+
 // Global parameters
 extern sdbf_parameters_t sdbf_sys;
 
-// Makeshift cache
-static uint16_t bf_est_cache[256][256];
+// Match estimate tables built so far (see bf_est_table()): never changed once on the list
+static bf_est_t *est_tables = NULL;
+static pthread_mutex_t est_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Active bf_bitcount_cut_256() kernel (see bf_bitcount_init())
+static uint32_t bf_bitcount_cut_256_lut( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack);
+static uint32_t (*bitcount_cut_256)( uint8_t *, uint8_t *, uint32_t, int32_t) = bf_bitcount_cut_256_lut;
+// Active bf_bitcount_cut_256_x4() kernel
+static void bf_bitcount_cut_256_x4_any( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results);
+static void (*bitcount_cut_256_x4)( uint8_t **, uint8_t *, const uint32_t *, int32_t, uint32_t *) = bf_bitcount_cut_256_x4_any;
 
 /** 
  * Precalculates the number of set bits for all 16-bit numbers
@@ -24,23 +37,50 @@ void init_bit_count_16() {
                 bit_count_16[byte]++;
         }
     }
-    bzero( bf_est_cache, sizeof( bf_est_cache));
 }
 
 /**
- * Estimate number of expected matching bits
+ * Estimate number of expected matching bits (from the table of the geometry, if it is covered)
  */
 uint32_t bf_match_est( uint32_t m, uint32_t k, uint32_t s1, uint32_t s2, uint32_t common) {
+	if( !common && s1 < BF_EST_MAX && s2 < BF_EST_MAX)
+		return bf_est_table( m, k)->est[s1][s2];
+	double ex = 1-1.0/m;
+	return round((double)m*(1 - pow( ex, k*s1) - pow( ex, k*s2) + pow( ex, k*(s1+s2-common))));
+}
 
-	// This cache should work >99% of the time
-	if( !common && bf_est_cache[s1][s2]) {
-		return bf_est_cache[s1][s2];
+/**
+ * Returns the (read-only) table of match estimates for m-bit filters with k hash functions: built on first
+ * request, it is shared by all threads from then on.
+ */
+const bf_est_t *bf_est_table( uint32_t m, uint32_t k) {
+	bf_est_t *est;
+	uint32_t s1, s2;
+	double ex = 1-1.0/m, ex_pow[2*BF_EST_MAX];
+
+	for( est=__atomic_load_n( &est_tables, __ATOMIC_ACQUIRE); est; est=est->next) {
+		if( est->m == m && est->k == k)
+			return est;
 	}
-	double ex = 1-1.0/m;
-	uint32_t result = round((double)m*(1 - pow( ex, k*s1) - pow( ex, k*s2) + pow( ex, k*(s1+s2-common))));
-	bf_est_cache[s1][s2] = (uint16_t)result;
-		
-	return result;
+	pthread_mutex_lock( &est_mutex);
+	for( est=est_tables; est && (est->m != m || est->k != k); est=est->next)
+		;
+	if( !est) {
+		est = (bf_est_t *)alloc_check( ALLOC_ONLY, sizeof( bf_est_t), "bf_est_table", "est", ERROR_EXIT);
+		est->m = m;
+		est->k = k;
+		// The same terms as bf_match_est() computes, each once
+		for( s1=0; s1<2*BF_EST_MAX; s1++)
+			ex_pow[s1] = pow( ex, k*s1);
+		for( s1=0; s1<BF_EST_MAX; s1++) {
+			for( s2=0; s2<BF_EST_MAX; s2++)
+				est->est[s1][s2] = round((double)m*(1 - ex_pow[s1] - ex_pow[s2] + ex_pow[s1+s2]));
+		}
+		est->next = est_tables;
+		__atomic_store_n( &est_tables, est, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock( &est_mutex);
+	return est;
 }
 
 /**
@@ -103,8 +143,9 @@ int32_t get_elem_count( sdbf_t *sdbf, uint64_t index) {
  * Computer the number of common bits (dot product) b/w two filters--conditional optimized version for 256-byte BFs.
  * The conditional looks first at the dot product of the first 32/64/128 bytes; if it is less than the threshold,
  * it returns 0; otherwise, proceeds with the rest of the computation.
+ * Lookup-table version; used when no hardware popcount is available.
  */
-uint32_t bf_bitcount_cut_256( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+static uint32_t bf_bitcount_cut_256_lut( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
 	uint32_t result=0;
 	uint64_t buff64[32];
 	uint64_t *f1_64 = (uint64_t *)bfilter_1;
@@ -290,6 +331,232 @@ uint32_t bf_bitcount_cut_256( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t c
     return result;
 }
 
+#ifdef BF_X86_KERNELS
+/**
+ * Hardware popcount version (POPCNT), 64 bits at a time.
+ */
+__attribute__((target("popcnt")))
+static uint32_t bf_bitcount_cut_256_popcnt( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+	uint32_t i, result=0;
+	uint64_t *f1_64 = (uint64_t *)bfilter_1;
+	uint64_t *f2_64 = (uint64_t *)bfilter_2;
+
+	for( i=0; i<4; i++)
+		result += __builtin_popcountll( f1_64[i] & f2_64[i]);
+	if( cut_off > 0 && (8*result + slack) < cut_off)
+		return 0;
+	for( ; i<8; i++)
+		result += __builtin_popcountll( f1_64[i] & f2_64[i]);
+	if( cut_off > 0 && (4*result + slack) < cut_off)
+		return 0;
+	for( ; i<16; i++)
+		result += __builtin_popcountll( f1_64[i] & f2_64[i]);
+	if( cut_off > 0 && (2*result + slack) < cut_off)
+		return 0;
+	for( ; i<32; i++)
+		result += __builtin_popcountll( f1_64[i] & f2_64[i]);
+	return result;
+}
+
+/**
+ * AVX2 helpers: per-byte nibble lookup (pshufb) count of the AND of two 32-byte vectors.
+ */
+__attribute__((target("avx2")))
+static inline __m256i avx2_and_count8( const uint8_t *f1, const uint8_t *f2) {
+	const __m256i lookup = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8( 0x0F);
+	__m256i v = _mm256_and_si256( _mm256_loadu_si256( (const __m256i *)f1), _mm256_loadu_si256( (const __m256i *)f2));
+	__m256i lo = _mm256_and_si256( v, low_mask);
+	__m256i hi = _mm256_and_si256( _mm256_srli_epi16( v, 4), low_mask);
+	return _mm256_add_epi8( _mm256_shuffle_epi8( lookup, lo), _mm256_shuffle_epi8( lookup, hi));
+}
 
+__attribute__((target("avx2")))
+static inline uint32_t avx2_hsum8( __m256i counts) {
+	__m256i sums = _mm256_sad_epu8( counts, _mm256_setzero_si256());
+	__m128i s = _mm_add_epi64( _mm256_castsi256_si128( sums), _mm256_extracti128_si256( sums, 1));
+	return (uint32_t)(_mm_cvtsi128_si64( s) + _mm_extract_epi64( s, 1));
+}
 
+/**
+ * AVX2 version: each stage is one, one, two and four 32-byte vectors.
+ * Per-byte counts never exceed 32 within a stage, so they are reduced once per stage.
+ */
+__attribute__((target("avx2")))
+static uint32_t bf_bitcount_cut_256_avx2( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+	uint32_t result=0;
 
+	result += avx2_hsum8( avx2_and_count8( bfilter_1, bfilter_2));
+	if( cut_off > 0 && (8*result + slack) < cut_off)
+		return 0;
+	result += avx2_hsum8( avx2_and_count8( bfilter_1+32, bfilter_2+32));
+	if( cut_off > 0 && (4*result + slack) < cut_off)
+		return 0;
+	result += avx2_hsum8( _mm256_add_epi8( avx2_and_count8( bfilter_1+64, bfilter_2+64),
+	                                       avx2_and_count8( bfilter_1+96, bfilter_2+96)));
+	if( cut_off > 0 && (2*result + slack) < cut_off)
+		return 0;
+	result += avx2_hsum8( _mm256_add_epi8( _mm256_add_epi8( avx2_and_count8( bfilter_1+128, bfilter_2+128),
+	                                                         avx2_and_count8( bfilter_1+160, bfilter_2+160)),
+	                                       _mm256_add_epi8( avx2_and_count8( bfilter_1+192, bfilter_2+192),
+	                                                         avx2_and_count8( bfilter_1+224, bfilter_2+224))));
+	return result;
+}
+
+/**
+ * AVX-512 version (VPOPCNTDQ): the 32-byte stages use masked 512-bit loads.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint32_t bf_bitcount_cut_256_avx512( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+	uint32_t result=0;
+	__m512i v;
+
+	v = _mm512_and_si512( _mm512_maskz_loadu_epi64( 0x0F, bfilter_1), _mm512_maskz_loadu_epi64( 0x0F, bfilter_2));
+	result += (uint32_t)_mm512_reduce_add_epi64( _mm512_popcnt_epi64( v));
+	if( cut_off > 0 && (8*result + slack) < cut_off)
+		return 0;
+	v = _mm512_and_si512( _mm512_maskz_loadu_epi64( 0x0F, bfilter_1+32), _mm512_maskz_loadu_epi64( 0x0F, bfilter_2+32));
+	result += (uint32_t)_mm512_reduce_add_epi64( _mm512_popcnt_epi64( v));
+	if( cut_off > 0 && (4*result + slack) < cut_off)
+		return 0;
+	v = _mm512_and_si512( _mm512_loadu_si512( bfilter_1+64), _mm512_loadu_si512( bfilter_2+64));
+	result += (uint32_t)_mm512_reduce_add_epi64( _mm512_popcnt_epi64( v));
+	if( cut_off > 0 && (2*result + slack) < cut_off)
+		return 0;
+	v = _mm512_add_epi64(
+	        _mm512_popcnt_epi64( _mm512_and_si512( _mm512_loadu_si512( bfilter_1+128), _mm512_loadu_si512( bfilter_2+128))),
+	        _mm512_popcnt_epi64( _mm512_and_si512( _mm512_loadu_si512( bfilter_1+192), _mm512_loadu_si512( bfilter_2+192))));
+	result += (uint32_t)_mm512_reduce_add_epi64( v);
+	return result;
+}
+
+/**
+ * Four filters vs one, POPCNT version: the first stage of all four is done with the first 32 bytes of the
+ * common filter held in registers; the (few) filters that pass it go through the full kernel.
+ */
+__attribute__((target("popcnt")))
+static void bf_bitcount_cut_256_x4_popcnt( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results) {
+	uint64_t *f2_64 = (uint64_t *)bfilter_2;
+	uint64_t t0 = f2_64[0], t1 = f2_64[1], t2 = f2_64[2], t3 = f2_64[3];
+	uint32_t q, result;
+
+	for( q=0; q<4; q++) {
+		uint64_t *f1_64 = (uint64_t *)bfilters_1[q];
+		result = __builtin_popcountll( f1_64[0] & t0) + __builtin_popcountll( f1_64[1] & t1) +
+		         __builtin_popcountll( f1_64[2] & t2) + __builtin_popcountll( f1_64[3] & t3);
+		if( cut_offs[q] > 0 && (8*result + slack) < cut_offs[q])
+			results[q] = 0;
+		else
+			results[q] = bitcount_cut_256( bfilters_1[q], bfilter_2, cut_offs[q], slack);
+	}
+}
+
+/**
+ * Four filters vs one, AVX2 version: the first stage of all four shares the load of the common filter, and the
+ * four counts are reduced together (packed as 16-bit fields of the SAD lanes, which never exceed 256).
+ */
+__attribute__((target("avx2")))
+static void bf_bitcount_cut_256_x4_avx2( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results) {
+	const __m256i lookup = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8( 0x0F);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i f2 = _mm256_loadu_si256( (const __m256i *)bfilter_2), sums = zero;
+	uint32_t q, result;
+
+	for( q=0; q<4; q++) {
+		__m256i v = _mm256_and_si256( _mm256_loadu_si256( (const __m256i *)bfilters_1[q]), f2);
+		__m256i cnt = _mm256_add_epi8( _mm256_shuffle_epi8( lookup, _mm256_and_si256( v, low_mask)),
+		                               _mm256_shuffle_epi8( lookup, _mm256_and_si256( _mm256_srli_epi16( v, 4), low_mask)));
+		sums = _mm256_or_si256( sums, _mm256_slli_epi64( _mm256_sad_epu8( cnt, zero), 16*q));
+	}
+	__m128i s = _mm_add_epi64( _mm256_castsi256_si128( sums), _mm256_extracti128_si256( sums, 1));
+	uint64_t packed = (uint64_t)(_mm_cvtsi128_si64( s) + _mm_extract_epi64( s, 1));
+	for( q=0; q<4; q++) {
+		result = (uint32_t)(packed >> 16*q) & 0xFFFF;
+		if( cut_offs[q] > 0 && (8*result + slack) < cut_offs[q])
+			results[q] = 0;
+		else
+			results[q] = bitcount_cut_256( bfilters_1[q], bfilter_2, cut_offs[q], slack);
+	}
+}
+
+/**
+ * Four filters vs one, AVX-512 version: the first 32 bytes of the four filters are ANDed two to a vector with the
+ * first 32 bytes of the common one (broadcast), and the four counts come out of one reduction.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void bf_bitcount_cut_256_x4_avx512( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results) {
+	__m512i f2 = _mm512_broadcast_i64x4( _mm256_loadu_si256( (const __m256i *)bfilter_2));
+	__m512i v01 = _mm512_inserti64x4( _mm512_castsi256_si512( _mm256_loadu_si256( (const __m256i *)bfilters_1[0])),
+	                                  _mm256_loadu_si256( (const __m256i *)bfilters_1[1]), 1);
+	__m512i v23 = _mm512_inserti64x4( _mm512_castsi256_si512( _mm256_loadu_si256( (const __m256i *)bfilters_1[2])),
+	                                  _mm256_loadu_si256( (const __m256i *)bfilters_1[3]), 1);
+	__m512i c01 = _mm512_popcnt_epi64( _mm512_and_si512( v01, f2));
+	__m512i c23 = _mm512_popcnt_epi64( _mm512_and_si512( v23, f2));
+	uint64_t counts[16];
+	uint32_t q, result;
+
+	// Pairwise sums: 64-bit neighbours, then 128-bit neighbours (each 256-bit half ends up with its total in lane 0)
+	c01 = _mm512_add_epi64( c01, _mm512_shuffle_epi32( c01, _MM_PERM_BADC));
+	c23 = _mm512_add_epi64( c23, _mm512_shuffle_epi32( c23, _MM_PERM_BADC));
+	c01 = _mm512_add_epi64( c01, _mm512_shuffle_i64x2( c01, c01, _MM_SHUFFLE( 2, 3, 0, 1)));
+	c23 = _mm512_add_epi64( c23, _mm512_shuffle_i64x2( c23, c23, _MM_SHUFFLE( 2, 3, 0, 1)));
+	_mm512_storeu_si512( counts, c01);
+	_mm512_storeu_si512( counts+8, c23);
+	for( q=0; q<4; q++) {
+		result = (uint32_t)counts[4*q];
+		if( cut_offs[q] > 0 && (8*result + slack) < cut_offs[q])
+			results[q] = 0;
+		else
+			results[q] = bitcount_cut_256( bfilters_1[q], bfilter_2, cut_offs[q], slack);
+	}
+}
+#endif
+
+/**
+ * Four filters vs one, generic version: one kernel call per filter.
+ */
+static void bf_bitcount_cut_256_x4_any( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results) {
+	uint32_t q;
+
+	for( q=0; q<4; q++)
+		results[q] = bitcount_cut_256( bfilters_1[q], bfilter_2, cut_offs[q], slack);
+}
+
+/**
+ * Selects the fastest bf_bitcount_cut_256() (& bf_bitcount_cut_256_x4()) kernel supported by the CPU (to be called once).
+ */
+void bf_bitcount_init() {
+	bitcount_cut_256 = bf_bitcount_cut_256_lut;
+	bitcount_cut_256_x4 = bf_bitcount_cut_256_x4_any;
+#ifdef BF_X86_KERNELS
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512vpopcntdq")) {
+		bitcount_cut_256 = bf_bitcount_cut_256_avx512;
+		bitcount_cut_256_x4 = bf_bitcount_cut_256_x4_avx512;
+	} else if( __builtin_cpu_supports( "avx2")) {
+		bitcount_cut_256 = bf_bitcount_cut_256_avx2;
+		bitcount_cut_256_x4 = bf_bitcount_cut_256_x4_avx2;
+	} else if( __builtin_cpu_supports( "popcnt")) {
+		bitcount_cut_256 = bf_bitcount_cut_256_popcnt;
+		bitcount_cut_256_x4 = bf_bitcount_cut_256_x4_popcnt;
+	}
+#endif
+}
+
+/**
+ * Computes the number of common bits b/w two 256-byte filters using the kernel selected by bf_bitcount_init().
+ */
+uint32_t bf_bitcount_cut_256( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack) {
+	return bitcount_cut_256( bfilter_1, bfilter_2, cut_off, slack);
+}
+
+/**
+ * Computes the number of common bits b/w each of four 256-byte filters and a fifth one (as bf_bitcount_cut_256()
+ * does for each pair, with its own cut off).
+ */
+void bf_bitcount_cut_256_x4( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results) {
+	bitcount_cut_256_x4( bfilters_1, bfilter_2, cut_offs, slack, results);
+}
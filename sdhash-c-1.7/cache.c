@@ -0,0 +1,331 @@
+/**
+ * cache.c: Persistent digest cache. Digests are kept in an append-only file, each with the identity of its
+ * source file (device, inode, size, modification time & optionally a sampled content checksum) & the kind of
+ * digest, so that files which have not changed are not read again. Records carry their length & a checksum:
+ * a torn tail (crash) is cut off & a damaged record is a miss. Appends are serialized within the process (mutex)
+ * & between processes (flock); before appending, a process indexes the records appended by others. A newer
+ * record for a file replaces the older one; the file is compacted (replaced) when replaced records outnumber the
+ * live ones, & processes that still have the old one open switch to the new one.
+ */
+
+#include "sdbf.h"
+#include <sys/file.h>
+
+extern sdbf_parameters_t sdbf_sys;
+
+#ifdef __APPLE__
+#define CACHE_MTIME_NS( st)  ((uint64_t)(st).st_mtimespec.tv_sec*1000000000 + (st).st_mtimespec.tv_nsec)
+#else
+#define CACHE_MTIME_NS( st)  ((uint64_t)(st).st_mtim.tv_sec*1000000000 + (st).st_mtim.tv_nsec)
+#endif
+
+/**
+ * 64-bit checksum of a buffer (each fingerprint word covers half of every 64 bytes).
+ */
+static uint64_t cache_sum( const void *data, uint64_t len) {
+    uint64_t fp[2];
+
+    xxh3_fingerprint( (const uint8_t *)data, len, fp);
+    return fp[0] ^ fp[1];
+}
+
+/**
+ * Kind of the digests generated with the current parameters (dd_block_size: 0 for stream digests).
+ */
+static uint64_t cache_kind( uint32_t dd_block_size) {
+    char kind[64];
+
+    sprintf( kind, "%s/%d/%d/%d", HASH_NAMES[sdbf_sys.hash_id], sdbf_sys.bf_size, sdbf_sys.max_elem, dd_block_size);
+    return cache_sum( kind, strlen( kind)) | 1;
+}
+
+/**
+ * Sampled content checksum: the first & last CACHE_SAMPLE bytes of the file (0 if it cannot be read).
+ */
+static uint64_t cache_check( char *filename, uint64_t size) {
+    uint64_t check = 0, len = (size < 2*CACHE_SAMPLE) ? size : 2*CACHE_SAMPLE;
+    ssize_t head = len/2, tail = len-len/2;
+    uint8_t *sample = (uint8_t *)alloc_check( ALLOC_ONLY, 2*CACHE_SAMPLE, "cache_check", "sample", ERROR_EXIT);
+    int fd = open( filename, O_RDONLY);
+
+    if( fd >= 0) {
+        if( pread( fd, sample, head, 0) == head && pread( fd, sample+head, tail, size-tail) == tail)
+            check = cache_sum( sample, len) | 1;
+        close( fd);
+    }
+    free( sample);
+    return check;
+}
+
+/**
+ * Index slot of a file/kind (mutex held): its entry or, if it is not there, an empty slot.
+ */
+static uint64_t cache_slot( cache_t *cache, const cache_key_t *key) {
+    uint64_t slot, mask = cache->cap-1;
+
+    for( slot=((key->ino ^ (key->dev << 40) ^ key->kind)*0x9E3779B97F4A7C15ULL >> 20) & mask; cache->entries[slot].length; slot=(slot+1) & mask) {
+        cache_key_t *entry = cache->entries + slot;
+        if( entry->ino == key->ino && entry->dev == key->dev && entry->kind == key->kind)
+            break;
+    }
+    return slot;
+}
+
+/**
+ * Adds a record to the index (mutex held), replacing an older one for the same file.
+ */
+static void cache_index( cache_t *cache, const cache_key_t *key) {
+    uint64_t i, slot;
+
+    if( 2*(cache->count+1) > cache->cap) {
+        cache_key_t *old = cache->entries;
+        uint64_t old_cap = cache->cap;
+        cache->cap = 2*old_cap;
+        cache->entries = (cache_key_t *)alloc_check( ALLOC_ZERO, cache->cap*sizeof( cache_key_t), "cache_index", "cache->entries", ERROR_EXIT);
+        for( i=0; i<old_cap; i++) {
+            if( old[i].length)
+                cache->entries[cache_slot( cache, old + i)] = old[i];
+        }
+        free( old);
+    }
+    slot = cache_slot( cache, key);
+    if( cache->entries[slot].length)
+        cache->dead++;
+    else
+        cache->count++;
+    cache->entries[slot] = *key;
+}
+
+/**
+ * Writes a record (header & digest text) at pos in one go; returns the position of the text, or -1 (a partly
+ * written record is cut off again).
+ */
+static int64_t cache_write( int fd, uint64_t pos, const cache_key_t *key, const char *text) {
+    char header[256];
+    int64_t result = -1;
+    ssize_t header_len;
+
+    sprintf( header, "%s:%02d:%lu:%lu:%016lx:%lu:%lu:%016lx:%016lx:%lu\n", CACHE_MAGIC, CACHE_VERSION, key->dev, key->ino, key->kind,
+             key->size, key->mtime_ns, key->check, key->sum, key->length);
+    header_len = strlen( header);
+    char *record = (char *)alloc_check( ALLOC_ONLY, header_len+key->length, "cache_write", "record", ERROR_EXIT);
+    memcpy( record, header, header_len);
+    memcpy( record+header_len, text, key->length);
+    if( pwrite( fd, record, header_len+key->length, pos) == (ssize_t)(header_len+key->length))
+        result = pos+header_len;
+    else
+        ftruncate( fd, pos);
+    free( record);
+    return result;
+}
+
+/**
+ * Brings the index up to date with the cache file (file locked & mutex held): if another process has replaced
+ * the file (compaction), switches to the new one & indexes it anew; then indexes the records appended since the
+ * last time. Anything after the last complete record is left from an interrupted run & cut off.
+ */
+static void cache_sync( cache_t *cache) {
+    char line[256], magic[16];
+    struct stat cache_stat, path_stat;
+    uint64_t pos, len;
+    cache_key_t key;
+    int32_t version;
+    FILE *in;
+    int fd;
+
+    while( !stat( cache->path, &path_stat) && !fstat( cache->fd, &cache_stat) &&
+           (path_stat.st_ino != cache_stat.st_ino || path_stat.st_dev != cache_stat.st_dev)) {
+        if( (fd = open( cache->path, O_RDWR)) < 0)
+            break;
+        // Same descriptor (lookups may be reading it); the lock on the old file goes with it
+        flock( fd, LOCK_EX);
+        dup2( fd, cache->fd);
+        close( fd);
+        bzero( cache->entries, cache->cap*sizeof( cache_key_t));
+        cache->count = cache->dead = cache->end = 0;
+    }
+    if( fstat( cache->fd, &cache_stat) || cache->end >= (uint64_t)cache_stat.st_size || !(in = fdopen( dup( cache->fd), "r")))
+        return;
+    pos = cache->end;
+    while( !fseeko( in, pos, SEEK_SET) && fgets( line, sizeof( line), in)) {
+        bzero( &key, sizeof( cache_key_t));
+        len = strlen( line);
+        if( line[len-1] != '\n' || sscanf( line, "%10[^:]:%d:%lu:%lu:%lx:%lu:%lu:%lx:%lx:%lu", magic, &version, &key.dev, &key.ino, &key.kind,
+                                           &key.size, &key.mtime_ns, &key.check, &key.sum, &key.length) != 10 ||
+            strcmp( magic, CACHE_MAGIC) || version != CACHE_VERSION || !key.length || pos+len+key.length > (uint64_t)cache_stat.st_size)
+            break;
+        key.offset = pos+len;
+        pos = key.offset+key.length;
+        cache_index( cache, &key);
+    }
+    fclose( in);
+    cache->end = pos;
+    if( pos < (uint64_t)cache_stat.st_size) {
+        if( sdbf_sys.warnings)
+            fprintf( stderr, "Warning: Cache file '%s' damaged after %ld bytes; cutting it off.\n", cache->path, pos);
+        ftruncate( cache->fd, pos);
+    }
+}
+
+/**
+ * Open (or create) a cache file & index its records; verify: also compare sampled content checksums.
+ */
+cache_t *cache_open( char *path, uint32_t verify) {
+    cache_t *cache = (cache_t *)alloc_check( ALLOC_ZERO, sizeof( cache_t), "cache_open", "cache", ERROR_EXIT);
+
+    cache->path = path;
+    cache->verify = verify;
+    cache->cap = CACHE_INDEX_INIT;
+    cache->entries = (cache_key_t *)alloc_check( ALLOC_ZERO, cache->cap*sizeof( cache_key_t), "cache_open", "cache->entries", ERROR_EXIT);
+    if( (cache->fd = open( path, O_RDWR | O_CREAT, 0644)) < 0) {
+        fprintf( stderr, "ERROR: Could not open cache file '%s'.\n", path);
+        exit(-1);
+    }
+    pthread_mutex_init( &cache->mutex, NULL);
+    flock( cache->fd, LOCK_EX);
+    cache_sync( cache);
+    flock( cache->fd, LOCK_UN);
+    return cache;
+}
+
+/**
+ * Look up the digest of a file (of the kind generated with dd_block_size): returns 1 if there is one for the
+ * file as it is now (to be read with cache_load()), or 0; either way, key identifies the file for cache_put().
+ */
+int cache_find( cache_t *cache, char *filename, uint32_t dd_block_size, cache_key_t *key) {
+    struct stat file_stat;
+    cache_key_t entry;
+
+    bzero( key, sizeof( cache_key_t));
+    if( !strcmp( filename, STDIN_ARG) || stat( filename, &file_stat) || !S_ISREG( file_stat.st_mode))
+        return 0;
+    key->dev = file_stat.st_dev;
+    key->ino = file_stat.st_ino;
+    key->size = file_stat.st_size;
+    key->mtime_ns = CACHE_MTIME_NS( file_stat);
+    key->kind = cache_kind( dd_block_size);
+    pthread_mutex_lock( &cache->mutex);
+    entry = cache->entries[cache_slot( cache, key)];
+    pthread_mutex_unlock( &cache->mutex);
+    if( entry.length && entry.size == key->size && entry.mtime_ns == key->mtime_ns &&
+        (!cache->verify || (entry.check && entry.check == cache_check( filename, key->size)))) {
+        *key = entry;
+        return 1;
+    }
+    __sync_fetch_and_add( &cache->miss_cnt, 1);
+    return 0;
+}
+
+/**
+ * Read the digest found by cache_find() (named after filename); NULL if its record turns out to be damaged.
+ */
+sdbf_t *cache_load( cache_t *cache, const cache_key_t *key, char *filename) {
+    char *text = (char *)alloc_check( ALLOC_ONLY, key->length, "cache_load", "text", ERROR_EXIT);
+    sdbf_t *sdbf = NULL;
+    FILE *in;
+
+    if( pread( cache->fd, text, key->length, key->offset) == (ssize_t)key->length && cache_sum( text, key->length) == key->sum &&
+        (in = fmemopen( text, key->length, "r"))) {
+        sdbf = sdbf_from_stream( in);
+        fclose( in);
+    }
+    free( text);
+    if( !sdbf) {
+        if( sdbf_sys.warnings)
+            fprintf( stderr, "Warning: Damaged cache record for '%s'. Hashing the file.\n", filename);
+        __sync_fetch_and_add( &cache->miss_cnt, 1);
+        return NULL;
+    }
+    free( sdbf->name);
+    sdbf->name = (int8_t *)filename;
+    __sync_fetch_and_add( &cache->hit_cnt, 1);
+    return sdbf;
+}
+
+/**
+ * Store the digest text (length bytes, as written by sdbf_to_stream()) of the file identified by cache_find().
+ */
+void cache_put( cache_t *cache, cache_key_t *key, char *filename, const char *text, uint64_t length) {
+    int64_t pos;
+
+    if( !key->kind || !length)
+        return;
+    key->sum = cache_sum( text, length);
+    key->length = length;
+    key->check = cache->verify ? cache_check( filename, key->size) : 0;
+    pthread_mutex_lock( &cache->mutex);
+    flock( cache->fd, LOCK_EX);
+    cache_sync( cache);
+    if( (pos = cache_write( cache->fd, cache->end, key, text)) >= 0) {
+        key->offset = pos;
+        cache->end = pos+length;
+        cache_index( cache, key);
+        cache->add_cnt++;
+    }
+    flock( cache->fd, LOCK_UN);
+    pthread_mutex_unlock( &cache->mutex);
+}
+
+/**
+ * Store an SDBF of the file identified by cache_find().
+ */
+void cache_put_sdbf( cache_t *cache, cache_key_t *key, char *filename, sdbf_t *sdbf) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out;
+
+    if( !key->kind || !(out = open_memstream( &text, &length)))
+        return;
+    sdbf_to_stream( sdbf, out);
+    fclose( out);
+    cache_put( cache, key, filename, text, length);
+    free( text);
+}
+
+/**
+ * Rewrites the cache file with just the live records, incl. those appended by other processes (file locked);
+ * the new file replaces the old one.
+ */
+static void cache_compact( cache_t *cache) {
+    char *tmp_path = (char *)alloc_check( ALLOC_ONLY, strlen( cache->path)+8, "cache_compact", "tmp_path", ERROR_EXIT);
+    uint64_t i, pos = 0;
+    int fd;
+
+    sprintf( tmp_path, "%s.tmp", cache->path);
+    pthread_mutex_lock( &cache->mutex);
+    flock( cache->fd, LOCK_EX);
+    cache_sync( cache);
+    if( (fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        for( i=0; i<cache->cap; i++) {
+            cache_key_t *entry = cache->entries + i;
+            if( !entry->length)
+                continue;
+            char *text = (char *)alloc_check( ALLOC_ONLY, entry->length, "cache_compact", "text", ERROR_EXIT);
+            ssize_t got = pread( cache->fd, text, entry->length, entry->offset);
+            if( got == (ssize_t)entry->length && cache_write( fd, pos, entry, text) >= 0)
+                pos = lseek( fd, 0, SEEK_END);
+            free( text);
+        }
+        if( fsync( fd) || close( fd) || rename( tmp_path, cache->path))
+            unlink( tmp_path);
+    }
+    flock( cache->fd, LOCK_UN);
+    pthread_mutex_unlock( &cache->mutex);
+    free( tmp_path);
+}
+
+/**
+ * Report the hit rate, compact the cache file if need be & release the cache.
+ */
+void cache_close( cache_t *cache) {
+    uint64_t lookups = cache->hit_cnt + cache->miss_cnt;
+
+    fprintf( stderr, "cache: %lu hits, %lu misses (%.1f%% hits), %lu digests added, %lu cached\n", cache->hit_cnt, cache->miss_cnt,
+             lookups ? 100.0*cache->hit_cnt/lookups : 0.0, cache->add_cnt, cache->count);
+    if( cache->dead > cache->count)
+        cache_compact( cache);
+    close( cache->fd);
+    pthread_mutex_destroy( &cache->mutex);
+    free( cache->entries);
+    free( cache);
+}
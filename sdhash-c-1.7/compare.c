@@ -0,0 +1,192 @@
+/**
+ * compare.c: Pair-parallel comparison of the digests in the set. The pairs are scored in windows of up to
+ * CMP_WINDOW_PAIRS; a window is cut into blocks of CMP_BLOCK_PAIRS consecutive pairs, which are dealt to the
+ * workers in contiguous runs (consecutive pairs mostly share their reference digest). A worker takes its own
+ * blocks first to last, then steals the last block of another worker; each pair is scored by a single worker.
+ * The results of a window are printed in pair order once it is done. A pair with too much work for a single
+ * worker is scored on its own, split across all of them (see sdbf_score_ctx()). As only the scores at or above
+ * the output threshold are printed, pairs are abandoned as soon as they cannot reach it.
+ */
+
+#include "sdbf.h"
+
+extern sdbf_parameters_t sdbf_sys;
+
+/**
+ * First target of a reference digest.
+ */
+static uint32_t cmp_tgt_start( const cmp_pairs_t *pairs, uint32_t ref) {
+    return pairs->triangle ? ref+1 : pairs->tgt_first;
+}
+
+/**
+ * Moves *ref, *tgt on to the first pair at or after them; returns 0 if there is none.
+ */
+static int cmp_seek( const cmp_pairs_t *pairs, uint32_t *ref, uint32_t *tgt) {
+    while( *ref < pairs->ref_end && *tgt >= pairs->tgt_end) {
+        (*ref)++;
+        *tgt = cmp_tgt_start( pairs, *ref);
+    }
+    return *ref < pairs->ref_end;
+}
+
+/**
+ * Is the pair to be split across the workers?
+ */
+static int cmp_split( uint32_t ref, uint32_t tgt) {
+    return (uint64_t)sdbf_get( ref)->bf_count*sdbf_get( tgt)->bf_count >= CMP_SPLIT_WORK;
+}
+
+/**
+ * Prints the result of a pair (if above the output threshold).
+ */
+static void cmp_print( const sdbf_ctx_t *ctx, const cmp_pair_t *pair) {
+    if( pair->score >= ctx->output_threshold) {
+        if( pair->swap)
+            printf( "%s|%s|%03d\n", sdbf_get_name( pair->tgt), sdbf_get_name( pair->ref), pair->score);
+        else
+            printf( "%s|%s|%03d\n", sdbf_get_name( pair->ref), sdbf_get_name( pair->tgt), pair->score);
+    }
+}
+
+/**
+ * Prints the scoring counters (verbose).
+ */
+static void cmp_report( const cmp_stats_t *stats) {
+    if( sdbf_sys.verbose)
+        fprintf( stderr, "compare: %ld pairs (%ld skipped by the prefilter, %ld abandoned under the threshold), "
+                 "%ld BFs done at a perfect match, %ld of %ld BF comparisons skipped\n", stats->pair_cnt, stats->skip_cnt,
+                 stats->cut_cnt, stats->full_cnt, stats->bf_total-stats->bf_cmp, stats->bf_total);
+}
+
+/**
+ * Next block for a worker: its own first one, else the last one of another worker.
+ */
+static int32_t cmp_next( cmp_worker_t *worker, uint32_t *stolen) {
+    cmp_run_t *run = worker->run;
+    int32_t block = -1;
+    uint32_t i;
+
+    pthread_mutex_lock( &worker->mutex);
+    if( worker->head < worker->tail)
+        block = worker->head++;
+    pthread_mutex_unlock( &worker->mutex);
+    *stolen = 0;
+    for( i=1; block < 0 && i<run->worker_cnt; i++) {
+        cmp_worker_t *victim = run->workers + (worker->tid+i) % run->worker_cnt;
+        pthread_mutex_lock( &victim->mutex);
+        if( victim->head < victim->tail) {
+            block = --victim->tail;
+            *stolen = 1;
+        }
+        pthread_mutex_unlock( &victim->mutex);
+    }
+    return block;
+}
+
+/**
+ * Comparison worker: scores blocks of pairs of the window until there are none left.
+ */
+static void *thread_cmp_worker( void *worker_param) {
+    cmp_worker_t *worker = (cmp_worker_t *)worker_param;
+    cmp_run_t *run = worker->run;
+    uint32_t i, end, stolen;
+    int32_t b;
+
+    while( (b = cmp_next( worker, &stolen)) >= 0) {
+        end = (b+1)*CMP_BLOCK_PAIRS;
+        end = (end < run->pair_cnt) ? end : run->pair_cnt;
+        for( i=b*CMP_BLOCK_PAIRS; i<end; i++) {
+            cmp_pair_t *pair = run->pairs + i;
+            pair->score = sdbf_score_ctx( &run->ctx, sdbf_get( pair->ref), sdbf_get( pair->tgt), FLAG_OFF, &pair->swap);
+        }
+        worker->pair_cnt += end - b*CMP_BLOCK_PAIRS;
+        worker->block_cnt++;
+        worker->steal_cnt += stolen;
+    }
+    sdbf_score_stats( &worker->stats);
+    return NULL;
+}
+
+/**
+ * Scores the pairs of digests of the set in a comparison context & prints the results (above its output threshold)
+ * in pair order. With more than one thread (& no map), pairs are scored in parallel. Returns the number of pairs
+ * scored.
+ */
+uint64_t sdbf_compare_pairs( const sdbf_ctx_t *ctx, const cmp_pairs_t *pairs, uint32_t map_on) {
+    uint32_t ref = pairs->ref_first, tgt = cmp_tgt_start( pairs, ref), i, blocks, thread_cnt = ctx->thread_cnt;
+    int32_t  more = cmp_seek( pairs, &ref, &tgt);
+    uint64_t result = 0;
+    cmp_stats_t stats;
+    cmp_pair_t pair;
+    cmp_run_t run;
+    sdbf_ctx_t cut = *ctx;
+
+    // Scores under the threshold are not printed: they need not be exact
+    cut.min_score = ctx->output_threshold;
+    bzero( &stats, sizeof( cmp_stats_t));
+    sdbf_score_stats( NULL);
+    if( map_on == FLAG_ON || thread_cnt < 2 || !pool_size()) {
+        for( ; more; result++, tgt++, more = cmp_seek( pairs, &ref, &tgt)) {
+            pair.ref = ref;
+            pair.tgt = tgt;
+            pair.score = sdbf_score_ctx( &cut, sdbf_get( ref), sdbf_get( tgt), map_on, &pair.swap);
+            cmp_print( ctx, &pair);
+        }
+        sdbf_score_stats( &stats);
+        cmp_report( &stats);
+        return result;
+    }
+    // The workers score each pair on their own
+    run.ctx = cut;
+    run.ctx.thread_cnt = 1;
+    run.pairs = (cmp_pair_t *)alloc_check( ALLOC_ALIGN, CMP_WINDOW_PAIRS*sizeof( cmp_pair_t), "sdbf_compare_pairs", "run.pairs", ERROR_EXIT);
+    run.worker_cnt = thread_cnt;
+    run.workers = (cmp_worker_t *)alloc_check( ALLOC_ALIGN, thread_cnt*sizeof( cmp_worker_t), "sdbf_compare_pairs", "run.workers", ERROR_EXIT);
+    for( i=0; i<thread_cnt; i++) {
+        run.workers[i].run = &run;
+        run.workers[i].tid = i;
+        bzero( &run.workers[i].stats, sizeof( cmp_stats_t));
+        pthread_mutex_init( &run.workers[i].mutex, NULL);
+    }
+    while( more) {
+        // Fill the window, up to the next pair to be split
+        for( run.pair_cnt=0; more && run.pair_cnt < CMP_WINDOW_PAIRS; tgt++, more = cmp_seek( pairs, &ref, &tgt)) {
+            if( cmp_split( ref, tgt))
+                break;
+            run.pairs[run.pair_cnt].ref = ref;
+            run.pairs[run.pair_cnt++].tgt = tgt;
+        }
+        if( run.pair_cnt) {
+            blocks = (run.pair_cnt + CMP_BLOCK_PAIRS-1)/CMP_BLOCK_PAIRS;
+            for( i=0; i<thread_cnt; i++) {
+                run.workers[i].head = (uint64_t)blocks*i/thread_cnt;
+                run.workers[i].tail = (uint64_t)blocks*(i+1)/thread_cnt;
+            }
+            pool_run( thread_cmp_worker, run.workers, sizeof( cmp_worker_t), thread_cnt);
+            for( i=0; i<run.pair_cnt; i++)
+                cmp_print( ctx, run.pairs + i);
+            result += run.pair_cnt;
+        } else if( more) {
+            pair.ref = ref;
+            pair.tgt = tgt;
+            pair.score = sdbf_score_ctx( &cut, sdbf_get( ref), sdbf_get( tgt), FLAG_OFF, &pair.swap);
+            cmp_print( ctx, &pair);
+            result++;
+            tgt++;
+            more = cmp_seek( pairs, &ref, &tgt);
+        }
+    }
+    sdbf_score_stats( &stats);
+    for( i=0; i<thread_cnt; i++) {
+        cmp_worker_t *worker = run.workers + i;
+        if( sdbf_sys.verbose)
+            fprintf( stderr, "compare worker %d: %ld pairs, %ld blocks (%ld stolen)\n", i, worker->pair_cnt, worker->block_cnt, worker->steal_cnt);
+        cmp_stats_add( &stats, &worker->stats);
+        pthread_mutex_destroy( &worker->mutex);
+    }
+    cmp_report( &stats);
+    free( run.workers);
+    free( run.pairs);
+    return result;
+}
@@ -0,0 +1,224 @@
+/**
+ * dd_pipe.c: Pipelined block-based (dd) hashing of a list of images. Images are cut into ranges of
+ * DD_RANGE_BLOCKS blocks, which are hashed as jobs on the shared workers; once all of the ranges of an image
+ * are queued, those of the next images follow, so several images are in flight at once. Ranges are written
+ * out (or left in place, for digests kept in memory) in order as they complete, so a streamed digest never
+ * takes more memory than the ranges in flight. Images with a cached digest are not read at all.
+ */
+
+#include "sdbf.h"
+
+extern sdbf_parameters_t sdbf_sys;
+
+/**
+ * Worker job: hashes a range of blocks (blocks repeating one hashed before by any range of the image get a
+ * copy of its BF).
+ */
+static void *thread_dd_range( void *param) {
+    dd_range_t *range = (dd_range_t *)param;
+    dd_image_t *image = range->image;
+
+    bzero( range->window.buffer, range->window.bf_count*range->window.bf_size);
+    bzero( range->window.elem_counts, range->window.bf_count*sizeof( uint16_t));
+    gen_block_range( image->mfile->buffer, image->mfile->size, range->first, &range->window, &image->dedup);
+    return NULL;
+}
+
+/**
+ * Opens the next image of the list (skipped files get an image without ranges). An image with a cached digest
+ * (keys: NULL without a cache) gets it instead of ranges; it is not read, unless the cache record turns out to be
+ * damaged (then it is mapped here). Returns 0 at the end of the list.
+ */
+static int dd_image_open( ingest_t *ing, char **filenames, uint32_t file_count, cache_key_t *keys, uint32_t *next,
+                          dd_image_t *image, uint32_t keep, uint32_t dd_block_size) {
+    mapped_file_t *mfile = NULL;
+
+    if( *next == file_count)
+        return 0;
+    bzero( image, sizeof( dd_image_t));
+    image->index = (*next)++;
+    if( keys && keys[image->index].length) {
+        image->key = keys[image->index];
+        if( (image->sdbf = cache_load( sdbf_sys.cache, &image->key, filenames[image->index])))
+            return 1;
+        mfile = mmap_file( filenames[image->index], MIN_FILE_SIZE, sdbf_sys.warnings);
+    } else {
+        if( keys)
+            image->key = keys[image->index];
+        ingest_next( ing, &mfile);
+        image->ingested = 1;
+    }
+    image->mfile = mfile;
+    if( mfile) {
+        image->sdbf = sdbf_create_dd( mfile->name, mfile->size, dd_block_size, sdbf_sys.max_elem, keep);
+        image->range_cnt = (image->sdbf->bf_count + DD_RANGE_BLOCKS-1)/DD_RANGE_BLOCKS;
+        gen_dedup_init( &image->dedup, image->sdbf->bf_count, image->sdbf->bf_size);
+        // A streamed digest is copied for the cache as it is written (unless it gets too large)
+        if( image->key.kind && !keep)
+            image->text_out = open_memstream( &image->text, &image->text_len);
+    }
+    return 1;
+}
+
+/**
+ * Writes out (or adds to the set) the digest of an image all of whose ranges are written & stores a newly hashed
+ * digest in the cache.
+ */
+static void dd_image_finish( ingest_t *ing, dd_image_t *image, FILE *out) {
+    cache_t *cache = sdbf_sys.cache;
+
+    if( image->mfile && image->sdbf) {
+        gen_dedup_free( &image->dedup);
+        if( image->text_out) {
+            fprintf( image->text_out, "\n");
+            fclose( image->text_out);
+            cache_put( cache, &image->key, (char *)image->sdbf->name, image->text, image->text_len);
+            free( image->text);
+        } else if( image->key.kind && !out)
+            cache_put_sdbf( cache, &image->key, (char *)image->sdbf->name, image->sdbf);
+    }
+    if( image->sdbf) {
+        if( out) {
+            if( image->mfile)
+                fprintf( out, "\n");
+            else
+                sdbf_to_stream( image->sdbf, out);
+            sdbf_free( image->sdbf);
+        } else
+            sdbf_add( image->sdbf);
+    }
+    if( image->ingested)
+        ingest_release( ing);
+    else if( image->mfile)
+        unmap_file( image->mfile);
+}
+
+/**
+ * Queues the next range of an image.
+ */
+static void dd_range_start( dd_range_t *range, dd_image_t *image) {
+    sdbf_t *sdbf = image->sdbf;
+
+    range->image = image;
+    range->first = image->dispatched++ * DD_RANGE_BLOCKS;
+    range->window = *sdbf;
+    range->window.bf_count = (sdbf->bf_count-range->first > DD_RANGE_BLOCKS) ? DD_RANGE_BLOCKS : sdbf->bf_count-range->first;
+    if( sdbf->buffer) {
+        range->window.buffer = sdbf->buffer + range->first*sdbf->bf_size;
+        range->window.elem_counts = sdbf->elem_counts + range->first;
+    } else {
+        if( !range->buffer) {
+            range->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, DD_RANGE_BLOCKS*sdbf->bf_size, "dd_range_start", "range->buffer", ERROR_EXIT);
+            range->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, DD_RANGE_BLOCKS*sizeof( uint16_t), "dd_range_start", "range->elem_counts", ERROR_EXIT);
+        }
+        range->window.buffer = range->buffer;
+        range->window.elem_counts = range->elem_counts;
+    }
+    pool_submit( &range->batch, &range->job, thread_dd_range, (void *)range, 0, 1);
+}
+
+/**
+ * Waits for the oldest range in flight & writes it out. Pages of a mapped image that are done with are dropped,
+ * so that the resident set does not grow with the image.
+ */
+static void dd_range_finish( dd_range_t *range, FILE *out, uint64_t page_size) {
+    dd_image_t *image = range->image;
+    uint64_t block_size = image->sdbf->dd_block_size;
+
+    pool_wait( &range->batch);
+    if( out) {
+        if( !range->first)
+            sdbf_dd_header_to_stream( image->sdbf, out);
+        sdbf_dd_blocks_to_stream( &range->window, out);
+    }
+    if( image->text_out) {
+        if( !range->first)
+            sdbf_dd_header_to_stream( image->sdbf, image->text_out);
+        sdbf_dd_blocks_to_stream( &range->window, image->text_out);
+        if( ftello( image->text_out) > CACHE_MAX_TEXT) {
+            fclose( image->text_out);
+            free( image->text);
+            image->text_out = NULL;
+        }
+    }
+    if( image->mfile->mapped) {
+        uint64_t start = (range->first*block_size + page_size-1) & ~(page_size-1);
+        uint64_t end = (range->first+range->window.bf_count)*block_size;
+        end = ((end < image->mfile->size) ? end : image->mfile->size) & ~(page_size-1);
+        if( end > start)
+            madvise( image->mfile->buffer+start, end-start, MADV_DONTNEED);
+    }
+    image->written++;
+}
+
+/**
+ * Hash a list of images with dd_block_size blocks, on the shared workers; the digests are written to out (in
+ * list order) or, if out is NULL, added to the set. Only images without a cached digest are read. Returns the
+ * number of digests.
+ */
+int dd_hash_files( char **filenames, uint32_t file_count, FILE *out, uint32_t dd_block_size) {
+    cache_key_t *keys = NULL;
+    char **misses = filenames;
+    uint32_t miss_cnt = file_count, next = 0;
+
+    if( sdbf_sys.cache) {
+        keys = (cache_key_t *)alloc_check( ALLOC_ZERO, file_count*sizeof( cache_key_t), "dd_hash_files", "keys", ERROR_EXIT);
+        misses = (char **)alloc_check( ALLOC_ONLY, file_count*sizeof( char *), "dd_hash_files", "misses", ERROR_EXIT);
+        for( next=0, miss_cnt=0; next<file_count; next++) {
+            if( !cache_find( sdbf_sys.cache, filenames[next], dd_block_size, keys+next))
+                misses[miss_cnt++] = filenames[next];
+        }
+        next = 0;
+    }
+    ingest_t *ing = ingest_open( misses, miss_cnt, sdbf_sys.read_ahead);
+    uint32_t ahead = DD_RANGES_AHEAD*(pool_size() ? pool_size() : 1), more = 1;
+    uint64_t img_head = 0, img_disp = 0, img_tail = 0, r_head = 0, r_tail = 0, i;
+    uint64_t page_size = sysconf( _SC_PAGESIZE);
+    int32_t  result = 0;
+
+    // Images held (up to the read-ahead depth) & ranges in flight, as rings: [head, tail)
+    dd_image_t *images = (dd_image_t *)alloc_check( ALLOC_ZERO, ing->depth*sizeof( dd_image_t), "dd_hash_files", "images", ERROR_EXIT);
+    dd_range_t *ranges = (dd_range_t *)alloc_check( ALLOC_ZERO, ahead*sizeof( dd_range_t), "dd_hash_files", "ranges", ERROR_EXIT);
+    while( 1) {
+        // Queue ranges of the current image, or of the next ones, while there is room
+        while( r_tail-r_head < ahead) {
+            if( img_disp == img_tail) {
+                if( !more || img_tail-img_head == ing->depth)
+                    break;
+                if( !dd_image_open( ing, filenames, file_count, keys, &next, images + img_tail % ing->depth, !out, dd_block_size)) {
+                    more = 0;
+                    break;
+                }
+                img_tail++;
+            }
+            dd_image_t *image = images + img_disp % ing->depth;
+            if( image->dispatched < image->range_cnt)
+                dd_range_start( ranges + r_tail++ % ahead, image);
+            if( image->dispatched == image->range_cnt)
+                img_disp++;
+        }
+        // Images all of whose ranges are written are done with (before any range of a later image is written)
+        while( img_head < img_disp && images[img_head % ing->depth].written == images[img_head % ing->depth].range_cnt) {
+            dd_image_t *image = images + img_head++ % ing->depth;
+            if( image->sdbf)
+                result++;
+            dd_image_finish( ing, image, out);
+        }
+        if( r_head < r_tail)
+            dd_range_finish( ranges + r_head++ % ahead, out, page_size);
+        if( !more && r_head == r_tail && img_head == img_tail)
+            break;
+    }
+    for( i=0; i<ahead; i++) {
+        free( ranges[i].buffer);
+        free( ranges[i].elem_counts);
+    }
+    free( ranges);
+    free( images);
+    ingest_close( ing);
+    if( keys) {
+        free( keys);
+        free( misses);
+    }
+    return result;
+}
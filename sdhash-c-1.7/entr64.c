@@ -4,7 +4,21 @@
 
 #include "sdbf.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define ENTR_X86_KERNELS
+#endif
+
 static uint64_t ENTROPY_64_INT[65];
+static int32_t  ENTROPY_64_INC[64];     // ENTROPY_64_INT[i+1] - ENTROPY_64_INT[i]
+
+// Active lane kernel for entr64_ranks(); NULL if only the byte-at-a-time version is available
+static void (*entr64_ranks_lanes)( const uint8_t *const *, uint32_t, uint16_t *const *) = NULL;
+
+static uint64_t entr64_flat_run_scalar( const uint8_t *buffer, uint64_t pos, uint64_t end, uint8_t c);
+
+// Active run kernel for entr64_flat_end()
+static uint64_t (*entr64_flat_run)( const uint8_t *, uint64_t, uint64_t, uint8_t) = entr64_flat_run_scalar;
 
 /**
  * Entropy lookup table setup--int64 version (to be called once)
@@ -16,6 +30,9 @@ void entr64_table_init_int() {
 		double p = (double)i/64;
 		ENTROPY_64_INT[i] = (uint64_t) ((-p*(log(p)/log(2))/6)*ENTR_SCALE);
 	}
+	for( i=0; i<64; i++)
+		ENTROPY_64_INC[i] = (int32_t)(ENTROPY_64_INT[i+1] - ENTROPY_64_INT[i]);
+	entr64_ranks_init();
 }
 
 /**
@@ -64,3 +81,310 @@ uint64_t entr64_inc_int( uint64_t prev_entropy, const uint8_t *buffer, uint8_t *
   return (uint64_t)entropy;
 }
 
+#ifdef ENTR_X86_KERNELS
+/**
+ * Rank kernel (AVX-512): ENTR_LANES sync blocks of block_size bytes, one per lane (in[lane] -> out[lane]).
+ * Every block restarts the entropy state, so the lanes are independent; each one runs exactly the 
+ * entr64_inc_int() recurrence (incl. clamping), with its own histogram. Lanes may repeat a block.
+ * Requires block_size % 64 == 0 and 64 readable bytes past the end of every block.
+ */
+__attribute__((target("avx512f")))
+static void entr64_ranks_avx512( const uint8_t *const *in, uint32_t block_size, uint16_t *const *out) {
+	uint32_t  ascii[256*ENTR_LANES] __attribute__((aligned(64)));     // [byte][lane] histograms
+	uint8_t   bytes[2][64*ENTR_LANES] __attribute__((aligned(64)));   // [step][lane] transposed input
+	uint16_t  tile[64*ENTR_LANES] __attribute__((aligned(64)));       // [step][lane] ranks
+	uint8_t   ascii_8[256];
+	int32_t   entr_0[ENTR_LANES];
+	uint32_t  i, l, k, cur;
+	uint64_t  pos;
+
+	bzero( ascii, sizeof( ascii));
+	for( l=0; l<ENTR_LANES; l++) {
+		const uint8_t *block = in[l];
+		for( i=0; i<64; i++) {
+			ascii[block[i]*ENTR_LANES+l]++;
+			bytes[0][i*ENTR_LANES+l] = block[i];
+		}
+		entr_0[l] = entr64_init_int( block, ascii_8);
+	}
+	const __m512i lane = _mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m512i zero = _mm512_setzero_si512(), one = _mm512_set1_epi32( 1), bit_5 = _mm512_set1_epi32( 32);
+	const __m512i scale = _mm512_set1_epi32( ENTR_SCALE);
+	const __m512i inc_0 = _mm512_loadu_si512( ENTROPY_64_INC),    inc_1 = _mm512_loadu_si512( ENTROPY_64_INC+16);
+	const __m512i inc_2 = _mm512_loadu_si512( ENTROPY_64_INC+32), inc_3 = _mm512_loadu_si512( ENTROPY_64_INC+48);
+	__m512i entropy = _mm512_loadu_si512( entr_0);
+	__m512i rank = _mm512_i32gather_epi32( _mm512_srli_epi32( entropy, ENTR_POWER), (const int *)ENTR64_RANKS, 4);
+	_mm256_store_si256( (__m256i *)tile, _mm512_cvtepi32_epi16( rank));
+
+	for( pos=1; pos<block_size; pos++) {
+		k = (pos-1) & 63;
+		cur = ((pos-1) >> 6) & 1;
+		// Transpose the bytes entering the windows over the next 64 steps; they leave again 64 steps later
+		if( k == 0) {
+			for( l=0; l<ENTR_LANES; l++) {
+				const uint8_t *next = in[l] + pos+63;
+				for( i=0; i<64; i++)
+					bytes[cur^1][i*ENTR_LANES+l] = next[i];
+			}
+		}
+		__m512i old_char = _mm512_cvtepu8_epi32( _mm_load_si128( (const __m128i *)(bytes[cur] + k*ENTR_LANES)));
+		__m512i new_char = _mm512_cvtepu8_epi32( _mm_load_si128( (const __m128i *)(bytes[cur^1] + k*ENTR_LANES)));
+		__mmask16 diff = _mm512_cmpneq_epi32_mask( old_char, new_char);
+		__m512i old_idx = _mm512_add_epi32( _mm512_slli_epi32( old_char, 4), lane);
+		__m512i new_idx = _mm512_add_epi32( _mm512_slli_epi32( new_char, 4), lane);
+		__m512i old_cnt = _mm512_mask_i32gather_epi32( one, diff, old_idx, (const int *)ascii, 4);
+		__m512i new_cnt = _mm512_mask_i32gather_epi32( zero, diff, new_idx, (const int *)ascii, 4);
+		old_cnt = _mm512_sub_epi32( old_cnt, one);
+		_mm512_mask_i32scatter_epi32( ascii, diff, old_idx, old_cnt, 4);
+		_mm512_mask_i32scatter_epi32( ascii, diff, new_idx, _mm512_add_epi32( new_cnt, one), 4);
+		// old_diff = INC[old_cnt-1], new_diff = INC[new_cnt]: 64-entry lookups from registers
+		__m512i old_diff = _mm512_mask_blend_epi32( _mm512_test_epi32_mask( old_cnt, bit_5),
+		                        _mm512_permutex2var_epi32( inc_0, old_cnt, inc_1), _mm512_permutex2var_epi32( inc_2, old_cnt, inc_3));
+		__m512i new_diff = _mm512_mask_blend_epi32( _mm512_test_epi32_mask( new_cnt, bit_5),
+		                        _mm512_permutex2var_epi32( inc_0, new_cnt, inc_1), _mm512_permutex2var_epi32( inc_2, new_cnt, inc_3));
+		entropy = _mm512_add_epi32( entropy, _mm512_maskz_sub_epi32( diff, new_diff, old_diff));
+		entropy = _mm512_min_epi32( _mm512_max_epi32( entropy, zero), scale);
+		rank = _mm512_i32gather_epi32( _mm512_srli_epi32( entropy, ENTR_POWER), (const int *)ENTR64_RANKS, 4);
+		_mm256_store_si256( (__m256i *)(tile + (pos & 63)*ENTR_LANES), _mm512_cvtepi32_epi16( rank));
+		if( (pos & 63) == 63) {
+			for( l=0; l<ENTR_LANES; l++)
+				for( i=0; i<64; i++)
+					out[l][pos-63+i] = tile[i*ENTR_LANES+l];
+		}
+	}
+}
+#endif
+
+/**
+ * Returns 1 if the 64 bytes at buffer all equal c (SSE2 where available: part of every x86-64 CPU).
+ */
+static inline int entr64_flat( const uint8_t *buffer, uint8_t c) {
+#ifdef ENTR_X86_KERNELS
+	const __m128i fill = _mm_set1_epi8( (char)c);
+	__m128i eq = _mm_and_si128( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)buffer), fill),
+	                            _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)(buffer+16)), fill));
+	eq = _mm_and_si128( eq, _mm_and_si128( _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)(buffer+32)), fill),
+	                                       _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)(buffer+48)), fill)));
+	return _mm_movemask_epi8( eq) == 0xFFFF;
+#else
+	uint64_t word, bits = 0, fill = 0x0101010101010101ULL*c;
+	uint32_t i;
+
+	for( i=0; i<64; i+=8) {
+		memcpy( &word, buffer+i, 8);
+		bits |= word ^ fill;
+	}
+	return !bits;
+#endif
+}
+
+/**
+ * Run kernel: skips the 64-byte stretches from pos on that are all c; returns the position of the first one
+ * that is not (or that would reach past end).
+ */
+static uint64_t entr64_flat_run_scalar( const uint8_t *buffer, uint64_t pos, uint64_t end, uint8_t c) {
+	for( ; pos+64<=end && entr64_flat( buffer+pos, c); pos+=64)
+		;
+	return pos;
+}
+
+#ifdef ENTR_X86_KERNELS
+/**
+ * Run kernel (AVX2): two 32-byte compares per stretch, 256 bytes per round while the run lasts.
+ */
+__attribute__((target("avx2")))
+static uint64_t entr64_flat_run_avx2( const uint8_t *buffer, uint64_t pos, uint64_t end, uint8_t c) {
+	const __m256i fill = _mm256_set1_epi8( (char)c);
+
+	for( ; pos+256<=end; pos+=256) {
+		__m256i eq = _mm256_and_si256( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos)), fill),
+		                               _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+32)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+64)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+96)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+128)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+160)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+192)), fill));
+		eq = _mm256_and_si256( eq, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+224)), fill));
+		if( _mm256_movemask_epi8( eq) != -1)
+			break;
+	}
+	// The stretch that ends the run (& the last ones before end)
+	for( ; pos+64<=end; pos+=64) {
+		__m256i eq = _mm256_and_si256( _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos)), fill),
+		                               _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)(buffer+pos+32)), fill));
+		if( _mm256_movemask_epi8( eq) != -1)
+			break;
+	}
+	return pos;
+}
+
+/**
+ * Run kernel (AVX-512BW): one 64-byte compare per stretch, 256 bytes per round while the run lasts.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t entr64_flat_run_avx512( const uint8_t *buffer, uint64_t pos, uint64_t end, uint8_t c) {
+	const __m512i fill = _mm512_set1_epi8( (char)c);
+
+	for( ; pos+256<=end; pos+=256) {
+		__mmask64 eq = _mm512_cmpeq_epi8_mask( _mm512_loadu_si512( buffer+pos), fill);
+		eq &= _mm512_cmpeq_epi8_mask( _mm512_loadu_si512( buffer+pos+64), fill);
+		eq &= _mm512_cmpeq_epi8_mask( _mm512_loadu_si512( buffer+pos+128), fill);
+		eq &= _mm512_cmpeq_epi8_mask( _mm512_loadu_si512( buffer+pos+192), fill);
+		if( eq != ~0ULL)
+			break;
+	}
+	for( ; pos+64<=end && _mm512_cmpeq_epi8_mask( _mm512_loadu_si512( buffer+pos), fill) == ~0ULL; pos+=64)
+		;
+	return pos;
+}
+#endif
+
+/**
+ * Selects the lane & run kernels supported by the CPU (called by entr64_table_init_int()).
+ */
+void entr64_ranks_init() {
+	entr64_ranks_lanes = NULL;
+	entr64_flat_run = entr64_flat_run_scalar;
+#ifdef ENTR_X86_KERNELS
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx512f"))
+		entr64_ranks_lanes = entr64_ranks_avx512;
+	if( __builtin_cpu_supports( "avx512bw"))
+		entr64_flat_run = entr64_flat_run_avx512;
+	else if( __builtin_cpu_supports( "avx2"))
+		entr64_flat_run = entr64_flat_run_avx2;
+#endif
+}
+
+/**
+ * Returns the end of the run of bytes equal to buffer[pos] that starts at pos (at most end).
+ */
+uint64_t entr64_flat_end( const uint8_t *buffer, uint64_t pos, uint64_t end) {
+	uint8_t c = buffer[pos];
+
+	for( pos=entr64_flat_run( buffer, pos, end, c); pos<end && buffer[pos]==c; pos++)
+		;
+	return pos;
+}
+
+/**
+ * Finds the runs of a single byte value in [begin, end) that are long enough to hold at least ENTR_FLAT_MIN
+ * whole 64-byte windows; every window inside such a run has zero entropy, i.e., rank 0. Stores the window 
+ * positions [flat[2*k], flat[2*k+1]) covered by each run (ascending, at most max_spans); returns the count. 
+ * The scan only looks at every 64th window, so it is cheap on any content; it need not be complete.
+ */
+static uint32_t entr64_flat_spans( const uint8_t *buffer, uint64_t begin, uint64_t end, uint64_t *flat, uint32_t max_spans) {
+	uint64_t pos, run, run_end, low = begin;
+	uint32_t cnt = 0;
+
+	for( pos=begin; pos+64<=end && cnt<max_spans; pos+=64) {
+		uint8_t c = buffer[pos];
+		if( !entr64_flat( buffer+pos, c))
+			continue;
+		for( run=pos; run>low && buffer[run-1]==c; run--)
+			;
+		run_end = entr64_flat_end( buffer, pos, end);
+		if( run_end-run >= 63+ENTR_FLAT_MIN) {
+			flat[2*cnt] = run;
+			flat[2*cnt+1] = run_end-63;
+			cnt++;
+		}
+		low = run_end;
+		pos = run_end-64;
+	}
+	return cnt;
+}
+
+/**
+ * Byte-at-a-time ranks for positions [pos, end) (resync at multiples of block_size); ranks[0] is position pos.
+ * Positions inside the flat spans are set to 0 without touching the data; the entropy state is recomputed
+ * after each span, which yields the same values as rolling through it (the rolling sums are exact).
+ */
+static void entr64_ranks_scalar( const uint8_t *buffer, uint64_t pos, uint64_t end, uint64_t entr_end, uint32_t block_size, 
+                                 const uint64_t *flat, uint32_t flat_cnt, uint16_t *ranks) {
+	uint64_t start = pos, stop, entropy = 0;
+	uint32_t f = 0;
+	uint8_t  ascii[256];
+	int      sync = 1;
+
+	// Positions without a full window (legacy: the last one that has one, too)
+	if( end > entr_end) {
+		stop = (pos > entr_end) ? pos : entr_end;
+		bzero( ranks+stop-start, (end-stop)*sizeof( uint16_t));
+		end = stop;
+	}
+	while( pos < end) {
+		for( ; f<flat_cnt && flat[2*f+1]<=pos; f++)
+			;
+		if( f<flat_cnt && flat[2*f]<=pos) {
+			stop = (flat[2*f+1] < end) ? flat[2*f+1] : end;
+			bzero( ranks+pos-start, (stop-pos)*sizeof( uint16_t));
+			pos = stop;
+			sync = 1;
+			continue;
+		}
+		stop = (f<flat_cnt && flat[2*f] < end) ? flat[2*f] : end;
+		for( ; pos<stop; pos++) {
+			// Initial/sync entropy calculation
+			if( sync || pos % block_size == 0) {
+				entropy = entr64_init_int( buffer+pos, ascii);
+				sync = 0;
+			}
+			// Incremental entropy update (much faster)
+			else
+				entropy = entr64_inc_int( entropy, buffer+pos-1, ascii);
+			ranks[pos-start] = ENTR64_RANKS[entropy >> ENTR_POWER];
+		}
+	}
+}
+
+/**
+ * Entropy ranks for positions [offset, offset+count) of a buffer; offset must be a multiple of block_size,
+ * the entropy resync interval. Positions without a full 64-byte window get rank 0.
+ * Runs of a single byte value are found first and get rank 0 directly (see entr64_flat_spans()). Complete 
+ * blocks that are mostly outside such runs go to the lane kernel, ENTR_LANES at a time; the rest of the 
+ * positions are done a byte at a time.
+ */
+void entr64_ranks( const uint8_t *buffer, uint64_t buffer_size, uint64_t offset, uint64_t count, uint32_t block_size, uint16_t *ranks) {
+	uint64_t end = offset+count, entr_end = (buffer_size > 64) ? buffer_size-64 : 0;
+	uint64_t scan_end = (end+63 < buffer_size) ? end+63 : buffer_size;
+	uint64_t flat[2*ENTR_FLAT_SPANS], pos, flat_pos;
+	const uint8_t *lane_in[ENTR_LANES];
+	uint16_t *lane_out[ENTR_LANES];
+	uint32_t lanes = 0, flat_cnt, f = 0, l;
+
+	flat_cnt = entr64_flat_spans( buffer, offset, scan_end, flat, ENTR_FLAT_SPANS);
+	if( !entr64_ranks_lanes || block_size % 64) {
+		entr64_ranks_scalar( buffer, offset, end, entr_end, block_size, flat, flat_cnt, ranks);
+		return;
+	}
+	for( pos=offset; pos<end; pos+=block_size) {
+		uint64_t block_end = (pos+block_size < end) ? pos+block_size : end;
+		// Number of window positions of the block that are covered by flat spans
+		for( ; f<flat_cnt && flat[2*f+1]<=pos; f++)
+			;
+		for( l=f, flat_pos=0; l<flat_cnt && flat[2*l]<block_end; l++)
+			flat_pos += ((flat[2*l+1] < block_end) ? flat[2*l+1] : block_end) - ((flat[2*l] > pos) ? flat[2*l] : pos);
+		if( block_end-pos < block_size || pos+block_size > entr_end || 2*flat_pos >= block_size) {
+			entr64_ranks_scalar( buffer, pos, block_end, entr_end, block_size, flat+2*f, flat_cnt-f, ranks+pos-offset);
+			continue;
+		}
+		lane_in[lanes] = buffer+pos;
+		lane_out[lanes] = ranks+pos-offset;
+		if( ++lanes == ENTR_LANES) {
+			entr64_ranks_lanes( lane_in, block_size, lane_out);
+			lanes = 0;
+		}
+	}
+	// Leftover blocks: the kernel takes as long for a few lanes as for all of them
+	if( 3*lanes >= 2*ENTR_LANES) {
+		for( l=lanes; l<ENTR_LANES; l++) {
+			lane_in[l] = lane_in[lanes-1];
+			lane_out[l] = lane_out[lanes-1];
+		}
+		entr64_ranks_lanes( lane_in, block_size, lane_out);
+	} else {
+		for( l=0; l<lanes; l++)
+			entr64_ranks_scalar( buffer, lane_in[l]-buffer, lane_in[l]-buffer+block_size, entr_end, block_size, NULL, 0, lane_out[l]);
+	}
+}
@@ -30,6 +30,12 @@ void *alloc_check( uint32_t alloc_type, uint64_t mem_bytes, const char *fun_name
 		case ALLOC_ZERO:
 			mem_chunk = calloc( 1, mem_bytes);
 			break;
+		case ALLOC_ALIGN:
+			if( posix_memalign( &mem_chunk, CACHE_LINE, mem_bytes ? mem_bytes : CACHE_LINE))
+				mem_chunk = NULL;
+			else
+				memset( mem_chunk, 0, mem_bytes);
+			break;
 		default:
 			return NULL;
 	}
@@ -0,0 +1,132 @@
+/**
+ * ingest.c: Read-ahead file ingestion. Reader threads read the files of a list, in order, into a ring of
+ * reusable buffers, staying up to the queue depth ahead of the consumer; large files are memory-mapped.
+ */
+
+#include "sdbf.h"
+
+extern sdbf_parameters_t sdbf_sys;
+
+/**
+ * Reader thread: claims the next file whose slot is free & reads it into the slot's buffer.
+ */
+static void *thread_ingest_reader( void *param) {
+    ingest_t *ing = (ingest_t *)param;
+    ingest_slot_t *slot;
+    uint32_t i;
+
+    pthread_mutex_lock( &ing->mutex);
+    while( 1) {
+        while( !ing->stop && ing->next_read < ing->file_count && ing->slots[ing->next_read % ing->depth].state != INGEST_FREE)
+            pthread_cond_wait( &ing->slot_free, &ing->mutex);
+        if( ing->stop || ing->next_read >= ing->file_count)
+            break;
+        i = ing->next_read++;
+        slot = ing->slots + i % ing->depth;
+        slot->state = INGEST_READING;
+        pthread_mutex_unlock( &ing->mutex);
+
+        // Standard input ('-') is left to the consumer
+        mapped_file_t *mfile = NULL;
+        if( strcmp( ing->filenames[i], STDIN_ARG))
+            mfile = read_file( ing->filenames[i], MIN_FILE_SIZE, sdbf_sys.warnings, INGEST_MAP_SIZE, &slot->buffer, &slot->buffer_cap);
+
+        pthread_mutex_lock( &ing->mutex);
+        slot->mfile = mfile;
+        slot->state = INGEST_READY;
+        if( ing->waiting)
+            pthread_cond_signal( &ing->file_ready);
+    }
+    pthread_mutex_unlock( &ing->mutex);
+    return NULL;
+}
+
+/**
+ * Start reading a list of files ahead of the consumer, with up to depth files in flight (0: INGEST_DEPTH).
+ */
+ingest_t *ingest_open( char **filenames, uint32_t file_count, uint32_t depth) {
+    ingest_t *ing = (ingest_t *)alloc_check( ALLOC_ZERO, sizeof( ingest_t), "ingest_open", "ing", ERROR_EXIT);
+    uint32_t t;
+
+    ing->filenames = filenames;
+    ing->file_count = file_count;
+    ing->depth = depth ? depth : INGEST_DEPTH;
+    ing->depth = (ing->depth < 2) ? 2 : ing->depth;
+    ing->slots = (ingest_slot_t *)alloc_check( ALLOC_ZERO, ing->depth*sizeof( ingest_slot_t), "ingest_open", "ing->slots", ERROR_EXIT);
+    ing->reader_cnt = (ing->depth-1 < INGEST_READERS) ? ing->depth-1 : INGEST_READERS;
+    pthread_mutex_init( &ing->mutex, NULL);
+    pthread_cond_init( &ing->slot_free, NULL);
+    pthread_cond_init( &ing->file_ready, NULL);
+    for( t=0; t<ing->reader_cnt; t++) {
+        if( pthread_create( &ing->readers[t], NULL, thread_ingest_reader, (void *)ing)) {
+            fprintf( stderr, "ERROR: Could not create thread.\n");
+            exit(-1);
+        }
+    }
+    return ing;
+}
+
+/**
+ * Next file, in list order: returns its index (-1 at the end of the list) & sets *mfile (NULL if the file
+ * is to be skipped). Files are handed back with ingest_release(), in the same order; the consumer may hold
+ * up to depth files, but must release one before the next call once it holds that many.
+ */
+int32_t ingest_next( ingest_t *ing, mapped_file_t **mfile) {
+    ingest_slot_t *slot;
+
+    pthread_mutex_lock( &ing->mutex);
+    if( ing->next_out >= ing->file_count) {
+        pthread_mutex_unlock( &ing->mutex);
+        *mfile = NULL;
+        return -1;
+    }
+    slot = ing->slots + ing->next_out % ing->depth;
+    while( slot->state != INGEST_READY) {
+        ing->waiting = 1;
+        pthread_cond_wait( &ing->file_ready, &ing->mutex);
+    }
+    ing->waiting = 0;
+    pthread_mutex_unlock( &ing->mutex);
+    *mfile = slot->mfile;
+    return ing->next_out++;
+}
+
+/**
+ * Hand back the oldest file returned by ingest_next() & not released yet; its buffer goes back to the readers.
+ */
+void ingest_release( ingest_t *ing) {
+    ingest_slot_t *slot = ing->slots + ing->next_release % ing->depth;
+
+    if( slot->mfile)
+        unmap_file( slot->mfile);
+    pthread_mutex_lock( &ing->mutex);
+    slot->mfile = NULL;
+    slot->state = INGEST_FREE;
+    ing->next_release++;
+    pthread_cond_signal( &ing->slot_free);
+    pthread_mutex_unlock( &ing->mutex);
+}
+
+/**
+ * Stop the readers & free the buffers (files not consumed yet are dropped).
+ */
+void ingest_close( ingest_t *ing) {
+    uint32_t t;
+
+    pthread_mutex_lock( &ing->mutex);
+    ing->stop = 1;
+    pthread_cond_broadcast( &ing->slot_free);
+    pthread_mutex_unlock( &ing->mutex);
+    for( t=0; t<ing->reader_cnt; t++)
+        pthread_join( ing->readers[t], NULL);
+    for( t=0; t<ing->depth; t++) {
+        if( ing->slots[t].mfile)
+            unmap_file( ing->slots[t].mfile);
+        free( ing->slots[t].buffer);
+    }
+    pthread_mutex_destroy( &ing->mutex);
+    pthread_cond_destroy( &ing->slot_free);
+    pthread_cond_destroy( &ing->file_ready);
+    free( ing->slots);
+    free( ing);
+}
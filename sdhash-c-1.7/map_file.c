@@ -7,46 +7,124 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "util.h"
 
 int fileno(FILE *stream);  // This should not be necessary but w/o it a warning is shown.
 
 /**
- * Open & memory-map a file (compile w/ -D_FILE_OFFSET_BITS=64)
+ * Open a file for hashing: it must be a regular file of at least min_file_size bytes. Returns an
+ * mfile with the descriptor & size set (buffer not set yet), or NULL if the file is to be skipped.
  */
-mapped_file_t *mmap_file( char *fname, int64_t min_file_size, uint32_t warnings) {
+static mapped_file_t *open_file( char *fname, int64_t min_file_size, uint32_t warnings) {
     mapped_file_t *mfile = (mapped_file_t *) alloc_check( ALLOC_ZERO, sizeof( mapped_file_t), "map_file", "mfile", ERROR_EXIT);
 	struct stat file_stat;
 
-	if( !( mfile->input = fopen( fname, "r"))) {
+	if( (mfile->fd = open( fname, O_RDONLY)) < 0) {
         if( warnings)
             fprintf( stderr, "Warning: Could not open file '%s'. Skipping.\n", fname);
+        free( mfile);
 		return NULL;
 	}
-	mfile->fd = fileno( mfile->input);
 	if( fstat( mfile->fd, &file_stat)) {
         if( warnings)
             fprintf( stderr, "Warning: Could not stat file '%s'. Skipping.\n", fname);
+        unmap_file( mfile);
 		return NULL;
 	}
     if( !S_ISREG( file_stat.st_mode)) {
 		if( warnings)
             fprintf( stderr, "Warning: '%s' is not a regular file. Skipping.\n", fname);
+        unmap_file( mfile);
 		return NULL;
     }
     if( file_stat.st_size < min_file_size) {
         if( warnings)
             fprintf( stderr, "Warning: File '%s' too small (%ld). Skipping.\n", fname, file_stat.st_size);
+        unmap_file( mfile);
 		return NULL;
 	}
-	mfile->buffer = mmap( 0, file_stat.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, mfile->fd, 0);
+    mfile->name = fname;
+	mfile->size = file_stat.st_size;
+    return mfile;
+}
+
+/**
+ * Map an opened file (read sequentially, so the kernel can read ahead aggressively).
+ */
+static mapped_file_t *map_opened( mapped_file_t *mfile) {
+	mfile->buffer = mmap( 0, mfile->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, mfile->fd, 0);
 	if( mfile->buffer == MAP_FAILED) {
         fprintf( stderr, "mmap() failed: %s.\n", strerror( errno));
-        free( mfile);
+        mfile->buffer = NULL;
+        unmap_file( mfile);
 		return NULL;
 	}
-    mfile->name = fname;
-	mfile->size = file_stat.st_size;
+    mfile->mapped = 1;
+    madvise( mfile->buffer, mfile->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise( mfile->buffer, mfile->size, MADV_HUGEPAGE);
+#endif
 	return mfile;
 }
+
+/**
+ * Open & memory-map a file (compile w/ -D_FILE_OFFSET_BITS=64)
+ */
+mapped_file_t *mmap_file( char *fname, int64_t min_file_size, uint32_t warnings) {
+    mapped_file_t *mfile = open_file( fname, min_file_size, warnings);
+    return mfile ? map_opened( mfile) : NULL;
+}
+
+/**
+ * Open & read a file into a reusable buffer (*buffer of *buffer_cap bytes, grown as needed); files larger than
+ * map_size are memory-mapped instead. The buffer is zero-padded to a page boundary past the data, as a mapping
+ * would be. The buffer stays with the caller: unmap_file() only releases the file.
+ */
+mapped_file_t *read_file( char *fname, int64_t min_file_size, uint32_t warnings, uint64_t map_size, uint8_t **buffer, uint64_t *buffer_cap) {
+    mapped_file_t *mfile = open_file( fname, min_file_size, warnings);
+    uint64_t pos, cap;
+    ssize_t  got;
+
+    if( !mfile)
+        return NULL;
+    if( mfile->size > map_size)
+        return map_opened( mfile);
+
+    cap = (mfile->size + FILE_PAGE_SIZE) & ~(uint64_t)(FILE_PAGE_SIZE-1);
+    if( cap > *buffer_cap) {
+        free( *buffer);
+        *buffer = (uint8_t *) alloc_check( ALLOC_ALIGN, cap, "read_file", "buffer", ERROR_EXIT);
+        *buffer_cap = cap;
+    }
+    for( pos=0; pos < mfile->size; pos += got) {
+        got = pread( mfile->fd, *buffer+pos, mfile->size-pos, pos);
+        if( got <= 0) {
+            if( got < 0 && errno == EINTR) {
+                got = 0;
+                continue;
+            }
+            if( warnings)
+                fprintf( stderr, "Warning: Could not read file '%s'. Skipping.\n", fname);
+            unmap_file( mfile);
+            return NULL;
+        }
+    }
+    memset( *buffer+mfile->size, 0, cap-mfile->size);
+    mfile->buffer = *buffer;
+    return mfile;
+}
+
+/**
+ * Release a file opened by mmap_file()/read_file(), along with its mfile.
+ */
+void unmap_file( mapped_file_t *mfile) {
+    if( mfile->mapped)
+        munmap( mfile->buffer, mfile->size);
+    if( mfile->input)
+        fclose( mfile->input);
+    else
+        close( mfile->fd);
+    free( mfile);
+}
@@ -31,11 +31,14 @@
 #ifndef __SDBF_H
 #define __SDBF_H
 
+#define MAX_ELEM_COUNT_DD   192     // Max elements per BF of dd digests (also made by dual runs)
+#define DUAL_DD_BLOCK       16      // dd block size (KB) of dual (stream + dd) runs
+
 #ifndef _MAX_ELEM_COUNT
     #ifndef _DD_BLOCK
         #define _MAX_ELEM_COUNT  160
     #else
-        #define _MAX_ELEM_COUNT  192
+        #define _MAX_ELEM_COUNT  MAX_ELEM_COUNT_DD
     #endif
 #endif
 
@@ -44,6 +47,8 @@
 #define DELIM_STRING     ":"
 #define MAGIC_DD        "sdbf-dd"
 #define MAGIC_STREAM    "sdbf"
+#define STDIN_ARG       "-"         // File argument for standard input (stream mode)
+#define STDIN_NAME      "stdin"     // Name of its digest
 #define MAX_MAGIC_HEADER 512
 #define SDBF_VERSION     2
 #define VERSION_INFO    "sdhash-1.7 by Vassil Roussev, Feb 2012"
@@ -53,17 +58,62 @@
 #define BINS                1000
 #define ENTR_POWER		    10		
 #define ENTR_SCALE		    (BINS*(1 << ENTR_POWER))
-#define MAX_FILES           1000000
+#define MAX_FILES           1000000 // Initial capacity of the SDBF set (it grows as needed)
 #define MAX_THREADS         512
 #define MIN_FILE_SIZE	    512
 #define MIN_ELEM_COUNT      6
 #define MIN_REF_ELEM_COUNT  64
 #define POP_WIN_SIZE        64
 #define SD_SCORE_SCALE      0.3
+#define SD_SCORE_CUT        -2      // Score of a pair abandoned as it cannot reach the min score of its context
+#define STREAM_CHUNK_SIZE   (32*MB) // Stream mode works on independent chunks of this size
+#define INGEST_DEPTH        8       // Default number of files read ahead of hashing (see ingest.c)
+#define INGEST_READERS      4       // Max reader threads per ingest_t
+#define INGEST_MAP_SIZE     (8*MB)  // Larger files are memory-mapped rather than read into a buffer
+#define WRITE_BUDGET        256     // Default memory (MB) for digests waiting to be written (see writer.c)
+#define DD_RANGE_BLOCKS     256     // dd blocks hashed (& written out) together (see dd_pipe.c)
+#define DD_RANGES_AHEAD     2       // dd ranges in flight per worker
+#define DD_DEDUP_SLOTS      4096    // Max slots of an image's table of hashed blocks (half of them are used)
+#define WALK_THREADS        4       // Directory walker threads (see walk.c)
+#define WALK_BUF_SIZE       (32*KB) // Directory entries read per call
+#define WALK_SEEN_INIT      4096    // Initial size of the walker's inode set (power of 2)
+#define INGEST_FREE         0       // ingest_slot_t states: free for the readers,
+#define INGEST_READING      1       // being read,
+#define INGEST_READY        2       // ready for (or held by) the consumer
+#define SCHED_FILE_NEW      0       // sched_file_t states: not mapped yet,
+#define SCHED_FILE_MAPPED   1       // mapped & being hashed in chunks,
+#define SCHED_FILE_DONE     2       // no chunk work left (failed or hashed as a whole)
 #define SYNC_SIZE           16384
+#define GEN_RING_SIZE       1024    // Rank/score ring used by the fused generation pass (power of 2)
+#define GEN_RING_MASK       (GEN_RING_SIZE-1)
+#define GEN_BATCH_SIZE      64      // Features hashed per feature hash batch call
+#define ENTR_LANES          16      // Sync blocks ranked side by side by entr64_ranks()
+#define BF_EST_MAX          256     // Element counts covered by the match estimate tables (see bf_est_table())
+#define CMP_REF_BLOCK       4       // Reference BFs compared against each target BF at once (bf_bitcount_cut_256_x4())
+#define CMP_TILE_BFS        1024    // Target BFs per tile (the parts of them touched stay in L2 across the references)
+#define CMP_REF_PANEL       32      // Reference BFs scored against all target tiles before the score bound is checked
+#define CMP_PREFETCH        4       // Target BFs prefetched ahead
+#define CMP_BLOCK_PAIRS     64      // Pairs per work unit of the pair-parallel comparison (see compare.c)
+#define CMP_WINDOW_PAIRS    (64*KB) // Pairs scored between two rounds of output
+#define CMP_SPLIT_WORK      (16*MB) // Pairs of at least this many BF comparisons are split across the workers instead
+#define ENTR_FLAT_MIN       256     // Min number of windows in a single-byte run for entr64_ranks() to skip it
+#define ENTR_FLAT_SPANS     64      // Max number of such runs per entr64_ranks() call
+#define GEN_MINQ_SIZE       128     // Run deque of the popularity scorer (power of 2, >= pop_win_size)
+#define GEN_MINQ_MASK       (GEN_MINQ_SIZE-1)
+#define STATE_TAIL_SIZE     8192    // Max bytes of the current chunk kept in an sdbf_update() resume state
+#define STATE_MAGIC         "sdbf-state"
+#define STATE_VERSION       2
+#define CACHE_MAGIC         "sdbf-cache"
+#define CACHE_VERSION       1
+#define CACHE_SAMPLE        (64*KB) // Bytes checksummed at each end of a file for cache validation (-K)
+#define CACHE_MAX_TEXT      (64*MB) // Larger digests are not cached
+#define CACHE_INDEX_INIT    4096    // Initial size of the cache index (power of 2)
+#define WATCH_DEBOUNCE_MS   500     // Watch mode: a file is hashed once it has not changed for this long
+#define WATCH_BUF_SIZE      (64*KB) // inotify events read per call
+#define WATCH_INDEX_INIT    1024    // Initial size of the index of waiting files (power of 2)
 
 // Command line options
-#define OPT_MAX       3
+#define OPT_MAX       5
 //
 #define OPT_MODE	  0
 #define MODE_GEN      0x01
@@ -75,6 +125,12 @@
 #define OPT_MAP       1
 #define FLAG_OFF      0x00
 #define FLAG_ON       0x01
+//
+#define OPT_DUAL      2
+//
+#define OPT_RECURSE   3
+//
+#define OPT_WATCH     4
 
 //
 // Ranks based on 6x100MB benchmark: txt, html, doc, xls, pdf, jpg
@@ -143,12 +199,18 @@ static const uint8_t BITS[] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
 
 static const uint32_t BF_CLASS_MASKS[] = { 0x7FF, 0x7FFF, 0x7FFFF, 0x7FFFFF, 0x7FFFFFF, 0xFFFFFFFF};
 
+// Feature hash functions (the digest header carries the name; digests of different kinds do not compare)
+#define HASH_SHA1       0
+#define HASH_XXH3       1
+#define HASH_COUNT      2
+extern const char *HASH_NAMES[];
+
 uint8_t bit_count_16[64*KB];
 
 // BF digest (SDBF) description
 typedef struct {
     int8_t   *name;          // Name (usually, source file)
-    uint32_t  bf_count;      // Number of BFs
+    uint64_t  bf_count;      // Number of BFs
     uint32_t  bf_size;       // BF size in bytes (==m/8)
     uint32_t  hash_count;    // Number of hash functions used (k)
     uint32_t  mask;          // Bit mask used (must agree with m)
@@ -159,8 +221,27 @@ typedef struct {
     uint16_t *hamming;	     // Hamming weight for each BF
     uint16_t *elem_counts;   // Individual elements counts for each BF (used in dd mode)
     uint32_t  dd_block_size; // Size of the base block in dd mode
+    uint32_t  hash_id;       // Feature hash function (HASH_*)
+    struct sdbf_state *state; // Resume state for sdbf_update() (NULL if none)
+    struct sdbf_summary *summary; // Bounds for the pair prefilter (computed with the Hamming weights)
 } sdbf_t;
 
+// Classes of BFs of a digest summary: all, those that are compared as reference BFs (MIN_ELEM_COUNT) & those that
+// are compared against by a reference digest of more than one BF (MIN_REF_ELEM_COUNT)
+#define SUM_ANY             0
+#define SUM_REF             1
+#define SUM_TGT             2
+#define SUM_CLASSES         3
+
+// Digest summary (compute_hamming()): no BF of the digest has a bit set outside of bits, or fewer bits or elements
+// than the min of its class; two summaries bound what the BFs of a pair of digests can score
+typedef struct sdbf_summary {
+    uint8_t  *bits;                 // OR of the BFs (the BF itself, for a digest of one BF)
+    uint64_t  count[SUM_CLASSES];   // BFs in each class
+    uint16_t  min_e[SUM_CLASSES];   // Min Hamming weight in each class
+    uint16_t  min_s[SUM_CLASSES];   // Min element count in each class
+} sdbf_summary_t;
+
 // SDHASH global parameters
 typedef struct {
 	uint32_t  thread_cnt;
@@ -173,28 +254,75 @@ typedef struct {
     int32_t   output_threshold;
     uint32_t  warnings;
     uint32_t  sample_size;
+    uint32_t  hash_id;      // Feature hash for new digests (HASH_*)
+    uint32_t  verbose;      // Print generation statistics to stderr
+    uint64_t  dd_block_cnt; // Stats: dd blocks generated (incl. reused ones)
+    uint64_t  dd_reuse_cnt; // Stats: dd blocks copied from an earlier block with the same contents
+    uint32_t  no_split;     // Do not split large files into chunk tasks (sdbf_hash_files)
+    uint32_t  read_ahead;   // Files read ahead of hashing (0: INGEST_DEPTH)
+    uint32_t  write_budget; // Memory for digests waiting to be written, in MB (0: WRITE_BUDGET)
+    uint32_t  write_any;    // Write digests in completion order rather than in input order
+    char     *cache_path;   // Digest cache file (NULL: none)
+    uint32_t  cache_verify; // Validate cached digests with a sampled content checksum, too
+    struct cache *cache;    // The open cache (NULL if none)
+    struct sdbf_ctx *ctx;   // Comparison context of these parameters (see sdbf_init())
 } sdbf_parameters_t;
 
-// P-threading task spesicification structure for matching SDBFs 
+// Scoring counters (sdbf_score_stats()): work done & skipped by early termination
+typedef struct {
+    uint64_t  pair_cnt;     // Pairs scored
+    uint64_t  cut_cnt;      // Pairs abandoned under the min score
+    uint64_t  skip_cnt;     // Pairs skipped by the prefilter (no BF pair can score)
+    uint64_t  full_cnt;     // Reference BFs whose scan stopped at a perfect match
+    uint64_t  bf_total;     // BF comparisons of the pairs scored
+    uint64_t  bf_cmp;       // BF comparisons done
+} cmp_stats_t;
+
+// P-threading task spesicification structure for matching SDBFs (a cache line each, so that the results of 
+// adjacent tasks do not share one)
 typedef struct {
 	uint32_t  tid;			// Thread id
 	uint32_t  tcount;		// Total thread count for the job
-    sem_t     sem_start;    // Starting semaphore (allows thread to enter iteration)
-    sem_t     sem_end;      // Ending semaphore (signals the end of an iteration)
 	sdbf_t   *ref_sdbf;  	// Reference SDBF
-	uint32_t  ref_index;	// Index of the reference BF
+	uint64_t  ref_index;	// Index of the reference BF
 	sdbf_t   *tgt_sdbf;		// Target SDBF
+	uint64_t  tgt_first;	// Part of the target BFs [tgt_first, tgt_end) (split pairs)
+	uint64_t  tgt_end;
+	double   *scores;		// Result: max score of each reference BF over the part (split pairs)
+	const struct bf_est *est;	// Match estimates (split pairs)
+	cmp_stats_t stats;		// Result: scoring counters of the part (split pairs)
 	double 	  result;		// Result: max score for the task
-} sdbf_task_t; 
+} __attribute__((aligned( CACHE_LINE))) sdbf_task_t; 
 
-// P-threading task specification file-parallel stream hashing 
-typedef struct {
-	uint32_t  tid;			// Thread id
-	uint32_t  tcount;		// Total thread count for the job
-    char    **filenames;    // Files to be hashed 
-    uint32_t  file_count;   // Total number of files 
-    uint32_t  hashed_count; // Result: total number of files actually hashed
-} filehash_task_t; 
+// Expected numbers of matching bits b/w m-bit filters with k hash functions, by their element counts
+typedef struct bf_est {
+    uint32_t  m, k;
+    uint16_t  est[BF_EST_MAX][BF_EST_MAX];
+    struct bf_est *next;
+} bf_est_t;
+
+// Comparison context (sdbf_ctx_create()): everything scoring reads, so that any number of threads can score
+// with it at once. Scratch space is the calling thread's own; split pairs run on the process-wide worker pool.
+typedef struct sdbf_ctx {
+    uint32_t  thread_cnt;       // Threads per comparison (more than one: pairs are split across the pool)
+    uint32_t  warnings;         // Print warnings
+    int32_t   output_threshold; // Min score printed by sdbf_compare_pairs()
+    int32_t   min_score;        // Pairs that cannot reach it may be abandoned (SD_SCORE_CUT); 0: all scores are exact
+    const bf_est_t *est;        // Match estimates of the default filter geometry
+} sdbf_ctx_t;
+
+// Worker pool job (see thread_pool.c): func( arg), counted against its batch
+typedef struct pool_job {
+    void   *(*func)( void *);
+    void     *arg;
+    struct pool_batch *batch;
+    struct pool_job   *next; // Next job in the pool queue
+} pool_job_t;
+
+// A set of jobs submitted together & waited for together
+typedef struct pool_batch {
+    uint32_t  pending;      // Jobs not finished yet
+} pool_batch_t;
 
 // P-threading task specification structure for block hashing 
 typedef struct {
@@ -204,8 +332,376 @@ typedef struct {
     uint64_t  file_size;    // File size (for the buffer) 
     uint64_t  block_size;   // Block size
 	sdbf_t   *sdbf;		    // Result SDBF
+    uint64_t *fp;           // Fingerprint of each block (2 words per block)
+    uint64_t *src;          // First block with the same contents (the block itself if none)
 } blockhash_task_t; 
 
+// Growable list of feature hashes (5 words each)
+typedef struct {
+    uint32_t *hashes;       // Feature hashes, in file order
+    uint64_t  count;        // Number of features
+    uint64_t  cap;          // Capacity (in features)
+} feat_list_t;
+
+// Digest cache: identity of a file, kind of digest & where its digest is in the cache file
+typedef struct {
+    uint64_t  dev;
+    uint64_t  ino;
+    uint64_t  kind;         // Digest parameters fingerprint (0: file cannot be cached)
+    uint64_t  size;
+    uint64_t  mtime_ns;
+    uint64_t  check;        // Sampled content checksum (0: none)
+    uint64_t  offset;       // Digest text in the cache file
+    uint64_t  length;       // Its length (0: empty index slot)
+    uint64_t  sum;          // Its checksum
+} cache_key_t;
+
+// Persistent digest cache (see cache.c)
+typedef struct cache {
+    int       fd;
+    char     *path;
+    uint32_t  verify;       // Compare sampled content checksums, too
+    cache_key_t *entries;   // Open-addressing index of the records, by file & kind
+    uint64_t  cap, count;
+    uint64_t  dead;         // Records replaced by newer ones
+    uint64_t  end;          // End of the records indexed (other processes may have appended more)
+    uint64_t  hit_cnt, miss_cnt, add_cnt;
+    pthread_mutex_t mutex;
+} cache_t;
+
+// File-parallel stream hashing (sdbf_hash_files): a file, split into chunk tasks if it is large
+typedef struct {
+    char     *filename;
+    uint64_t  size;         // File size when scheduled (stat)
+    uint32_t  chunk_count;  // Number of chunk tasks (0: the whole file is one task)
+    uint32_t  chunks_done;  // Chunk tasks finished
+    uint32_t  merged;       // Chunks merged into the SDBF so far (in file order)
+    int32_t   state;        // SCHED_FILE_*
+    mapped_file_t *mfile;   // Mapped by the first chunk task
+    sdbf_t   *sdbf;         // Result SDBF
+    uint64_t  buff_size;    // BF allocation of the SDBF (see gen_chunk_alloc())
+    feat_list_t *feats;     // Features of each chunk
+    uint8_t  *done;         // Per-chunk completion flags
+    cache_key_t key;        // Identity of the file in the digest cache
+    uint32_t  cached;       // Its digest is read from the cache
+    pthread_mutex_t mutex;
+} sched_file_t;
+
+// A unit of work for the file scheduler
+typedef struct {
+    uint32_t  file;         // Index of the file
+    uint32_t  chunk;        // Chunk number (split files only)
+    uint64_t  size;         // Bytes covered (the schedule is longest-first)
+    uint32_t  wave;         // Input order wave (ordered output: waves go first to last, longest-first within)
+} sched_task_t;
+
+// A file scheduler worker: owns a deque of tasks, which idle workers steal from
+typedef struct {
+    struct sched *sched;    // Scheduler
+    uint32_t  tid;          // Worker id
+    uint32_t *deque;        // Task numbers: [head, tail), largest first
+    uint32_t  head, tail;
+    pthread_mutex_t mutex;
+    uint64_t  task_cnt;     // Stats: tasks done
+    uint64_t  steal_cnt;    // Stats: tasks stolen from other workers
+    uint64_t  byte_cnt;     // Stats: bytes covered by the tasks done
+    uint64_t  busy_ns;      // Stats: time spent on tasks
+    uint8_t  *buffer;       // Reusable read buffer for whole-file tasks
+    uint64_t  buffer_cap;
+    uint32_t  hashed_count; // Result: number of files completed by this worker
+} sched_worker_t;
+
+// Work-stealing, longest-processing-time-first file scheduler for sdbf_hash_files()
+typedef struct sched {
+    sched_file_t   *files;
+    sched_task_t   *tasks;
+    sched_worker_t *workers;
+    uint32_t  worker_cnt;
+    struct writer *writer;  // Output writer (NULL: SDBFs are added to the set)
+} sched_t;
+
+// Pair-parallel comparison (sdbf_compare_pairs()): the pairs are (ref, tgt) for every reference digest ref in
+// [ref_first, ref_end) & target digest tgt in [tgt_first, tgt_end), or in (ref, tgt_end) for all-pairs (triangle)
+typedef struct {
+    uint32_t  ref_first, ref_end;   // Reference digests (set indexes)
+    uint32_t  tgt_first, tgt_end;   // Target digests (set indexes)
+    uint32_t  triangle;             // Each reference digest against the ones after it
+} cmp_pairs_t;
+
+// A pair of a comparison window & its result
+typedef struct {
+    uint32_t  ref, tgt;     // Set indexes
+    int32_t   score;        // Result: score
+    int32_t   swap;         // Result: the digests were swapped for scoring
+} cmp_pair_t;
+
+// A comparison worker: owns a deque of blocks of pairs, which idle workers steal from (a cache line apart)
+typedef struct {
+    struct cmp_run *run;    // Comparison run
+    uint32_t  tid;          // Worker id
+    uint32_t  head, tail;   // Blocks of the window: [head, tail)
+    pthread_mutex_t mutex;
+    uint64_t  pair_cnt;     // Stats: pairs scored
+    uint64_t  block_cnt;    // Stats: blocks done
+    uint64_t  steal_cnt;    // Stats: blocks stolen from other workers
+    cmp_stats_t stats;      // Stats: scoring
+} __attribute__((aligned( CACHE_LINE))) cmp_worker_t;
+
+// State of a pair-parallel comparison
+typedef struct cmp_run {
+    sdbf_ctx_t    ctx;      // Context of the workers (one thread per pair)
+    cmp_pair_t   *pairs;    // Current window
+    uint32_t      pair_cnt;
+    cmp_worker_t *workers;
+    uint32_t      worker_cnt;
+} cmp_run_t;
+
+// Read-ahead slot: a reusable buffer & the file read into it
+typedef struct {
+    int32_t   state;        // INGEST_*
+    mapped_file_t *mfile;   // File (NULL if it is to be skipped)
+    uint8_t  *buffer;       // Reusable read buffer
+    uint64_t  buffer_cap;   // Its capacity
+} ingest_slot_t;
+
+// Read-ahead ingestion of a list of files (files are handed out in list order)
+typedef struct {
+    char    **filenames;
+    uint32_t  file_count;
+    uint32_t  depth;        // Number of slots (files in flight)
+    ingest_slot_t *slots;   // File i goes to slot i % depth
+    uint32_t  next_read;    // Next file to be claimed by a reader
+    uint32_t  next_out;     // Next file to be handed to the consumer
+    uint32_t  next_release; // Oldest file held by the consumer
+    uint32_t  stop;
+    pthread_t readers[INGEST_READERS];
+    uint32_t  reader_cnt;
+    uint32_t  waiting;      // The consumer is waiting for a file
+    pthread_mutex_t mutex;
+    pthread_cond_t  slot_free;  // Signaled to the readers when a slot is released
+    pthread_cond_t  file_ready; // Signaled to the consumer when a file is ready
+} ingest_t;
+
+// Output writer: a dedicated thread writes the digests handed over by the hashing workers, in input order
+// (or in completion order), while the digests waiting to be written stay within a memory budget
+typedef struct writer {
+    FILE     *out;
+    sdbf_t  **slots;        // Digests by input position (ordered) or by arrival (in completion order)
+    uint8_t  *filled;       // Slot has been handed over (the digest may be NULL: file skipped)
+    uint32_t  count;        // Number of digests to come
+    uint32_t  next;         // Next slot to be written
+    uint32_t  arrived;      // Slots handed over so far
+    uint32_t  ordered;
+    uint32_t  producers;    // Number of threads handing over digests
+    uint32_t  blocked;      // Producers waiting for the budget
+    uint64_t  bytes;        // Memory held by the digests waiting to be written
+    uint64_t  budget;
+    uint64_t  peak;         // Stats: max bytes waiting
+    uint64_t  wait_cnt;     // Stats: times a producer had to wait
+    pthread_mutex_t mutex;
+    pthread_cond_t  ready;  // The next slot has been filled
+    pthread_cond_t  space;  // Digests have been written
+    pthread_t thread;
+} writer_t;
+
+// Directory waiting to be listed by a walker thread
+typedef struct walk_dir {
+    char     *path;
+    struct walk_dir *next;
+} walk_dir_t;
+
+// Identity of a directory or file (the walker visits each one once)
+typedef struct {
+    uint64_t  dev;
+    uint64_t  ino;
+} walk_id_t;
+
+// Parallel recursive traversal of directory trees: regular files are handed to the consumer in batches,
+// as they are found (see walk.c)
+typedef struct {
+    walk_dir_t *dirs;       // Directories waiting to be listed (LIFO)
+    uint32_t  busy;         // Walker threads listing a directory
+    uint32_t  done;         // Traversal complete
+    char    **names;        // Files found & not taken yet
+    uint64_t *sizes;        // Their sizes
+    uint32_t  file_count, file_cap;
+    walk_id_t *seen;        // Open-addressing set of visited directories & files
+    uint64_t  seen_count, seen_cap;
+    uint32_t  waiting;      // The consumer is waiting for files
+    pthread_mutex_t mutex;
+    pthread_cond_t  work;   // Directories queued (or traversal complete)
+    pthread_cond_t  found;  // Files found (or traversal complete)
+    pthread_t threads[WALK_THREADS];
+    uint32_t  thread_cnt;
+} walk_t;
+
+// Watch mode: a file waiting for its writes to settle
+typedef struct {
+    char     *path;
+    uint64_t  due;          // Time (ms) after which it is hashed, unless it changes again
+} watch_file_t;
+
+// Watch mode: a file whose digest was written out, in the state it was hashed in
+typedef struct {
+    uint64_t  dev;
+    uint64_t  ino;
+    uint64_t  size;
+    uint64_t  mtime, ctime; // ns
+} watch_emit_t;
+
+// Watch mode (see watch.c)
+typedef struct {
+    int       fd;           // inotify instance
+    char    **dirs;         // Path of each watch descriptor (NULL: none)
+    uint32_t  dir_cap;
+    watch_file_t *files;    // Files waiting to be hashed
+    uint32_t  file_count, file_cap;
+    uint32_t *index;        // Open-addressing index of the waiting files, by path (position+1; 0: empty)
+    uint32_t  index_cap;
+    uint32_t  gen_mode, dd_block_size, dual;
+    uint64_t  since;        // Start of the previous traversal (s; 0: none yet)
+    watch_emit_t *emitted;  // Open-addressing set of the files written out that changed since then (by identity)
+    uint64_t  emit_count, emit_cap;
+    uint64_t  batch_cnt, file_cnt, rescan_cnt; // Stats
+} watch_t;
+
+// Pipelined dd hashing: BFs of blocks hashed so far, by block fingerprint (entries are never changed once set)
+typedef struct {
+    uint64_t *fp;           // Fingerprint of each slot (2 words)
+    uint64_t *block;        // Block number + 1 (0: empty slot)
+    uint16_t *elem_counts;
+    uint8_t  *bfs;
+    uint64_t  mask;         // Number of slots - 1
+    uint64_t  count;        // Slots used
+    pthread_mutex_t mutex;
+} gen_dedup_t;
+
+// Pipelined dd hashing (see dd_pipe.c): an image in flight
+typedef struct {
+    mapped_file_t *mfile;   // Image (NULL if it is skipped)
+    sdbf_t   *sdbf;         // Its digest (just the header when streaming)
+    uint64_t  range_cnt;    // Number of ranges
+    uint64_t  dispatched;   // Ranges handed to the workers
+    uint64_t  written;      // Ranges written out (or in place)
+    gen_dedup_t dedup;      // Blocks hashed so far, for the following ranges
+    uint32_t  index;        // Position in the list
+    uint32_t  ingested;     // The image comes from the ingest queue (otherwise, it is mapped here)
+    cache_key_t key;        // Identity of the image in the digest cache
+    FILE     *text_out;     // Copy of the streamed digest, for the cache (NULL if none)
+    char     *text;
+    size_t    text_len;
+} dd_image_t;
+
+// Pipelined dd hashing: a range of up to DD_RANGE_BLOCKS blocks of an image, hashed by one pool job
+typedef struct {
+    dd_image_t  *image;
+    uint64_t     first;     // First block of the range
+    sdbf_t       window;    // The range's BFs (block numbers relative to first)
+    uint8_t     *buffer;    // BFs & element counts when streaming (reused by the following ranges)
+    uint16_t    *elem_counts;
+    pool_job_t   job;
+    pool_batch_t batch;
+} dd_range_t;
+
+// Block-aligned (dd) digest generated along with a stream digest, from the same ranks (dual runs)
+typedef struct {
+    sdbf_t   *sdbf;         // dd SDBF (BFs & element counts allocated for all blocks)
+    uint8_t  *buffer;       // File buffer
+    uint64_t  file_size;    // File size (for the buffer)
+    uint64_t  block_size;   // dd block size (divides both the rank stripe and the stream chunk size)
+    const uint64_t *src;    // First block with the same contents (the block itself if none)
+} gen_dual_t;
+
+// P-threading task specification structure for chunk-parallel stream hashing
+// (shared by all workers; chunks are claimed in order and merged in order)
+typedef struct {
+    uint8_t  *buffer;       // File buffer to be hashed 
+    uint64_t  file_size;    // File size (for the buffer) 
+    uint64_t  chunk_size;   // Chunk size
+    uint64_t  chunk_count;  // Total number of chunks
+    uint64_t  next_chunk;   // Next chunk to be claimed by a worker
+    uint64_t  merged;       // Number of chunks already merged into the SDBF
+    uint32_t  window;       // Max number of chunks in flight ahead of the merge
+    uint32_t  hash_id;      // Feature hash (HASH_*)
+    const gen_dual_t *dual; // dd digest generated along with the stream one (NULL if none)
+    feat_list_t *results;   // Per-chunk features (slot = chunk % window)
+    uint8_t  *done;         // Per-slot completion flags
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} chunkhash_task_t;
+
+// Monotonic deque of equal-rank runs (non-zero ranks only) for the popularity window minimum
+typedef struct {
+    uint64_t  end[GEN_MINQ_SIZE];   // Last position of each run
+    uint16_t  rank[GEN_MINQ_SIZE];  // Rank of each run (non-decreasing from head to tail)
+    uint64_t  head, tail;           // Live runs are [head, tail)
+    uint64_t  next;                 // Next position to be pushed
+} gen_minq_t;
+
+// Scorer loop position of the fused generation pass (a pass may be suspended & resumed, see gen_pass_run())
+typedef struct {
+    uint64_t  i;            // Next window to be scored
+    uint64_t  min_pos;      // Position of the minimum rank of the last window
+    uint16_t  min_rank;     // Minimum rank of the last window
+    uint8_t   started;      // The first ranks have been generated
+    uint8_t   sliding;      // Suspended in the middle of a cheap slide
+} gen_loop_t;
+
+// Per-thread scratch space for the fused generation pass (reused across files)
+typedef struct gen_scratch {
+    uint16_t  ranks[GEN_RING_SIZE];  // Ring of entropy ranks [pos, rank_end)
+    uint16_t  scores[GEN_RING_SIZE]; // Ring of popularity scores [emit_pos, rank_end)
+    uint16_t *stripe;                // Ranks of the current stripe of sync blocks [stripe_pos, stripe_end)
+    uint64_t  stripe_cap;            // Capacity of stripe
+    uint64_t  stripe_pos, stripe_end;
+    uint64_t  rank_end;              // Number of ranks generated so far in the chunk
+    uint64_t  emit_pos;              // Number of final scores handed over so far
+    gen_minq_t minq;                 // Popularity window minimum
+    gen_loop_t loop;                 // Scorer loop position
+    uint64_t  base;                  // Chunk position of the first byte of the buffer passed in (resumed passes)
+    uint16_t *block_scores;          // Full score array for a block (dd mode)
+    uint64_t  block_cap;             // Capacity of block_scores
+    const uint8_t *feat_data[GEN_BATCH_SIZE];    // Selected features waiting to be hashed
+    uint32_t  feat_hash[5*GEN_BATCH_SIZE];       // SHA1 hashes of the batch
+    uint32_t  feat_cnt;                          // Number of features in the batch
+    uint32_t  hash_id;                           // Feature hash (HASH_*) for the batch
+    feat_list_t *feat_out;                       // If set, hashes are collected here instead of inserted
+    const gen_dual_t *dual;                      // If set, dd blocks are generated from each new stripe
+    uint64_t  dual_pos;                          // File position of the current chunk (dual runs)
+    struct gen_scratch *dual_scratch;            // Scratch space for the dd blocks (dual runs)
+    const uint16_t *rank_src;                    // If set, ranks of the chunk are copied from here (dual runs)
+} gen_scratch_t;
+
+// Per-thread scratch space for tiled digest comparison (grows as needed)
+typedef struct cmp_scratch {
+    uint64_t *ref_idx;               // Reference BFs with enough elements to be compared
+    double   *scores;                // Max score of each reference BF
+    uint64_t *tgt_idx;               // Target BFs to compare against
+    uint16_t *tgt_elem;              // Element counts of the target BFs
+    uint16_t *tgt_hamming;           // Hamming weights of the target BFs
+    uint64_t  ref_cap, tgt_cap;      // Capacities
+    cmp_stats_t stats;               // Scoring counters of the thread
+} cmp_scratch_t;
+
+// Resume state of a stream SDBF built with sdbf_update(): the fused pass over the current chunk (suspended
+// where it would need ranks of windows that reach past the data) & the digest as of the last complete feature
+typedef struct sdbf_state {
+    uint64_t  total;                    // Bytes hashed so far
+    uint64_t  chunk_len;                // Bytes of the current chunk so far
+    uint64_t  tail_pos;                 // Chunk position of tail[0]; tail holds the bytes [tail_pos, chunk_len)
+    uint8_t   tail[STATE_TAIL_SIZE];
+    uint16_t  ranks[GEN_RING_SIZE];     // Fused pass state (see gen_scratch_t)
+    uint16_t  scores[GEN_RING_SIZE];
+    gen_minq_t minq;
+    gen_loop_t loop;
+    uint64_t  rank_end;
+    uint64_t  emit_pos;
+    uint64_t  bf_count;                 // Digest before the current chunk is finished off: BF count,
+    uint64_t  last_count;               // element count of the last BF
+    uint8_t   last_bf[BF_SIZE];         // & the last BF itself
+    uint64_t  buff_size;                // BF allocation of the SDBF (0: unknown, e.g., after sdbf_state_read())
+} sdbf_state_t;
+
 // sdbf_api.c: Top-level API
 // ------------------------- 
 int   	sdbf_init(); 
@@ -213,8 +709,15 @@ void  	sdbf_finalize();
 int  	sdbf_free( sdbf_t *sdbf);
 sdbf_t *sdbf_hashfile( char *filename, uint32_t dd_block_size);
 sdbf_t *sdbf_hash_buffer( uint8_t *buffer, uint64_t buffer_size, char *name);
+sdbf_t *sdbf_hash_fd( int fd, char *name);
+int     sdbf_update( sdbf_t *sdbf, const uint8_t *data, uint64_t len);
+int     sdbf_state_write( sdbf_t *sdbf, FILE *out);
+int     sdbf_state_read( sdbf_t *sdbf, FILE *in);
 int     sdbf_hash_files( char **filenames, uint32_t file_count, uint32_t gen_mode);
 int     sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t gen_mode, uint32_t dd_block_size);
+int     sdbf_hash_files_dual( char **filenames, uint32_t file_count, uint32_t gen_mode, uint32_t dd_block_size);
+int     sdbf_hash_batch( char **names, const uint64_t *sizes, uint32_t count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual);
+int     sdbf_hash_tree( char **paths, uint32_t path_count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual);
 sdbf_t *sdbf_hash_dd( char *filename, uint32_t dd_block_size);
 
 sdbf_t *sdbf_create( char *name);
@@ -228,40 +731,130 @@ int     sdbf_compare( uint32_t index1, uint32_t index2, uint32_t map_on, int *sw
 char   *sdbf_encode( sdbf_t *sdbf);
 sdbf_t *sdbf_decode( char *sdbf_b64);
 void 	sdbf_to_stream( sdbf_t *sdbf, FILE *out);
+void    sdbf_dd_header_to_stream( sdbf_t *sdbf, FILE *out);
+void    sdbf_dd_blocks_to_stream( sdbf_t *sdbf, FILE *out);
+sdbf_t *sdbf_create_dd( char *name, uint64_t file_size, uint32_t dd_block_size, uint32_t max_elem, uint32_t alloc);
+sdbf_t *sdbf_from_stream( FILE *in);
 int     sdbf_load( const char *fname);
+int     sdbf_hash_lookup( const char *hash_name);
 
 // sdbf_core.c: Core SDBF generation/comparison functions
 // ------------------------------------------------------
-void 	gen_chunk_scores( const uint16_t *chunk_ranks, const uint64_t chunk_size, uint16_t *chunk_scores, int32_t *score_histo);
-void gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint16_t *chunk_scores, const uint64_t chunk_size, sdbf_t *sdbf);
+gen_scratch_t *gen_scratch_get();
+void    gen_chunk_pass( uint8_t *chunk, const uint64_t chunk_size, gen_scratch_t *scratch, sdbf_t *sdbf);
+void    gen_pass_reset( gen_scratch_t *scratch, sdbf_t *sdbf);
+int     gen_pass_run( uint8_t *chunk, const uint64_t chunk_size, uint64_t rank_final, gen_scratch_t *scratch, sdbf_t *sdbf);
+int     gen_stream_update( sdbf_t *sdbf, sdbf_state_t *state, const uint8_t *data, uint64_t len);
+int     gen_state_check( const sdbf_state_t *state, const sdbf_t *sdbf);
 void gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_num, const uint16_t *chunk_scores, const uint64_t block_size,  
                      sdbf_t *sdbf, uint32_t rem, uint32_t threshold, int32_t allowed);
+uint64_t gen_chunk_alloc( uint64_t file_size, sdbf_t *sdbf);
+uint64_t gen_chunk_grow( sdbf_t *sdbf, uint64_t buff_size, uint64_t chunk_size);
+void    gen_chunk_finish( sdbf_t *sdbf, uint64_t buff_size);
+void    gen_chunk_feats( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, uint64_t chunk, uint32_t hash_id, feat_list_t *feats);
+void    gen_chunk_merge( sdbf_t *sdbf, const feat_list_t *feats);
 sdbf_t *gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf);
+sdbf_t *gen_chunk_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf, uint32_t thread_cnt);
 sdbf_t *gen_block_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, sdbf_t *sdbf);
 sdbf_t *gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, sdbf_t *sdbf, uint32_t thread_cnt);
+void    gen_block_range( uint8_t *file_buffer, uint64_t file_size, uint64_t first, sdbf_t *window, gen_dedup_t *dedup);
+void    gen_dedup_init( gen_dedup_t *dedup, uint64_t block_cnt, uint32_t bf_size);
+void    gen_dedup_free( gen_dedup_t *dedup);
+sdbf_t *gen_dual_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, sdbf_t *sdbf, sdbf_t *dd_sdbf, uint64_t dd_block_size, uint32_t thread_cnt);
+sdbf_ctx_t *sdbf_ctx_create( uint32_t thread_cnt);
+void    sdbf_ctx_free( sdbf_ctx_t *ctx);
 int     sdbf_score( sdbf_t *sd_1, sdbf_t *sd_2, uint32_t map_on, int *swap);
+int     sdbf_score_ctx( const sdbf_ctx_t *ctx, sdbf_t *sd_1, sdbf_t *sd_2, uint32_t map_on, int *swap);
+void    sdbf_score_stats( cmp_stats_t *stats);
+void    cmp_stats_add( cmp_stats_t *stats, const cmp_stats_t *from);
 int     sdbf_score2( sdbf_t *sd_1, sdbf_t *sd_2, uint32_t thread_cnt);
 double  sdbf_max_score( sdbf_task_t *task, uint32_t map_on);
 double  sdbf_max_score2( sdbf_task_t *task);
 sdbf_t *sdbf_compress( sdbf_t *base, uint8_t factor);
 
+// ingest.c: Read-ahead file ingestion
+// ------------------------------------
+ingest_t *ingest_open( char **filenames, uint32_t file_count, uint32_t depth);
+int32_t   ingest_next( ingest_t *ing, mapped_file_t **mfile);
+void      ingest_release( ingest_t *ing);
+void      ingest_close( ingest_t *ing);
+
+// writer.c: Ordered output of digests
+// -----------------------------------
+writer_t *writer_open( FILE *out, uint32_t count, uint32_t producers, uint32_t ordered, uint64_t budget);
+void      writer_put( writer_t *writer, uint32_t index, sdbf_t *sdbf);
+void      writer_close( writer_t *writer);
+
+// walk.c: Parallel directory traversal
+// ------------------------------------
+walk_t   *walk_open( char **paths, uint32_t path_count);
+uint32_t  walk_take( walk_t *walk, char ***names, uint64_t **sizes);
+void      walk_close( walk_t *walk);
+
+// dd_pipe.c: Pipelined dd hashing
+// --------------------------------
+int       dd_hash_files( char **filenames, uint32_t file_count, FILE *out, uint32_t dd_block_size);
+
+// cache.c: Persistent digest cache
+// ---------------------------------
+cache_t  *cache_open( char *path, uint32_t verify);
+int       cache_find( cache_t *cache, char *filename, uint32_t dd_block_size, cache_key_t *key);
+sdbf_t   *cache_load( cache_t *cache, const cache_key_t *key, char *filename);
+void      cache_put( cache_t *cache, cache_key_t *key, char *filename, const char *text, uint64_t length);
+void      cache_put_sdbf( cache_t *cache, cache_key_t *key, char *filename, sdbf_t *sdbf);
+void      cache_close( cache_t *cache);
+
+// watch.c: Watch mode
+// --------------------
+int       watch_files( char **paths, uint32_t path_count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual);
+
+// compare.c: Pair-parallel comparison
+// -----------------------------------
+uint64_t sdbf_compare_pairs( const sdbf_ctx_t *ctx, const cmp_pairs_t *pairs, uint32_t map_on);
+
+// thread_pool.c: Process-wide worker pool
+// ----------------------------------------
+int      pool_init( uint32_t thread_cnt);
+void     pool_finalize();
+uint32_t pool_size();
+void     pool_submit( pool_batch_t *batch, pool_job_t *jobs, void *(*func)( void *), void *args, size_t arg_size, uint32_t cnt);
+void     pool_wait( pool_batch_t *batch);
+void     pool_run( void *(*func)( void *), void *args, size_t arg_size, uint32_t cnt);
+
 // entr64.c: 64-byte window functions
 // --------------------------------
 void     entr64_table_init_int();
 uint64_t entr64_init_int( const uint8_t *buffer, uint8_t *ascii);
 uint64_t entr64_inc_int( uint64_t entropy, const uint8_t *buffer, uint8_t *ascii);
+void     entr64_ranks_init();
+uint64_t entr64_flat_end( const uint8_t *buffer, uint64_t pos, uint64_t end);
+void     entr64_ranks( const uint8_t *buffer, uint64_t buffer_size, uint64_t offset, uint64_t count, uint32_t block_size, uint16_t *ranks);
 
 // bf_utils.c: bit manipulation
 // ----------------------------
 void     init_bit_count_16();
+void     bf_bitcount_init();
 int 	 compute_hamming( sdbf_t *sdbf);
+void     free_hamming( sdbf_t *sdbf);
 uint32_t bf_bitcount( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t bf_size);
 uint32_t bf_bitcount_cut_256( uint8_t *bfilter_1, uint8_t *bfilter_2, uint32_t cut_off, int32_t slack);
+void     bf_bitcount_cut_256_x4( uint8_t **bfilters_1, uint8_t *bfilter_2, const uint32_t *cut_offs, int32_t slack, uint32_t *results);
 uint32_t bf_sha1_insert( uint8_t *bf, uint8_t bf_class, uint32_t *sha1_hash);
 uint32_t bf_match_est( uint32_t m, uint32_t k, uint32_t s1, uint32_t s2, uint32_t common);
+const bf_est_t *bf_est_table( uint32_t m, uint32_t k);
 int32_t  get_elem_count( sdbf_t *sdbf, uint64_t index);
 void     bf_merge( uint32_t *base, uint32_t *overlay, uint32_t size);
 
+// sha1_mb.c: Batched SHA1 for 64-byte features
+// ---------------------------------------------
+void     sha1_batch_init();
+void     sha1_batch_64( const uint8_t **data, uint32_t count, uint32_t *hashes);
+
+// xxh3.c: Fast feature hash for the xxh3 digest variant, block fingerprints
+// -------------------------------------------------------------------------
+void     xxh3_batch_64( const uint8_t **data, uint32_t count, uint32_t *hashes);
+void     xxh3_fingerprint( const uint8_t *data, uint64_t len, uint64_t *fp);
+
 // base64.c: Base64 encoding/decoding
 // ----------------------------------
 char     *b64encode(const char *input, int length);
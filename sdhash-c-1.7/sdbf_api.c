@@ -11,24 +11,33 @@ extern sdbf_parameters_t sdbf_sys;
 // State
 static sdbf_t **sdbf_list = NULL;
 static uint32_t curr_sdbf = 0;
+static uint32_t sdbf_cap = 0;
 static pthread_mutex_t set_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * Initialization of SDBF structures. Must be called once before the remaining sdbf functions are used.
+ * Initialization of SDBF structures. Must be called once before the remaining sdbf functions are used;
+ * starts the worker pool for sdbf_sys.thread_cnt & sets up the comparison context of sdbf_sys (sdbf_sys.ctx).
  */
 int sdbf_init() {
 	sdbf_list = (sdbf_t **)alloc_check( ALLOC_ZERO, (MAX_FILES*sizeof( sdbf_t **)), "sdbf_init", "sdbf_list", ERROR_EXIT);
+    sdbf_cap = MAX_FILES;
     entr64_table_init_int();
 	init_bit_count_16();
+	bf_bitcount_init();
+	sha1_batch_init();
+	sdbf_sys.ctx = sdbf_ctx_create( sdbf_sys.thread_cnt);
 	return 0;
 }
 
 /**
- * Frees up SDBF structures. 
+ * Frees up SDBF structures & stops the worker pool. 
  */
 void sdbf_finalize() {
 	if( sdbf_list)
 		free( sdbf_list);
+    sdbf_ctx_free( sdbf_sys.ctx);
+    sdbf_sys.ctx = NULL;
+    pool_finalize();
 }
 
 /**
@@ -36,9 +45,19 @@ void sdbf_finalize() {
  * Todo: sdbf_add() --> reimplement
  */
 int sdbf_add( sdbf_t *sdbf) {
-	assert( sdbf_list && curr_sdbf < MAX_FILES);
+	assert( sdbf_list);
+    // Set members are compared by any number of threads at once: their Hamming weights are in place beforehand
+    compute_hamming( sdbf);
 
     pthread_mutex_lock( &set_mutex);	
+        if( curr_sdbf == sdbf_cap) {
+            sdbf_cap *= 2;
+            sdbf_list = (sdbf_t **)realloc_check( sdbf_list, sdbf_cap*sizeof( sdbf_t *));
+            if( !sdbf_list) {
+                fprintf( stderr, "ERROR: Could not grow the SDBF set.\n");
+                exit(-1);
+            }
+        }
         sdbf_list[curr_sdbf] = sdbf;
         curr_sdbf++;
     pthread_mutex_unlock( &set_mutex);	
@@ -73,13 +92,14 @@ int sdbf_remove( char *sdbf_name) {
 sdbf_t *sdbf_lookup( sdbf_t *query, int threshold, int *result) {
 	if( query->hamming == NULL)
 		compute_hamming( query);
-	int i, score, *swap;
-	for( i=0; i<curr_sdbf; i++)
-		score = sdbf_score( query, sdbf_list[i], FLAG_OFF, swap);
+	int i, score, swap;
+	for( i=0; i<curr_sdbf; i++) {
+		score = sdbf_score( query, sdbf_list[i], FLAG_OFF, &swap);
 		if( score >= threshold) {
 			*result = score;
 			return sdbf_list[i];
 		}
+	}
 	return NULL;
 }
 
@@ -124,12 +144,13 @@ int sdbf_compare( uint32_t index1, uint32_t index2, uint32_t map_on, int *swap)
  */
 int sdbf_free( sdbf_t *sdbf) {
 	if( sdbf) {
+        free_hamming( sdbf);
         if( sdbf->buffer)
             free( sdbf->buffer);
-        if( sdbf->hamming)
-            free( sdbf->hamming);
         if( sdbf->elem_counts)
             free( sdbf->elem_counts);
+        if( sdbf->state)
+            free( sdbf->state);
 		free( sdbf);
 		return 0;
 	}
@@ -137,35 +158,67 @@ int sdbf_free( sdbf_t *sdbf) {
 }
 
 /**
- * Compute SD for a file.
+ * Create a block-aligned (dd) SDBF for a buffer of file_size bytes, with all of its BFs allocated (empty) or,
+ * if alloc is not set, just the header (BFs streamed out by ranges, see dd_pipe.c).
  */
-sdbf_t *sdbf_hashfile( char *filename, uint32_t dd_block_size) {
-    mapped_file_t *mfile = mmap_file( filename, MIN_FILE_SIZE, sdbf_sys.warnings);
-    if( !mfile)
-        return NULL;
-    sdbf_t *sdbf = sdbf_create( filename);
-    if( !sdbf)
-        return NULL;
+sdbf_t *sdbf_create_dd( char *name, uint64_t file_size, uint32_t dd_block_size, uint32_t max_elem, uint32_t alloc) {
+    uint64_t dd_block_cnt = file_size/dd_block_size;
+    if( file_size % dd_block_size >= MIN_FILE_SIZE)
+       dd_block_cnt++;
+
+	sdbf_t *sdbf = (sdbf_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_t), "sdbf_create_dd", "sdbf", ERROR_EXIT);
+	sdbf->name = name;
+	sdbf->bf_size = sdbf_sys.bf_size;
+	sdbf->hash_count = 5;
+	sdbf->mask = BF_CLASS_MASKS[0];
+	sdbf->hash_id = sdbf_sys.hash_id;
+	sdbf->max_elem = max_elem;
+	sdbf->bf_count = dd_block_cnt;
+    sdbf->dd_block_size = dd_block_size;
+	if( !alloc)
+		return sdbf;
+	sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, dd_block_cnt*sdbf_sys.bf_size, "sdbf_create_dd", "sdbf->buffer", ERROR_EXIT);
+	sdbf->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, sizeof( uint16_t)*dd_block_cnt, "sdbf_create_dd", "sdbf->elem_counts", ERROR_EXIT);
+    return sdbf;
+}
+
+/**
+ * Compute SD for an opened file, using up to thread_cnt threads for the file itself.
+ */
+static sdbf_t *sdbf_hash_mfile( mapped_file_t *mfile, uint32_t dd_block_size, uint32_t thread_cnt) {
+    sdbf_t *sdbf;
 
     // Stream-mode fork
     if( !dd_block_size) {
-        gen_chunk_sdbf( mfile->buffer, mfile->size, 32*MB, sdbf);	
+        sdbf = sdbf_create( mfile->name);
+        gen_chunk_sdbf_mt( mfile->buffer, mfile->size, STREAM_CHUNK_SIZE, sdbf, thread_cnt);	
     // Block-mode fork
     } else {
-        uint64_t dd_block_cnt =  mfile->size/dd_block_size;
-        if( mfile->size % dd_block_size >= MIN_FILE_SIZE)
-            dd_block_cnt++;
-        sdbf->bf_count = dd_block_cnt;
-        sdbf->dd_block_size = dd_block_size;
-        sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ZERO, dd_block_cnt*sdbf_sys.bf_size, "sdbf_hash_dd", "sdbf->buffer", ERROR_EXIT);
-        sdbf->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, sizeof( uint16_t)*dd_block_cnt, "sdbf_hash_dd", "sdbf->elem_counts", ERROR_EXIT);
-        gen_block_sdbf_mt( mfile->buffer, mfile->size, dd_block_size, sdbf, sdbf_sys.thread_cnt);	
+        sdbf = sdbf_create_dd( mfile->name, mfile->size, dd_block_size, sdbf_sys.max_elem, 1);
+        gen_block_sdbf_mt( mfile->buffer, mfile->size, dd_block_size, sdbf, thread_cnt);	
     }  
-	munmap( mfile->buffer, mfile->size);
-    fclose( mfile->input);
 	return sdbf;
 }
 
+/**
+ * Compute SD for a file, using up to thread_cnt threads for the file itself.
+ */
+static sdbf_t *sdbf_hashfile_mt( char *filename, uint32_t dd_block_size, uint32_t thread_cnt) {
+    mapped_file_t *mfile = mmap_file( filename, MIN_FILE_SIZE, sdbf_sys.warnings);
+    if( !mfile)
+        return NULL;
+    sdbf_t *sdbf = sdbf_hash_mfile( mfile, dd_block_size, thread_cnt);
+    unmap_file( mfile);
+	return sdbf;
+}
+
+/**
+ * Compute SD for a file.
+ */
+sdbf_t *sdbf_hashfile( char *filename, uint32_t dd_block_size) {
+    return sdbf_hashfile_mt( filename, dd_block_size, sdbf_sys.thread_cnt);
+}
+
 /**
  * Compute stream SD for a (presumably small) memory buffer.
  */
@@ -173,67 +226,437 @@ sdbf_t *sdbf_hash_buffer( uint8_t *buffer, uint64_t buffer_size, char *name) {
     sdbf_t *sdbf = sdbf_create( name);
     if( !sdbf)
         return NULL;
-    gen_chunk_sdbf( buffer, buffer_size, 32*MB, sdbf);	
+    gen_chunk_sdbf( buffer, buffer_size, STREAM_CHUNK_SIZE, sdbf);	
 	return sdbf;
 }
 
 /**
- * Threading envelope for sdbf_hashfile
+ * Compute stream SD for data read from a file descriptor (pipe, device, socket...) until EOF, in constant memory:
+ * stream digests are made of independent STREAM_CHUNK_SIZE chunks, so the input is read & hashed one chunk at a
+ * time; the digest is the same as for the complete file. Returns NULL on a read error or if the input is too small.
  */
-void *thread_sdbf_hashfile( void *task_param) {
-    filehash_task_t *task = (filehash_task_t *)task_param;
+sdbf_t *sdbf_hash_fd( int fd, char *name) {
+    uint8_t *chunk = (uint8_t *)alloc_check( ALLOC_ALIGN, STREAM_CHUNK_SIZE+FILE_PAGE_SIZE, "sdbf_hash_fd", "chunk", ERROR_EXIT);
+    sdbf_t *sdbf = sdbf_create( name);
+    uint64_t total = 0, size, buff_size = gen_chunk_alloc( 0, sdbf);
+    ssize_t got = 1;
 
-    int i;
-    for( i=task->tid; i<task->file_count; i+=task->tcount) {
-        sdbf_t *sdbf = sdbf_hashfile( task->filenames[i], 0);
-        if( sdbf) {
-            sdbf_add( sdbf);
-            task->hashed_count++;
+    while( got > 0) {
+        for( size=0; size < STREAM_CHUNK_SIZE; size += got) {
+            got = read( fd, chunk+size, STREAM_CHUNK_SIZE-size);
+            if( got < 0 && errno == EINTR) {
+                got = 0;
+                continue;
+            }
+            if( got <= 0)
+                break;
+        }
+        if( got < 0) {
+            if( sdbf_sys.warnings)
+                fprintf( stderr, "Warning: Could not read '%s': %s. Skipping.\n", name, strerror( errno));
+            break;
         }
+        if( !size)
+            break;
+        // Same bytes past the data as a mapping of the last page would have
+        memset( chunk+size, 0, FILE_PAGE_SIZE);
+        total += size;
+        buff_size = gen_chunk_grow( sdbf, buff_size, size);
+        gen_chunk_pass( chunk, size, gen_scratch_get(), sdbf);
+    }
+    free( chunk);
+    if( got < 0 || total < MIN_FILE_SIZE) {
+        if( got >= 0 && sdbf_sys.warnings)
+            fprintf( stderr, "Warning: '%s' too small (%ld). Skipping.\n", name, total);
+        sdbf_free( sdbf);
+        return NULL;
+    }
+    gen_chunk_finish( sdbf, buff_size);
+    return sdbf;
+}
+
+/**
+ * Append len bytes to a stream SDBF for an append-only input (log, growing capture, etc.). The first call
+ * (on a new SDBF from sdbf_create(), or one with a state from sdbf_state_read()) sets up the resume state.
+ * After each call, the SDBF is the same as the digest of all of the data so far; the cost is proportional
+ * to len. Returns 0 on success, -1 if the SDBF cannot be resumed (or if its resume state could not be saved;
+ * the state is then dropped & the SDBF is not to be used).
+ */
+int sdbf_update( sdbf_t *sdbf, const uint8_t *data, uint64_t len) {
+    if( !sdbf->state && (sdbf->dd_block_size || sdbf->bf_count != 1 || sdbf->last_count))
+        return -1;
+    // Hamming weights (& the summary) are recomputed on the next comparison
+    free_hamming( sdbf);
+    if( !sdbf->state) {
+        sdbf->state = (sdbf_state_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_state_t), "sdbf_update", "sdbf->state", ERROR_EXIT);
+        sdbf->state->bf_count = 1;
+        if( sdbf->buffer)
+            free( sdbf->buffer);
+        sdbf->state->buff_size = gen_chunk_alloc( len, sdbf);
+    }
+    if( gen_stream_update( sdbf, sdbf->state, data, len)) {
+        free( sdbf->state);
+        sdbf->state = NULL;
+        return -1;
     }
+    return 0;
+}
+
+/**
+ * Write the resume state of an SDBF built with sdbf_update() (to go along with its digest, see sdbf_to_stream()).
+ * The state is machine-specific binary data. Returns 0 on success, -1 if there is no state or on a write error.
+ */
+int sdbf_state_write( sdbf_t *sdbf, FILE *out) {
+    if( !sdbf->state)
+        return -1;
+    fprintf( out, "%s:%02d:%ld:%d:%s\n", STATE_MAGIC, STATE_VERSION, sizeof( sdbf_state_t), sdbf->bf_size, HASH_NAMES[sdbf->hash_id]);
+    if( fwrite( sdbf->state, sizeof( sdbf_state_t), 1, out) != 1)
+        return -1;
+    return ferror( out) ? -1 : 0;
+}
+
+/**
+ * Read back a resume state written by sdbf_state_write() & attach it to the SDBF it was written with (read
+ * back by sdbf_from_stream()), so that sdbf_update() can carry on. Returns 0 on success, -1 if the state
+ * cannot be read or does not go with the SDBF.
+ */
+int sdbf_state_read( sdbf_t *sdbf, FILE *in) {
+    char magic[16], hash_magic[8];
+    int version;
+    long size;
+    uint32_t bf_size;
+
+    if( fscanf( in, "%10s", magic) != 1 || strcmp( magic, STATE_MAGIC) || 
+        fscanf( in, ":%d:%ld:%u:%7s", &version, &size, &bf_size, hash_magic) != 4 || fgetc( in) != '\n' ||
+        version != STATE_VERSION || size != sizeof( sdbf_state_t) || bf_size != sdbf->bf_size || 
+        sdbf_hash_lookup( hash_magic) != (int)sdbf->hash_id)
+        return -1;
+    sdbf_state_t *state = (sdbf_state_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_state_t), "sdbf_state_read", "state", ERROR_EXIT);
+    // The state is raw binary: anything the pass would index with must be in range
+    if( fread( state, sizeof( sdbf_state_t), 1, in) != 1 || sdbf->dd_block_size || sdbf->bf_size > BF_SIZE ||
+        state->bf_count > sdbf->bf_count+1 || state->bf_count+1 < sdbf->bf_count || !gen_state_check( state, sdbf)) {
+        free( state);
+        return -1;
+    }
+    // The BF allocation is whatever the digest was read into
+    state->buff_size = 0;
+    if( sdbf->state)
+        free( sdbf->state);
+    sdbf->state = state;
+    return 0;
 }
 
 /**
  * Compute block-based SD for a file.
  */
 sdbf_t *sdbf_hash_dd( char *filename, uint32_t dd_block_size) {
-    mapped_file_t *mfile = mmap_file( filename, MIN_FILE_SIZE, sdbf_sys.warnings);
-    if( !mfile) {
-        return NULL;
+    return sdbf_hashfile_mt( filename, dd_block_size, sdbf_sys.thread_cnt);
+}
+/**
+ * Nanoseconds on the monotonic clock (scheduler stats).
+ */
+static uint64_t sched_now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Task order: by wave, then largest first; chunks of the same file stay in file order (so they can be merged early).
+ */
+static int sched_task_cmp( const void *a, const void *b) {
+    const sched_task_t *ta = (const sched_task_t *)a, *tb = (const sched_task_t *)b;
+    if( ta->wave != tb->wave)
+        return (ta->wave < tb->wave) ? -1 : 1;
+    if( ta->size != tb->size)
+        return (ta->size < tb->size) ? 1 : -1;
+    if( ta->file != tb->file)
+        return (ta->file < tb->file) ? -1 : 1;
+    return (ta->chunk < tb->chunk) ? -1 : (ta->chunk > tb->chunk);
+}
+
+/**
+ * Next task for a worker: the largest one in its own deque, else the smallest one left in another worker's deque.
+ */
+static int32_t sched_next( sched_worker_t *worker, uint32_t *stolen) {
+    sched_t *sched = worker->sched;
+    int32_t task = -1;
+    uint32_t i;
+
+    pthread_mutex_lock( &worker->mutex);
+    if( worker->head < worker->tail)
+        task = worker->deque[worker->head++];
+    pthread_mutex_unlock( &worker->mutex);
+    *stolen = 0;
+    for( i=1; task < 0 && i<sched->worker_cnt; i++) {
+        sched_worker_t *victim = sched->workers + (worker->tid+i) % sched->worker_cnt;
+        pthread_mutex_lock( &victim->mutex);
+        if( victim->head < victim->tail) {
+            task = victim->deque[--victim->tail];
+            *stolen = 1;
+        }
+        pthread_mutex_unlock( &victim->mutex);
     }
-    // Calculate total number of blocks
-    uint64_t dd_block_cnt =  mfile->size/dd_block_size;
-    if( mfile->size % dd_block_size >= MIN_FILE_SIZE)
-       dd_block_cnt++;
+    return task;
+}
 
-	sdbf_t *sdbf = (sdbf_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_t), "sdbf_hash_dd", "sdbf", ERROR_EXIT);
-	sdbf->name = filename;
-	sdbf->bf_size = sdbf_sys.bf_size;
-	sdbf->hash_count = 5;
-	sdbf->mask = BF_CLASS_MASKS[0];
-	sdbf->max_elem = sdbf_sys.max_elem;
+/**
+ * Release the mapping of a split file, store a newly hashed SDBF in the cache & hand it to the writer (if any);
+ * without a writer, it stays with the file & is added to the set once all files are done.
+ */
+static void sched_file_done( sched_worker_t *worker, sched_file_t *file) {
+    if( file->mfile) {
+        unmap_file( file->mfile);
+        file->mfile = NULL;
+    }
+    if( file->sdbf) {
+        worker->hashed_count++;
+        if( sdbf_sys.cache && !file->cached)
+            cache_put_sdbf( sdbf_sys.cache, &file->key, file->filename, file->sdbf);
+    }
+    if( worker->sched->writer) {
+        writer_put( worker->sched->writer, file - worker->sched->files, file->sdbf);
+        file->sdbf = NULL;
+    }
+}
 
-	sdbf->bf_count = dd_block_cnt;
-    sdbf->dd_block_size = dd_block_size;
-	sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ZERO, dd_block_cnt*sdbf_sys.bf_size, "sdbf_hash_dd", "sdbf->buffer", ERROR_EXIT);
-	sdbf->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, sizeof( uint16_t)*dd_block_cnt, "sdbf_hash_dd", "sdbf->elem_counts", ERROR_EXIT);
+/**
+ * Run one chunk of a split file. The first chunk task to run maps the file; finished chunks are merged into
+ * the SDBF in file order by whichever worker completes the next one due, so the result is identical to
+ * hashing the file sequentially.
+ */
+static void sched_run_chunk( sched_worker_t *worker, sched_file_t *file, uint32_t chunk) {
+    uint32_t finished = 0;
 
-	gen_block_sdbf_mt( mfile->buffer, mfile->size, dd_block_size, sdbf, sdbf_sys.thread_cnt);	
+    pthread_mutex_lock( &file->mutex);
+    if( file->state == SCHED_FILE_NEW) {
+        file->mfile = mmap_file( file->filename, MIN_FILE_SIZE, sdbf_sys.warnings);
+        file->state = SCHED_FILE_MAPPED;
+        if( file->mfile && file->mfile->size == file->size) {
+            file->sdbf = sdbf_create( file->filename);
+            file->buff_size = gen_chunk_alloc( file->size, file->sdbf);
+        // Changed since it was scheduled (or gone): hash whatever is there now, as a whole
+        } else {
+            if( file->mfile) {
+                file->sdbf = sdbf_create( file->filename);
+                gen_chunk_sdbf( file->mfile->buffer, file->mfile->size, STREAM_CHUNK_SIZE, file->sdbf);
+            }
+            file->state = SCHED_FILE_DONE;
+            finished = 1;
+        }
+    }
+    if( file->state == SCHED_FILE_DONE) {
+        pthread_mutex_unlock( &file->mutex);
+        if( finished)
+            sched_file_done( worker, file);
+        return;
+    }
+    pthread_mutex_unlock( &file->mutex);
 
-	munmap( mfile->buffer, mfile->size);
-    fclose( mfile->input);
-	return sdbf;
+    gen_chunk_feats( file->mfile->buffer, file->size, STREAM_CHUNK_SIZE, chunk, file->sdbf->hash_id, file->feats+chunk);
+
+    pthread_mutex_lock( &file->mutex);
+    file->done[chunk] = 1;
+    while( file->merged < file->chunk_count && file->done[file->merged]) {
+        feat_list_t *feats = file->feats + file->merged;
+        gen_chunk_merge( file->sdbf, feats);
+        free( feats->hashes);
+        bzero( feats, sizeof( feat_list_t));
+        file->merged++;
+    }
+    if( file->merged == file->chunk_count) {
+        gen_chunk_finish( file->sdbf, file->buff_size);
+        file->state = SCHED_FILE_DONE;
+        finished = 1;
+    }
+    pthread_mutex_unlock( &file->mutex);
+    // The writer may block (output budget), so the SDBF is handed over without the lock: other tasks of the 
+    // file only look at its state once it is done
+    if( finished)
+        sched_file_done( worker, file);
 }
+
 /**
- * Compute SD for a list of files & add them to the set.
+ * File scheduler worker: runs its own tasks largest first, then steals from the other workers.
  */
-int sdbf_hash_files( char **filenames, uint32_t file_count, uint32_t gen_mode) {
-    int32_t i, t, result = 0, thread_cnt = sdbf_sys.thread_cnt;
+static void *thread_sched_worker( void *worker_param) {
+    sched_worker_t *worker = (sched_worker_t *)worker_param;
+    sched_t *sched = worker->sched;
+    uint32_t stolen;
+    int32_t t;
+
+    while( (t = sched_next( worker, &stolen)) >= 0) {
+        sched_task_t *task = sched->tasks + t;
+        sched_file_t *file = sched->files + task->file;
+        uint64_t start = sched_now();
 
-    // Sequential implementation
+        if( file->chunk_count) {
+            sched_run_chunk( worker, file, task->chunk);
+        } else {
+            // A damaged cache record falls back to hashing the file
+            file->cached = file->cached && (file->sdbf = cache_load( sdbf_sys.cache, &file->key, file->filename));
+            if( !file->cached && !strcmp( file->filename, STDIN_ARG)) {
+                file->sdbf = sdbf_hash_fd( STDIN_FILENO, STDIN_NAME);
+            } else if( !file->cached) {
+                file->mfile = read_file( file->filename, MIN_FILE_SIZE, sdbf_sys.warnings, INGEST_MAP_SIZE, &worker->buffer, &worker->buffer_cap);
+                if( file->mfile)
+                    file->sdbf = sdbf_hash_mfile( file->mfile, 0, 1);
+            }
+            sched_file_done( worker, file);
+        }
+        worker->busy_ns += sched_now() - start;
+        worker->task_cnt++;
+        worker->steal_cnt += stolen;
+        worker->byte_cnt += task->size;
+    }
+    return NULL;
+}
+
+/**
+ * Hash a list of files on thread_cnt workers: files are stat-ed up front (unless their sizes are known), large 
+ * ones are split into STREAM_CHUNK_SIZE tasks (unless sdbf_sys.no_split), and tasks are run longest first; idle
+ * workers steal; files with a cached digest are a task of no size. Returns the number of files hashed; their SDBFs 
+ * are added to the set in input order (whatever the thread count) or, with a writer, written out as they complete. For in-order output, the files are cut into waves (in input order) of up to a chunk per
+ * worker or half the writer's budget worth of digests, so that output starts early & few digests have to wait for
+ * an earlier one. Waves only order the tasks: workers go on to the next wave as they run out of tasks.
+ */
+static int sdbf_hash_files_sched( char **filenames, const uint64_t *sizes, uint32_t file_count, uint32_t thread_cnt, writer_t *writer) {
+    uint32_t i, c, t, wave = 0, task_cnt = 0, result = 0;
+    uint64_t wave_bytes = 0, wave_size = 0;
+    struct stat file_stat;
+    sched_t sched;
+
+    bzero( &sched, sizeof( sched));
+    sched.writer = writer;
+    sched.files = (sched_file_t *) alloc_check( ALLOC_ZERO, file_count*sizeof( sched_file_t), "sdbf_hash_files", "sched.files", ERROR_EXIT);
+    for( i=0; i<file_count; i++) {
+        sched_file_t *file = sched.files + i;
+        file->filename = filenames[i];
+        if( sdbf_sys.cache)
+            file->cached = cache_find( sdbf_sys.cache, filenames[i], 0, &file->key);
+        if( sizes)
+            file->size = sizes[i];
+        else if( file->key.kind)
+            file->size = file->key.size;
+        else if( !stat( filenames[i], &file_stat) && S_ISREG( file_stat.st_mode))
+            file->size = file_stat.st_size;
+        if( !file->cached && !sdbf_sys.no_split && file->size > STREAM_CHUNK_SIZE) {
+            file->chunk_count = (file->size+STREAM_CHUNK_SIZE-1)/STREAM_CHUNK_SIZE;
+            file->feats = (feat_list_t *) alloc_check( ALLOC_ZERO, file->chunk_count*sizeof( feat_list_t), "sdbf_hash_files", "file->feats", ERROR_EXIT);
+            file->done = (uint8_t *) alloc_check( ALLOC_ZERO, file->chunk_count, "sdbf_hash_files", "file->done", ERROR_EXIT);
+            pthread_mutex_init( &file->mutex, NULL);
+            task_cnt += file->chunk_count;
+        } else {
+            task_cnt++;
+        }
+    }
+    sched.tasks = (sched_task_t *) alloc_check( ALLOC_ZERO, task_cnt*sizeof( sched_task_t), "sdbf_hash_files", "sched.tasks", ERROR_EXIT);
+    for( i=0, t=0; i<file_count; i++) {
+        sched_file_t *file = sched.files + i;
+        if( writer && writer->ordered) {
+            // Digest size estimate as for gen_chunk_alloc()
+            uint64_t bytes = ((file->size >> 11) + 1) << 8;
+            if( wave_size && (wave_bytes+bytes > writer->budget/2 || wave_size+file->size > (uint64_t)thread_cnt*STREAM_CHUNK_SIZE)) {
+                wave++;
+                wave_bytes = wave_size = 0;
+            }
+            wave_bytes += bytes;
+            wave_size += file->size;
+        }
+        for( c=0; c<file->chunk_count || (!c && !file->chunk_count); c++, t++) {
+            sched.tasks[t].wave = wave;
+            sched.tasks[t].file = i;
+            sched.tasks[t].chunk = c;
+            sched.tasks[t].size = (file->cached) ? 0 : (!file->chunk_count) ? file->size : 
+                                  (c < file->chunk_count-1) ? STREAM_CHUNK_SIZE : file->size - (uint64_t)c*STREAM_CHUNK_SIZE;
+        }
+    }
+    qsort( sched.tasks, task_cnt, sizeof( sched_task_t), sched_task_cmp);
+
+    // Deal the tasks round-robin, so that every deque starts out largest first
+    sched.worker_cnt = thread_cnt;
+    sched.workers = (sched_worker_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( sched_worker_t), "sdbf_hash_files", "sched.workers", ERROR_EXIT);
+    for( i=0; i<thread_cnt; i++) {
+        sched_worker_t *worker = sched.workers + i;
+        worker->sched = &sched;
+        worker->tid = i;
+        worker->deque = (uint32_t *) alloc_check( ALLOC_ZERO, (task_cnt/thread_cnt+1)*sizeof( uint32_t), "sdbf_hash_files", "worker->deque", ERROR_EXIT);
+        pthread_mutex_init( &worker->mutex, NULL);
+    }
+    for( t=0; t<task_cnt; t++) {
+        sched_worker_t *worker = sched.workers + t % thread_cnt;
+        worker->deque[worker->tail++] = t;
+    }
+
+    uint64_t start = sched_now();
+    pool_run( thread_sched_worker, sched.workers, sizeof( sched_worker_t), thread_cnt);
+    uint64_t elapsed = sched_now() - start;
+
+    for( i=0; i<thread_cnt; i++) {
+        sched_worker_t *worker = sched.workers + i;
+        if( sdbf_sys.verbose) {
+            fprintf( stderr, "worker %d: %ld tasks (%ld stolen), %.1f MB, busy %.3fs of %.3fs (%.1f%%)\n", i, worker->task_cnt, worker->steal_cnt, 
+                     (double)worker->byte_cnt/MB, worker->busy_ns/1e9, elapsed/1e9, elapsed ? 100.0*worker->busy_ns/elapsed : 100.0);
+        }
+        result += worker->hashed_count;
+        free( worker->buffer);
+        free( worker->deque);
+        pthread_mutex_destroy( &worker->mutex);
+    }
+    for( i=0; i<file_count; i++) {
+        if( sched.files[i].sdbf)
+            sdbf_add( sched.files[i].sdbf);
+        if( sched.files[i].chunk_count) {
+            free( sched.files[i].feats);
+            free( sched.files[i].done);
+            pthread_mutex_destroy( &sched.files[i].mutex);
+        }
+    }
+    free( sched.workers);
+    free( sched.tasks);
+    free( sched.files);
+    return result;
+}
+
+/**
+ * Compute SD for a list of files (sizes: NULL if not known) & add them to the set; in gen mode, sequentially 
+ * hashed SDBFs are written out instead.
+ */
+static int sdbf_hash_list( char **filenames, const uint64_t *sizes, uint32_t file_count, uint32_t gen_mode) {
+    uint32_t i, thread_cnt = sdbf_sys.thread_cnt;
+    int32_t result = 0;
+
+    // Sequential implementation (files are read ahead)
     if( thread_cnt == 1) {
+        cache_t *cache = sdbf_sys.cache;
+        cache_key_t *keys = NULL;
+        char **misses = filenames;
+        uint32_t miss_cnt = file_count;
+        mapped_file_t *mfile;
+        int32_t m;
+
+        // Only files without a cached digest are read
+        if( cache) {
+            keys = (cache_key_t *)alloc_check( ALLOC_ZERO, file_count*sizeof( cache_key_t), "sdbf_hash_list", "keys", ERROR_EXIT);
+            misses = (char **)alloc_check( ALLOC_ONLY, file_count*sizeof( char *), "sdbf_hash_list", "misses", ERROR_EXIT);
+            for( i=0, miss_cnt=0; i<file_count; i++) {
+                if( !cache_find( cache, filenames[i], 0, keys+i))
+                    misses[miss_cnt++] = filenames[i];
+            }
+        }
+        ingest_t *ing = ingest_open( misses, miss_cnt, sdbf_sys.read_ahead);
         for( i=0; i<file_count; i++) {
-            sdbf_t *sdbf = sdbf_hashfile( filenames[i], 0);
+            sdbf_t *sdbf = NULL;
+            if( keys && keys[i].length) {
+                if( !(sdbf = cache_load( cache, keys+i, filenames[i])) && (sdbf = sdbf_hashfile_mt( filenames[i], 0, 1)))
+                    cache_put_sdbf( cache, keys+i, filenames[i], sdbf);
+            } else if( (m = ingest_next( ing, &mfile)) >= 0) {
+                sdbf = mfile ? sdbf_hash_mfile( mfile, 0, 1) : 
+                       !strcmp( misses[m], STDIN_ARG) ? sdbf_hash_fd( STDIN_FILENO, STDIN_NAME) : NULL;
+                ingest_release( ing);
+                if( sdbf && cache)
+                    cache_put_sdbf( cache, keys+i, filenames[i], sdbf);
+            }
             if( sdbf) {
                 if( gen_mode == MODE_GEN) {
                     sdbf_to_stream( sdbf, stdout);
@@ -243,26 +666,30 @@ int sdbf_hash_files( char **filenames, uint32_t file_count, uint32_t gen_mode) {
                 result++;
             }
         }
-    // Threaded implementation
-    } else {
-        pthread_t *thread_pool = (pthread_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( pthread_t), "sdbf_hash_files", "thread_pool", ERROR_EXIT);
-        filehash_task_t *tasks = (filehash_task_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( filehash_task_t), "sdbf_hash_files", "tasks", ERROR_EXIT);
-        for( t=0; t<thread_cnt; t++) {
-            tasks[t].tid = t;
-            tasks[t].tcount = thread_cnt;
-            tasks[t].filenames = filenames;
-            tasks[t].file_count = file_count;
-            if( pthread_create( &thread_pool[t], NULL, thread_sdbf_hashfile, (void *)(tasks+t) )) {
-                fprintf( stderr, "ERROR: Could not create thread.\n");
-                exit(-1);
-            }
-        }
-        for( t=0; t<thread_cnt; t++) {
-            pthread_join( thread_pool[t], NULL);
-            result += tasks[t].hashed_count;
+        ingest_close( ing);
+        if( cache) {
+            free( keys);
+            free( misses);
         }
-    // End threading
+    // Threaded implementation (in gen mode, a writer thread writes the SDBFs out as they complete)
+    } else {
+        writer_t *writer = NULL;
+        if( gen_mode == MODE_GEN)
+            writer = writer_open( stdout, file_count, thread_cnt, !sdbf_sys.write_any, 
+                                  (uint64_t)(sdbf_sys.write_budget ? sdbf_sys.write_budget : WRITE_BUDGET)*MB);
+        result = sdbf_hash_files_sched( filenames, sizes, file_count, thread_cnt, writer);
+        if( writer)
+            writer_close( writer);
     }
+	return result;
+}
+
+/**
+ * Compute SD for a list of files & add them to the set.
+ */
+int sdbf_hash_files( char **filenames, uint32_t file_count, uint32_t gen_mode) {
+    int32_t i, result = sdbf_hash_list( filenames, NULL, file_count, gen_mode);
+
     if( gen_mode == MODE_GEN) {
         for( i=0; i<sdbf_get_size(); i++)
             sdbf_to_stream( sdbf_get( i), stdout);
@@ -270,33 +697,112 @@ int sdbf_hash_files( char **filenames, uint32_t file_count, uint32_t gen_mode) {
 	return result;
 }
 
-
 /**
- * Compute block-based SD for a list of files & add them to the set.
+ * Compute block-based SD for a list of files & add them to the set; in gen mode, the SDBFs are streamed out
+ * as their blocks are hashed (see dd_pipe.c).
  */
 int sdbf_hash_files_dd( char **filenames, uint32_t file_count, uint32_t gen_mode, uint32_t dd_block_size) {
-    int32_t i, result = 0;
+    return dd_hash_files( filenames, file_count, (gen_mode == MODE_GEN) ? stdout : NULL, dd_block_size);
+}
 
-    for( i=0; i<file_count; i++) {
-        sdbf_t *sdbf = sdbf_hash_dd( filenames[i], dd_block_size);
+/**
+ * Compute both the stream and the block-based SD for an opened file in a single pass over it; the dd SDBF
+ * (max_elem as for sdhash-dd) goes to *dd_sdbf.
+ */
+static sdbf_t *sdbf_hash_mfile_dual( mapped_file_t *mfile, uint32_t dd_block_size, uint32_t thread_cnt, sdbf_t **dd_sdbf) {
+    sdbf_t *sdbf = sdbf_create( mfile->name);
+    if( !sdbf)
+        return NULL;
+    *dd_sdbf = sdbf_create_dd( mfile->name, mfile->size, dd_block_size, MAX_ELEM_COUNT_DD, 1);
+    gen_dual_sdbf_mt( mfile->buffer, mfile->size, sdbf, *dd_sdbf, dd_block_size, thread_cnt);
+	return sdbf;
+}
+
+/**
+ * Compute stream and block-based SDs for a list of files (one pass over each file) & add them to the set,
+ * stream digest first.
+ */
+int sdbf_hash_files_dual( char **filenames, uint32_t file_count, uint32_t gen_mode, uint32_t dd_block_size) {
+    int32_t result = 0;
+    ingest_t *ing = ingest_open( filenames, file_count, sdbf_sys.read_ahead);
+    mapped_file_t *mfile;
+    sdbf_t *dd_sdbf;
+
+    while( ingest_next( ing, &mfile) >= 0) {
+        sdbf_t *sdbf = mfile ? sdbf_hash_mfile_dual( mfile, dd_block_size, sdbf_sys.thread_cnt, &dd_sdbf) : NULL;
+        ingest_release( ing);
         if( sdbf) {
             if( gen_mode == MODE_GEN) {
                 sdbf_to_stream( sdbf, stdout);
+                sdbf_to_stream( dd_sdbf, stdout);
                 sdbf_free( sdbf);
-            } else
+                sdbf_free( dd_sdbf);
+            } else {
 				sdbf_add( sdbf);
+				sdbf_add( dd_sdbf);
+            }
             result++;
         }
     }
+    ingest_close( ing);
 	return result;
 }
 
+/**
+ * Compute SD for a batch of files (sizes: NULL if not known) with the stream, dd (dd_block_size > 0) or dual
+ * method & add them to the set; in gen mode, the SDBFs are written out & released, along with the file names
+ * (otherwise, the names stay allocated along with the SDBFs).
+ */
+int sdbf_hash_batch( char **names, const uint64_t *sizes, uint32_t count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual) {
+    int32_t result;
+    uint32_t i;
+
+    if( dual)
+        result = sdbf_hash_files_dual( names, count, gen_mode, dd_block_size);
+    else if( dd_block_size)
+        result = sdbf_hash_files_dd( names, count, gen_mode, dd_block_size);
+    else
+        result = sdbf_hash_list( names, sizes, count, gen_mode);
+    if( gen_mode == MODE_GEN) {
+        pthread_mutex_lock( &set_mutex);
+        for( i=0; i<curr_sdbf; i++) {
+            sdbf_to_stream( sdbf_list[i], stdout);
+            sdbf_free( sdbf_list[i]);
+        }
+        curr_sdbf = 0;
+        pthread_mutex_unlock( &set_mutex);
+        for( i=0; i<count; i++)
+            free( names[i]);
+    }
+    return result;
+}
+
+/**
+ * Compute SD for the files in a list of directory trees (& plain files) & add them to the set. Files are
+ * hashed in batches (see sdbf_hash_batch()), as the parallel walker finds them (see walk.c).
+ */
+int sdbf_hash_tree( char **paths, uint32_t path_count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual) {
+    walk_t *walk = walk_open( paths, path_count);
+    char **names;
+    uint64_t *sizes;
+    uint32_t count;
+    int32_t result = 0;
+
+    while( (count = walk_take( walk, &names, &sizes))) {
+        result += sdbf_hash_batch( names, sizes, count, gen_mode, dd_block_size, dual);
+        free( names);
+        free( sizes);
+    }
+    walk_close( walk);
+    return result;
+}
+
 /**
  * Base64 encoding of SDBF; top-level interface
  */
 char *sdbf_encode( sdbf_t *sdbf) {
 	char header[64*KB], *base64, *base64_buffer;
-	sprintf( header, "%s sdbf:sha1:%d:%d:%x:%d:%d:%d:",  sdbf->name, sdbf->bf_size, sdbf->hash_count, sdbf->mask, 
+	sprintf( header, "%s sdbf:%s:%d:%d:%x:%d:%lu:%d:",  sdbf->name, HASH_NAMES[sdbf->hash_id], sdbf->bf_size, sdbf->hash_count, sdbf->mask, 
 														 sdbf->max_elem, sdbf->bf_count, sdbf->last_count);
 	base64 = (char *)alloc_check( ALLOC_ZERO, (strlen( header)+(sdbf->bf_size)*(sdbf->bf_count)*8/6 + 4), "sdbf_encode", "base64", ERROR_EXIT);
 	if( !base64)
@@ -313,7 +819,7 @@ char *sdbf_encode( sdbf_t *sdbf) {
 void sdbf_to_stream( sdbf_t *sdbf, FILE *out) {
     // Stream version
     if( !sdbf->elem_counts) {
-        fprintf( out, "%s:%02d:%d:%s:sha1:%d:%d:%x:%d:%d:%d:", MAGIC_STREAM, SDBF_VERSION, (int)strlen( sdbf->name), sdbf->name, sdbf->bf_size, 
+        fprintf( out, "%s:%02d:%d:%s:%s:%d:%d:%x:%d:%lu:%d:", MAGIC_STREAM, SDBF_VERSION, (int)strlen( sdbf->name), sdbf->name, HASH_NAMES[sdbf->hash_id], sdbf->bf_size, 
                                                             sdbf->hash_count, sdbf->mask, sdbf->max_elem, sdbf->bf_count, sdbf->last_count);
         uint64_t qt = sdbf->bf_count/6, rem = sdbf->bf_count % 6;
         uint64_t i, pos=0, b64_block = 6*sdbf->bf_size;
@@ -330,21 +836,38 @@ void sdbf_to_stream( sdbf_t *sdbf, FILE *out) {
         }
     // Block version
     } else {
-        fprintf( out,  "%s:%02d:%d:%s:sha1:%d:%d:%x:%d:%d:%d", MAGIC_DD, SDBF_VERSION, (int)strlen( sdbf->name), sdbf->name, sdbf->bf_size, 
-                                                               sdbf->hash_count, sdbf->mask, sdbf->max_elem, sdbf->bf_count, sdbf->dd_block_size);
-        int i;
-        for( i=0; i<sdbf->bf_count; i++) {
-            char *b64 = b64encode( sdbf->buffer+i*sdbf->bf_size, sdbf->bf_size);
-            fprintf( out, ":%02X:%s", sdbf->elem_counts[i], b64);
-        }
+        sdbf_dd_header_to_stream( sdbf, out);
+        sdbf_dd_blocks_to_stream( sdbf, out);
     }
     fprintf( out, "\n");
 }
 
+/**
+ * Header of a block-based (dd) SDBF, up to its first BF.
+ */
+void sdbf_dd_header_to_stream( sdbf_t *sdbf, FILE *out) {
+    fprintf( out,  "%s:%02d:%d:%s:%s:%d:%d:%x:%d:%lu:%d", MAGIC_DD, SDBF_VERSION, (int)strlen( sdbf->name), sdbf->name, HASH_NAMES[sdbf->hash_id], sdbf->bf_size, 
+                                                           sdbf->hash_count, sdbf->mask, sdbf->max_elem, sdbf->bf_count, sdbf->dd_block_size);
+}
+
+/**
+ * BFs (& element counts) of a block-based SDBF--or of a range of its blocks (see dd_pipe.c).
+ */
+void sdbf_dd_blocks_to_stream( sdbf_t *sdbf, FILE *out) {
+    uint64_t i;
+
+    for( i=0; i<sdbf->bf_count; i++) {
+        char *b64 = b64encode( sdbf->buffer+i*sdbf->bf_size, sdbf->bf_size);
+        fprintf( out, ":%02X:%s", sdbf->elem_counts[i], b64);
+        free( b64);
+    }
+}
+
 sdbf_t *sdbf_from_stream( FILE *in) {
     char *b64, fmt[64];
     uint8_t  buffer[16*KB], sdbf_magic[16], hash_magic[8];
-    uint32_t colon_cnt, read_cnt, hash_cnt, d_len, b64_len;
+    uint32_t colon_cnt, hash_cnt;
+    uint64_t d_len, b64_len;
     uint32_t version, name_len;
     uint64_t i;
 
@@ -369,38 +892,61 @@ sdbf_t *sdbf_from_stream( FILE *in) {
     fmt[0] = '%';
     sprintf( fmt+1, "%dc", name_len);
     sdbf->name = (uint8_t *)alloc_check( ALLOC_ZERO, name_len+2, "sdbf_from_stream", "sdbf->name", ERROR_EXIT);
-    read_cnt = fscanf( in, fmt, sdbf->name);
-
-    read_cnt = fscanf( in, ":%4s:%d:%d:%x:%d:%d", hash_magic, &(sdbf->bf_size), &(sdbf->hash_count), &(sdbf->mask), &(sdbf->max_elem), &(sdbf->bf_count));
-    sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ZERO, sdbf->bf_count*sdbf->bf_size, "sdbf_from_stream", "sdbf->buffer", ERROR_EXIT);
+    if( fscanf( in, fmt, sdbf->name) != 1 ||
+        fscanf( in, ":%4s:%d:%d:%x:%d:%lu", hash_magic, &(sdbf->bf_size), &(sdbf->hash_count), &(sdbf->mask), &(sdbf->max_elem), &(sdbf->bf_count)) != 6) {
+        fprintf( stderr, "ERROR: Truncated SDBF header. Name: %s\n", sdbf->name);
+        exit(-1);
+    }
+    if( sdbf_hash_lookup( hash_magic) < 0) {
+        fprintf( stderr, "ERROR: Unsupported feature hash '%s' in SDBF '%s'. Expecting 'sha1' or 'xxh3'\n", hash_magic, sdbf->name);
+        exit(-1);
+    }
+    sdbf->hash_id = sdbf_hash_lookup( hash_magic);
+    sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, sdbf->bf_count*sdbf->bf_size, "sdbf_from_stream", "sdbf->buffer", ERROR_EXIT);
     // DD fork
     if( !strcmp( sdbf_magic, MAGIC_DD)) {
-        read_cnt = fscanf( in, ":%d", &(sdbf->dd_block_size));
+        if( fscanf( in, ":%d", &(sdbf->dd_block_size)) != 1) {
+            fprintf( stderr, "ERROR: Truncated SDBF header. Name: %s\n", sdbf->name);
+            exit(-1);
+        }
         sdbf->elem_counts = (uint16_t *)alloc_check( ALLOC_ZERO, sdbf->bf_count*sizeof(uint16_t), "sdbf_from_stream", "sdbf->elem_counts", ERROR_EXIT);
         for( i=0; i<sdbf->bf_count; i++) {
-            read_cnt = fscanf( in, ":%2x:%344s", &hash_cnt, buffer);
+            if( fscanf( in, ":%2x:%344s", &hash_cnt, buffer) != 2) {
+                fprintf( stderr, "ERROR: Truncated SDBF. Name: %s, BF#: %lu\n", sdbf->name, i);
+                exit(-1);
+            }
             sdbf->elem_counts[i] = (uint16_t)hash_cnt;
             d_len = b64decode_into( buffer, 344, sdbf->buffer + i*sdbf->bf_size);
             if( d_len != 256) {
-                fprintf( stderr, "ERROR: Unexpected decoded length for BF: %d. Name: %s, BF#: %d\n", d_len, sdbf->name, (int)i);
+                fprintf( stderr, "ERROR: Unexpected decoded length for BF: %lu. Name: %s, BF#: %lu\n", d_len, sdbf->name, i);
                 exit(-1);
             }
         }
     // Stream fork
     } else {
-        read_cnt = fscanf( in, ":%d:", &(sdbf->last_count));
+        if( fscanf( in, ":%d:", &(sdbf->last_count)) != 1) {
+            fprintf( stderr, "ERROR: Truncated SDBF header. Name: %s\n", sdbf->name);
+            exit(-1);
+        }
         b64_len = sdbf->bf_count*sdbf->bf_size;
         b64_len = 4*(b64_len + 1 + b64_len % 3)/3;
-        sprintf( &fmt[1], "%ds", b64_len);
+        sprintf( &fmt[1], "%lus", b64_len);
         b64 = alloc_check( ALLOC_ZERO, b64_len+2, "sdbf_from_stream", "b64", ERROR_EXIT);
-        read_cnt = fscanf( in, fmt, b64);
-        sdbf->buffer = b64decode( b64, b64_len, &d_len);
+        if( fscanf( in, fmt, b64) != 1) {
+            fprintf( stderr, "ERROR: Truncated SDBF. Name: %s\n", sdbf->name);
+            exit(-1);
+        }
+        // Decode straight into an aligned buffer (b64_len is an upper bound on the decoded length)
+        free( sdbf->buffer);
+        sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, b64_len, "sdbf_from_stream", "sdbf->buffer", ERROR_EXIT);
+        d_len = b64decode_into( b64, b64_len, sdbf->buffer);
         if( d_len != sdbf->bf_count*sdbf->bf_size) {
-            fprintf( stderr, "ERROR: Incorrect base64 decoding length. Expected: %d, actual: %d\n", sdbf->bf_count*sdbf->bf_size, d_len);
+            fprintf( stderr, "ERROR: Incorrect base64 decoding length. Expected: %lu, actual: %lu\n", sdbf->bf_count*sdbf->bf_size, d_len);
             exit(-1);
         }
         free( b64);
     }
+    compute_hamming( sdbf);
     return sdbf;
 }
 
@@ -408,22 +954,42 @@ sdbf_t *sdbf_from_stream( FILE *in) {
  * Base64 decoding of a SDBF; top-level interface
  */
 sdbf_t *sdbf_decode( char *sdbf_b64) {
-	sdbf_t *sdbf = (sdbf_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_t), "sdbf_decode", "sdbf", ERROR_EXIT);
+	char *header = NULL, *pos, *b64, hash_magic[8];
+	uint64_t b64_len, d_len, name_len;
+	int field_cnt, header_len = 0;
 
-	uint32_t i, colon_cnt, name_len=0, bf_len=0, decoded_len;
-	for( i=0, colon_cnt=8; colon_cnt; i++) {
-		if( sdbf_b64[i] == ':') {
-			if( colon_cnt == 8) {
-				name_len = i+1;
-			}
-			colon_cnt--;
-		}
+	// The name may contain blanks: the header starts at the last " sdbf:" (base64 has neither blanks nor colons)
+	for( pos=strstr( sdbf_b64, " sdbf:"); pos; pos=strstr( pos+1, " sdbf:"))
+		header = pos;
+	if( !header) {
+		fprintf( stderr, "ERROR: Missing SDBF header in encoded digest\n");
+		exit(-1);
+	}
+	sdbf_t *sdbf = (sdbf_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_t), "sdbf_decode", "sdbf", ERROR_EXIT);
+	name_len = header - sdbf_b64;
+	sdbf->name = (int8_t *)alloc_check( ALLOC_ZERO, name_len+2, "sdbf_decode", "sdbf->name", ERROR_EXIT);
+	memcpy( sdbf->name, sdbf_b64, name_len);
+	field_cnt = sscanf( header+1, "sdbf:%7[^:]:%u:%u:%x:%u:%lu:%u:%n", hash_magic, &(sdbf->bf_size), &(sdbf->hash_count), &(sdbf->mask), 
+	                                                                     &(sdbf->max_elem), &(sdbf->bf_count), &(sdbf->last_count), &header_len);
+	if( field_cnt != 7 || !header_len) {
+		fprintf( stderr, "ERROR: Malformed SDBF header in encoded digest '%s'\n", sdbf->name);
+		exit(-1);
+	}
+	if( sdbf_hash_lookup( hash_magic) < 0) {
+		fprintf( stderr, "ERROR: Unsupported feature hash '%s' in SDBF '%s'. Expecting 'sha1' or 'xxh3'\n", hash_magic, sdbf->name);
+		exit(-1);
+	}
+	sdbf->hash_id = sdbf_hash_lookup( hash_magic);
+	// Decode straight into an aligned buffer (b64_len is an upper bound on the decoded length)
+	b64 = header+1+header_len;
+	b64_len = strlen( b64);
+	sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, b64_len+1, "sdbf_decode", "sdbf->buffer", ERROR_EXIT);
+	d_len = b64decode_into( (uint8_t *)b64, b64_len, sdbf->buffer);
+	if( d_len != sdbf->bf_count*sdbf->bf_size) {
+		fprintf( stderr, "ERROR: Incorrect base64 decoding length. Expected: %lu, actual: %lu\n", sdbf->bf_count*sdbf->bf_size, d_len);
+		exit(-1);
 	}
-	sdbf->name = (char *)alloc_check( ALLOC_ZERO, name_len+2, "sdbf_decode", "sdbf->name", ERROR_EXIT);
-	sscanf( sdbf_b64, "%s:sdbf:sha1:%d:%d:%x:%d:%d:%d:", sdbf->name, &(sdbf->bf_size), &(sdbf->hash_count), &(sdbf->mask), 
-													    &(sdbf->max_elem), &(sdbf->bf_count), &(sdbf->last_count));
-	bf_len = strlen( sdbf_b64+i);
-	sdbf->buffer = b64decode( sdbf_b64+i, bf_len, &decoded_len);
+	compute_hamming( sdbf);
 	return sdbf;
 }
 
@@ -445,3 +1011,17 @@ int sdbf_load( const char *fname) {
 	}
 	return sdbf_count;
 }
+
+// Feature hash names, by HASH_* id (as found in the SDBF header)
+const char *HASH_NAMES[] = { "sha1", "xxh3"};
+
+/**
+ * Maps a feature hash name (as found in the SDBF header) to its id; returns -1 if unknown.
+ */
+int sdbf_hash_lookup( const char *hash_name) {
+	int i;
+	for( i=0; i<HASH_COUNT; i++)
+		if( !strcmp( hash_name, HASH_NAMES[i]))
+			return i;
+	return -1;
+}
@@ -10,8 +10,14 @@
 extern sdbf_parameters_t sdbf_sys;
 
 static uint16_t *ranks_int;
-static pthread_t *thread_pool = NULL;
-static sdbf_task_t *tasklist = NULL;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+// Stream (feature-selecting) vs. block (score-collecting) flavor of the fused pass
+#define GEN_STREAM_MODE( scratch, sdbf) ((sdbf) || (scratch)->feat_out)
+
+// Batched feature hash functions, by hash id (HASH_*)
+static void (*const FEAT_HASH_BATCH[HASH_COUNT])( const uint8_t **, uint32_t, uint32_t *) = { sha1_batch_64, xxh3_batch_64 };
 
 /**
  * Create and initialize an sdbf_t structure ready for stream mode.
@@ -24,311 +30,1157 @@ sdbf_t *sdbf_create( char *name) {
 	sdbf->mask = BF_CLASS_MASKS[0];
 	sdbf->max_elem = sdbf_sys.max_elem;
     sdbf->bf_count = 1;
+    sdbf->hash_id = sdbf_sys.hash_id;
     return sdbf;
 }
 
+// Min element count of the BFs of each class of a digest summary (SUM_*)
+static const uint32_t SUM_MIN_ELEM[SUM_CLASSES] = { 0, MIN_ELEM_COUNT, MIN_REF_ELEM_COUNT};
+
+/**
+ * Hamming weights of the BFs, as published by compute_hamming().
+ */
+static inline const uint16_t *get_hamming( sdbf_t *sdbf) {
+	return __atomic_load_n( &sdbf->hamming, __ATOMIC_ACQUIRE);
+}
+
 /**
- * Pre-compute Hamming weights for each BF and adds them to the SDBF descriptor.
+ * Summary of the digest, as published by compute_hamming().
+ */
+static inline const sdbf_summary_t *get_summary( sdbf_t *sdbf) {
+	return __atomic_load_n( &sdbf->summary, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Builds the summary of a digest from its BFs & their Hamming weights.
+ */
+static sdbf_summary_t *summarize( sdbf_t *sdbf, const uint16_t *hamming) {
+	sdbf_summary_t *summary = (sdbf_summary_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_summary_t), "summarize", "summary", ERROR_EXIT);
+	uint64_t i, j, bf_words = sdbf->bf_size/8;
+	uint32_t c, s;
+
+	if( sdbf->bf_count == 1)
+		summary->bits = sdbf->buffer;
+	else {
+		summary->bits = (uint8_t *)alloc_check( ALLOC_ZERO, sdbf->bf_size, "summarize", "summary->bits", ERROR_EXIT);
+		for( i=0; i<sdbf->bf_count; i++) {
+			uint64_t *bf = (uint64_t *)(sdbf->buffer + i*sdbf->bf_size);
+			for( j=0; j<bf_words; j++)
+				((uint64_t *)summary->bits)[j] |= bf[j];
+		}
+	}
+	for( c=0; c<SUM_CLASSES; c++)
+		summary->min_e[c] = summary->min_s[c] = UINT16_MAX;
+	for( i=0; i<sdbf->bf_count; i++) {
+		s = get_elem_count( sdbf, i);
+		for( c=0; c<SUM_CLASSES && s >= SUM_MIN_ELEM[c]; c++) {
+			summary->count[c]++;
+			summary->min_e[c] = (hamming[i] < summary->min_e[c]) ? hamming[i] : summary->min_e[c];
+			summary->min_s[c] = (s < summary->min_s[c]) ? s : summary->min_s[c];
+		}
+	}
+	return summary;
+}
+
+/**
+ * Pre-compute Hamming weights for each BF and adds them to the SDBF descriptor, along with its summary (once: threads
+ * that get there at the same time all compute them, & one of them is kept).
  */ 
 int compute_hamming( sdbf_t *sdbf) {
-	uint32_t pos, bf_count = sdbf->bf_count;
-	sdbf->hamming = (uint16_t *) alloc_check( ALLOC_ZERO, bf_count*sizeof( uint16_t), "compute_hamming", "sdbf->hamming", ERROR_EXIT);
+	uint64_t pos, bf_count = sdbf->bf_count;
+	uint16_t *hamming;
+	sdbf_summary_t *summary;
+
+	if( get_summary( sdbf) || !sdbf->buffer)
+		return 0;
+	if( !get_hamming( sdbf)) {
+		hamming = (uint16_t *) alloc_check( ALLOC_ZERO, bf_count*sizeof( uint16_t), "compute_hamming", "sdbf->hamming", ERROR_EXIT);
 		
-	uint64_t i, j;
-	uint16_t *buffer16 = (uint16_t *)sdbf->buffer;
-    for( i=0,pos=0; i<bf_count; i++) {
-		for( j=0; j<BF_SIZE/2; j++,pos++) {
-			sdbf->hamming[i] += bit_count_16[buffer16[pos]];
+		uint64_t i, j;
+		uint16_t *buffer16 = (uint16_t *)sdbf->buffer;
+		for( i=0,pos=0; i<bf_count; i++) {
+			for( j=0; j<BF_SIZE/2; j++,pos++) {
+				hamming[i] += bit_count_16[buffer16[pos]];
+			}
 		}
+		if( !__sync_bool_compare_and_swap( &sdbf->hamming, NULL, hamming))
+			free( hamming);
+	}
+	summary = summarize( sdbf, get_hamming( sdbf));
+	if( !__sync_bool_compare_and_swap( &sdbf->summary, NULL, summary)) {
+		if( summary->bits != sdbf->buffer)
+			free( summary->bits);
+		free( summary);
 	}
 	return 0;
 }
 
 /**
- * Generate ranks for a file chunk.
+ * Releases the Hamming weights & the summary of a digest (before its BFs change or go).
  */
-void gen_chunk_ranks( uint8_t *file_buffer, const uint64_t chunk_size, uint16_t *chunk_ranks, uint16_t carryover) {
-    uint64_t offset, entropy=0;
-	uint8_t *ascii = (uint8_t *)alloc_check( ALLOC_ZERO, 256, "gen_chunk_ranks", "ascii", ERROR_EXIT);;
-
-	if( carryover > 0) {
-		memcpy( chunk_ranks, chunk_ranks+chunk_size-carryover, carryover*sizeof(uint16_t));
+void free_hamming( sdbf_t *sdbf) {
+	if( sdbf->summary) {
+		if( sdbf->summary->bits != sdbf->buffer)
+			free( sdbf->summary->bits);
+		free( sdbf->summary);
+		sdbf->summary = NULL;
 	}
-	bzero( chunk_ranks+carryover, (chunk_size-carryover)*sizeof( uint16_t));
-	for( offset=0; offset<chunk_size-sdbf_sys.entr_win_size; offset++) {
-		// Initial/sync entropy calculation
-		 if( offset % sdbf_sys.block_size == 0) {
-			entropy = entr64_init_int( file_buffer+offset, ascii);
-		// Incremental entropy update (much faster)
-		} else {
-			entropy = entr64_inc_int( entropy, file_buffer+offset-1, ascii);
-		}
-        chunk_ranks[offset] = ENTR64_RANKS[entropy >> ENTR_POWER];
+	if( sdbf->hamming) {
+		free( sdbf->hamming);
+		sdbf->hamming = NULL;
 	}
-    free( ascii);
 }
 
 /**
- * Generate scores for a ranks chunk.
+ * Popularity scorer: reset the window minimum state at the start of a chunk.
  */
-void gen_chunk_scores( const uint16_t *chunk_ranks, const uint64_t chunk_size, uint16_t *chunk_scores, int32_t *score_histo) { 
-    uint64_t i, j;
-    uint32_t pop_win = sdbf_sys.pop_win_size;
-    uint64_t min_pos = 0;
-    uint16_t min_rank = chunk_ranks[min_pos]; 
+static inline void gen_minq_reset( gen_minq_t *q) {
+    q->head = q->tail = q->next = 0;
+}
 
-	bzero( chunk_scores, chunk_size*sizeof( uint16_t));
-    for( i=0; i<chunk_size-pop_win; i++) {
-        // try sliding on the cheap    
-        if( i>0 && min_rank>0) {
-            while( chunk_ranks[i+pop_win] >= min_rank && i<min_pos && i<chunk_size-pop_win+1) {
-                if( chunk_ranks[i+pop_win] == min_rank)
-                    min_pos = i+pop_win;
-                chunk_scores[min_pos]++;
-                i++;
-            }
-        }      
-        min_pos = i;
-        min_rank = chunk_ranks[min_pos];
-        for( j=i+1; j<i+pop_win; j++) {
-            if( chunk_ranks[j] < min_rank && chunk_ranks[j]) {
-                min_rank = chunk_ranks[j];
-                min_pos = j;
-            } else if( min_pos == j-1 && chunk_ranks[j] == min_rank) {
-                min_pos = j;
-            }
-        }
-        if( chunk_ranks[min_pos] > 0) {
-            chunk_scores[min_pos]++;
-        }
+/**
+ * Popularity scorer: minimum of the window [i, i+pop_win) under the legacy rescan rules--a window 
+ * starting on a zero rank has no minimum (returns 0); otherwise, zero ranks are skipped and the 
+ * leftmost minimum is extended through adjacent equal ranks (*min_pos is the end of that run).
+ * The deque holds runs of equal (non-zero) ranks; runs that can never be a minimum again are dropped, 
+ * so every position is pushed at most once. ranks[pos & mask] must be valid for [i, i+pop_win).
+ */
+static inline uint16_t gen_minq_window( gen_minq_t *q, const uint16_t *ranks, uint64_t mask, uint64_t i, uint32_t pop_win, uint64_t *min_pos) {
+    uint64_t pos, head = q->head, tail = q->tail, next = q->next;
+    uint16_t rank;
+    uint32_t back;
+
+    if( !ranks[i & mask])
+        return 0;
+    // Windows are visited in order, but the cheap slide may skip over them
+    if( next <= i) {
+        head = tail = 0;
+        next = i;
     }
-    // Generate score histogram (for b-sdbf signatures)
-    if( score_histo) {
-        for( i=0; i<chunk_size-pop_win; i++)
-            score_histo[chunk_scores[i]]++;
+    while( tail > head && q->end[head & GEN_MINQ_MASK] < i)
+        head++;
+    for( pos=next; pos<i+pop_win; pos++) {
+        rank = ranks[pos & mask];
+        if( !rank)
+            continue;
+        // Higher runs can never be a minimum again; equal ones stay so that the head is the leftmost minimum
+        while( tail > head && q->rank[(tail-1) & GEN_MINQ_MASK] > rank)
+            tail--;
+        back = (tail-1) & GEN_MINQ_MASK;
+        if( tail > head && q->rank[back] == rank && q->end[back] == pos-1) {
+            q->end[back] = pos;
+        } else {
+            back = tail++ & GEN_MINQ_MASK;
+            q->end[back] = pos;
+            q->rank[back] = rank;
+        }
     }
+    q->head = head;
+    q->tail = tail;
+    q->next = pos;
+    *min_pos = q->end[head & GEN_MINQ_MASK];
+    return q->rank[head & GEN_MINQ_MASK];
 }
+
 /**
- * Generate SHA1 hashes and add them to the SDBF--original stream version.
+ * Add a feature hash to the last BF of a stream SDBF; starts a new BF once max_elem is reached.
  */
-void gen_chunk_hash( uint8_t *file_buffer, const uint64_t chunk_pos, const uint16_t *chunk_scores, const uint64_t chunk_size, sdbf_t *sdbf) {
-	uint64_t i;
-    uint32_t sha1_hash[5];
-	uint32_t bf_count = sdbf->bf_count;
-	uint32_t last_count = sdbf->last_count;
-	uint8_t *curr_bf = sdbf->buffer + (bf_count-1)*(sdbf->bf_size);
+static inline void gen_stream_insert( sdbf_t *sdbf, uint32_t *sha1_hash) {
+    uint8_t *curr_bf = sdbf->buffer + (sdbf->bf_count-1)*(sdbf->bf_size);
+    uint32_t bits_set = bf_sha1_insert( curr_bf, 0, sha1_hash);
+    // Avoid potentially repetitive features
+    if( !bits_set)
+        return;
+    sdbf->last_count++;
+    if( sdbf->last_count == sdbf->max_elem) {
+        sdbf->bf_count++;
+        sdbf->last_count = 0;
+    }
+}
 
-	for( i=0; i<chunk_size-sdbf_sys.pop_win_size; i++) {
-		if( chunk_scores[i] > sdbf_sys.threshold) {
-			SHA1( file_buffer+chunk_pos+i, sdbf_sys.pop_win_size, (uint8_t *)sha1_hash);
-			uint32_t bits_set = bf_sha1_insert( curr_bf, 0, (uint32_t *)sha1_hash);
-            // Avoid potentially repetitive features
-			if( !bits_set)
-				continue;
-			last_count++;
-			// Todo: check curr_bf for size vs. alloc_buffer
-			if( last_count == sdbf_sys.max_elem) {
-				curr_bf += sdbf->bf_size;
-				bf_count++;
-				last_count = 0;
+/**
+ * Hash the pending batch of selected features and add them (in order) to a stream SDBF.
+ */
+static inline void gen_stream_flush( gen_scratch_t *scratch, sdbf_t *sdbf) {
+    uint32_t i;
+    feat_list_t *out = scratch->feat_out;
 
-			}
-		}
-	}
-	sdbf->bf_count = bf_count;
-	sdbf->last_count = last_count;//
+    FEAT_HASH_BATCH[scratch->hash_id]( scratch->feat_data, scratch->feat_cnt, scratch->feat_hash);
+    // Collect only (chunk-parallel mode); the features are merged in order later
+    if( out) {
+        if( out->count+scratch->feat_cnt > out->cap) {
+            out->cap = (out->cap < GEN_BATCH_SIZE) ? 64*GEN_BATCH_SIZE : 2*out->cap;
+            out->hashes = (uint32_t *)realloc_check( out->hashes, out->cap*5*sizeof( uint32_t));
+            if( !out->hashes) {
+                fprintf( stderr, "ERROR: Could not allocate feature list.\n");
+                exit(-1);
+            }
+        }
+        memcpy( out->hashes+5*out->count, scratch->feat_hash, scratch->feat_cnt*5*sizeof( uint32_t));
+        out->count += scratch->feat_cnt;
+    } else {
+        for( i=0; i<scratch->feat_cnt; i++)
+            gen_stream_insert( sdbf, scratch->feat_hash+5*i);
+    }
+    scratch->feat_cnt = 0;
 }
+
 /**
  * Generate SHA1 hashes and add them to the SDBF--block-aligned version.
+ * Candidates are hashed in batches and then inserted in order; since allowed can only go down,
+ * each batch is a superset of the features the sequential version would have hashed.
  */
 void gen_block_hash( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_num, const uint16_t *chunk_scores, \
 					 const uint64_t block_size, sdbf_t *sdbf, uint32_t rem, uint32_t threshold, int32_t allowed) {
 
     uint8_t  *bf = sdbf->buffer + block_num*(sdbf->bf_size);  // BF to be filled
     uint8_t  *data = file_buffer + block_num*block_size;  // Start of data
-    uint32_t  i, hash_cnt=0, sha1_hash[5];
+    uint32_t  i=0, j, cnt, batch_max, hash_cnt=0;
     uint32_t  max_offset = (rem > 0) ? rem : block_size;
+    const uint8_t *feat_data[GEN_BATCH_SIZE];
+    uint16_t  feat_score[GEN_BATCH_SIZE];
+    uint32_t  feat_hash[5*GEN_BATCH_SIZE];
 
-	for( i=0; i<max_offset-sdbf_sys.pop_win_size && hash_cnt<sdbf_sys.max_elem; i++) {
-		if(  chunk_scores[i] > threshold || 
-            (chunk_scores[i] == threshold && allowed > 0)) {
-                SHA1( data+i, sdbf_sys.pop_win_size, (uint8_t *)sha1_hash);
-                uint32_t bits_set = bf_sha1_insert( bf, 0, (uint32_t *)sha1_hash);
-                if( !bits_set)
-                    continue;
-                hash_cnt++;
-                if( chunk_scores[i] == threshold) 
-                    allowed--;
-		}
+	while( i<max_offset-sdbf_sys.pop_win_size && hash_cnt<sdbf->max_elem) {
+        // Never collect more candidates than there is room left in the BF
+        batch_max = sdbf->max_elem-hash_cnt;
+        batch_max = (batch_max < GEN_BATCH_SIZE) ? batch_max : GEN_BATCH_SIZE;
+        for( cnt=0; i<max_offset-sdbf_sys.pop_win_size && cnt<batch_max; i++) {
+            if(  chunk_scores[i] > threshold || 
+                (chunk_scores[i] == threshold && allowed > 0)) {
+                feat_data[cnt] = data+i;
+                feat_score[cnt++] = chunk_scores[i];
+            }
+        }
+        FEAT_HASH_BATCH[sdbf->hash_id]( feat_data, cnt, feat_hash);
+        for( j=0; j<cnt && hash_cnt<sdbf->max_elem; j++) {
+            if( feat_score[j] == threshold && allowed <= 0)
+                continue;
+            uint32_t bits_set = bf_sha1_insert( bf, 0, feat_hash+5*j);
+            if( !bits_set)
+                continue;
+            hash_cnt++;
+            if( feat_score[j] == threshold) 
+                allowed--;
+        }
 	}
     sdbf->elem_counts[block_num] = hash_cnt; 
 }
 
 /**
- * Generate SDBF hash for a buffer--stream version.
+ * Releases a thread's generation scratch space (pthread key destructor).
  */
-sdbf_t *gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf) {
-	assert( chunk_size > sdbf_sys.pop_win_size);
-    
-    uint32_t i, k, sum, allowed;
-    int32_t score_histo[66];  // Score histogram 
-    uint64_t buff_size = ((file_size >> 11) + 1) << 8; // Estimate sdbf size (reallocate later)
-    buff_size = (buff_size < 256) ? 256 : buff_size;                // Ensure min size
-    sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ZERO, buff_size, "gen_chunk_sdbf", "sdbf_buffer", ERROR_EXIT);
+static void gen_scratch_free( void *ptr) {
+    gen_scratch_t *scratch = (gen_scratch_t *)ptr;
+    if( scratch->block_scores)
+        free( scratch->block_scores);
+    if( scratch->stripe)
+        free( scratch->stripe);
+    if( scratch->dual_scratch)
+        gen_scratch_free( scratch->dual_scratch);
+    free( scratch);
+}
+
+static void gen_scratch_key_init() {
+    pthread_key_create( &scratch_key, gen_scratch_free);
+}
+
+/**
+ * Returns the calling thread's generation scratch space (allocated on first use).
+ */
+gen_scratch_t *gen_scratch_get() {
+    pthread_once( &scratch_once, gen_scratch_key_init);
+    gen_scratch_t *scratch = (gen_scratch_t *)pthread_getspecific( scratch_key);
+    if( !scratch) {
+        scratch = (gen_scratch_t *)alloc_check( ALLOC_ALIGN, sizeof( gen_scratch_t), "gen_scratch_get", "scratch", ERROR_EXIT);
+        pthread_setspecific( scratch_key, scratch);
+    }
+    return scratch;
+}
+
+static void gen_dual_blocks( gen_scratch_t *scratch, uint64_t pos, uint64_t size);
+
+/**
+ * Fused pass: rank the next stripe of (up to) ENTR_LANES sync blocks, starting at block-aligned position pos.
+ */
+static void gen_fill_stripe( gen_scratch_t *scratch, const uint8_t *chunk, const uint64_t chunk_size, uint64_t pos) {
+    uint64_t stripe_size = ENTR_LANES*sdbf_sys.block_size;
+
+    // A resumed pass may pick up mid-block: the entropy resyncs at block boundaries, so start from there
+    pos -= pos % sdbf_sys.block_size;
+
+    if( scratch->stripe_cap < stripe_size) {
+        if( scratch->stripe)
+            free( scratch->stripe);
+        scratch->stripe = (uint16_t *)alloc_check( ALLOC_ALIGN, stripe_size*sizeof( uint16_t), "gen_fill_stripe", "stripe", ERROR_EXIT);
+        scratch->stripe_cap = stripe_size;
+    }
+    stripe_size = (pos+stripe_size < chunk_size) ? stripe_size : chunk_size-pos;
+    if( scratch->rank_src) {
+        // dd block of a dual run: the stream ranks, except for windows that reach past the block
+        uint64_t entr_end = (chunk_size > sdbf_sys.entr_win_size) ? chunk_size-sdbf_sys.entr_win_size : 0;
+        uint64_t cnt = (entr_end > pos) ? entr_end-pos : 0;
+        cnt = (cnt < stripe_size) ? cnt : stripe_size;
+        memcpy( scratch->stripe, scratch->rank_src+pos, cnt*sizeof( uint16_t));
+        bzero( scratch->stripe+cnt, (stripe_size-cnt)*sizeof( uint16_t));
+    } else {
+        entr64_ranks( chunk, chunk_size-scratch->base, pos-scratch->base, stripe_size, sdbf_sys.block_size, scratch->stripe);
+    }
+    scratch->stripe_pos = pos;
+    scratch->stripe_end = pos+stripe_size;
+    if( scratch->dual)
+        gen_dual_blocks( scratch, pos, stripe_size);
+}
+
+/**
+ * Fused pass: move ranks into the ring up to (but not including) position rank_end.
+ * Slots are recycled, so all scores for positions below rank_end-GEN_RING_SIZE must have been emitted.
+ */
+static inline void gen_fill_ranks( gen_scratch_t *scratch, const uint8_t *chunk, const uint64_t chunk_size, uint64_t rank_end) {
+    uint64_t pos, cnt, slot;
+
+    // Copied in segments that end at the stripe end or where the ring wraps
+    for( pos=scratch->rank_end; pos<rank_end; pos+=cnt) {
+        if( pos == scratch->stripe_end)
+            gen_fill_stripe( scratch, chunk, chunk_size, pos);
+        slot = pos & GEN_RING_MASK;
+        cnt = ((rank_end < scratch->stripe_end) ? rank_end : scratch->stripe_end) - pos;
+        cnt = (cnt < GEN_RING_SIZE-slot) ? cnt : GEN_RING_SIZE-slot;
+        memcpy( scratch->ranks+slot, scratch->stripe+pos-scratch->stripe_pos, cnt*sizeof( uint16_t));
+        bzero( scratch->scores+slot, cnt*sizeof( uint16_t));
+    }
+    scratch->rank_end = rank_end;
+}
+
+/**
+ * Fused pass: hand over the (final) scores for positions [emit_pos, upto).
+ * In stream mode (sdbf or feat_out set), features above the threshold are queued for hashing;
+ * otherwise, scores are copied to the scratch block_scores array.
+ */
+static inline void gen_emit_scores( gen_scratch_t *scratch, const uint8_t *chunk, const uint64_t chunk_size, uint64_t upto, sdbf_t *sdbf) {
+    uint64_t pos;
+
+    if( !GEN_STREAM_MODE( scratch, sdbf)) {
+        for( pos=scratch->emit_pos; pos<upto; pos++)
+            scratch->block_scores[pos] = scratch->scores[pos & GEN_RING_MASK];
+    } else {
+        uint64_t hash_end = chunk_size-sdbf_sys.pop_win_size;
+        upto = (upto < hash_end) ? upto : hash_end;
+        for( pos=scratch->emit_pos; pos<upto; pos++) {
+            if( scratch->scores[pos & GEN_RING_MASK] > sdbf_sys.threshold) {
+                scratch->feat_data[scratch->feat_cnt++] = chunk+pos-scratch->base;
+                if( scratch->feat_cnt == GEN_BATCH_SIZE)
+                    gen_stream_flush( scratch, sdbf);
+            }
+        }
+    }
+    scratch->emit_pos = (upto > scratch->emit_pos) ? upto : scratch->emit_pos;
+}
+
+/**
+ * Make sure that the rank at position pos is available; pos_min is the lowest position still in use.
+ */
+static inline void gen_need_rank( gen_scratch_t *scratch, const uint8_t *chunk, const uint64_t chunk_size, uint64_t pos, uint64_t pos_min, sdbf_t *sdbf) {
+    if( pos >= scratch->rank_end) {
+        uint64_t rank_end = pos_min+GEN_RING_SIZE;
+        gen_emit_scores( scratch, chunk, chunk_size, pos_min, sdbf);
+        gen_fill_ranks( scratch, chunk, chunk_size, (rank_end < chunk_size) ? rank_end : chunk_size);
+    }
+}
 
-	// Chunk-based computation
-	uint64_t qt = file_size/chunk_size;
-	uint64_t rem = file_size % chunk_size;
+/**
+ * Fused pass: cheap slide of the popularity window past ranks that are not below the last minimum.
+ * Stops early (returns 0) if it would need a rank at or beyond rank_final (suspended pass).
+ */
+static inline int gen_pass_slide( gen_scratch_t *scratch, uint8_t *chunk, const uint64_t chunk_size, uint64_t rank_final, 
+                                  uint64_t *pos, uint64_t *min_pos, uint16_t min_rank, sdbf_t *sdbf) {
+    uint32_t pop_win = sdbf_sys.pop_win_size;
+    uint16_t *ranks = scratch->ranks, *scores = scratch->scores;
+    uint64_t i = *pos;
 
-	uint64_t chunk_pos = 0;
-	uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (chunk_size)*sizeof( uint16_t), "gen_chunk_sdbf", "chunk_ranks", ERROR_EXIT);
-	uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (chunk_size)*sizeof( uint16_t), "gen_chunk_sdbf", "chunk_scores", ERROR_EXIT);
+    while( ranks[(i+pop_win) & GEN_RING_MASK] >= min_rank && i<*min_pos && i<chunk_size-pop_win+1) {
+        if( ranks[(i+pop_win) & GEN_RING_MASK] == min_rank)
+            *min_pos = i+pop_win;
+        scores[*min_pos & GEN_RING_MASK]++;
+        i++;
+        if( rank_final < chunk_size && i+pop_win >= rank_final) {
+            *pos = i;
+            return 0;
+        }
+        gen_need_rank( scratch, chunk, chunk_size, i+pop_win, i, sdbf);
+    }
+    *pos = i;
+    return 1;
+}
 
-	for( i=0; i<qt; i++, chunk_pos+=chunk_size) {
-		gen_chunk_ranks( file_buffer+chunk_size*i, chunk_size, chunk_ranks, 0);
-        bzero( score_histo, sizeof( score_histo));
-		gen_chunk_scores( chunk_ranks, chunk_size, chunk_scores, score_histo);
+/**
+ * Fused pass: get ready for a new chunk.
+ */
+void gen_pass_reset( gen_scratch_t *scratch, sdbf_t *sdbf) {
+    scratch->rank_end = 0;
+    scratch->emit_pos = 0;
+    scratch->base = 0;
+    if( sdbf)
+        scratch->hash_id = sdbf->hash_id;
+    scratch->stripe_pos = scratch->stripe_end = 0;
+    gen_minq_reset( &scratch->minq);
+    bzero( &scratch->loop, sizeof( gen_loop_t));
+}
 
-        // Calculate thresholding paremeters
-        for( k=65, sum=0; k>=sdbf_sys.threshold; k--) {
-            if( (sum <= sdbf_sys.max_elem) && (sum+score_histo[k] > sdbf_sys.max_elem))
+/**
+ * Streaming rank/score pass over a chunk of chunk_size bytes (chunk holds the bytes from position scratch->base),
+ * picking up where the last call left off. Only ranks below rank_final are final: if rank_final < chunk_size, the
+ * chunk continues past the available data & the pass is suspended before it depends on any other rank (it can
+ * be resumed once more data is available). Returns 1 if the chunk is done, 0 if the pass was suspended.
+ */
+int gen_pass_run( uint8_t *chunk, const uint64_t chunk_size, uint64_t rank_final, gen_scratch_t *scratch, sdbf_t *sdbf) {
+    uint32_t pop_win = sdbf_sys.pop_win_size;
+    uint16_t *ranks = scratch->ranks, *scores = scratch->scores;
+    uint64_t i = scratch->loop.i, min_pos = scratch->loop.min_pos;
+    uint16_t min_rank = scratch->loop.min_rank;
+    // An iteration at i reads ranks up to i+2*pop_win-1 (cheap slide to the previous minimum & the window after it)
+    uint64_t stop = (rank_final >= chunk_size) ? chunk_size-pop_win : (rank_final > 2*pop_win) ? rank_final-2*pop_win : 0;
+
+    if( rank_final >= chunk_size && chunk_size <= pop_win) {
+        if( !GEN_STREAM_MODE( scratch, sdbf))
+            bzero( scratch->block_scores, chunk_size*sizeof( uint16_t));
+        return 1;
+    }
+    if( !scratch->loop.started) {
+        if( !stop)
+            return 0;
+        gen_fill_ranks( scratch, chunk, chunk_size, (GEN_RING_SIZE < chunk_size) ? GEN_RING_SIZE : chunk_size);
+        min_rank = ranks[0];
+        scratch->loop.started = 1;
+    }
+    for( ; i<stop || scratch->loop.sliding; i++) {
+        // A suspended slide goes on once the rank after the window is final
+        if( scratch->loop.sliding && rank_final < chunk_size && i+pop_win >= rank_final)
+            break;
+        scratch->loop.sliding = 0;
+        gen_need_rank( scratch, chunk, chunk_size, i+pop_win, i, sdbf);
+        // try sliding on the cheap    
+        if( i>0 && min_rank>0) {
+            if( !gen_pass_slide( scratch, chunk, chunk_size, rank_final, &i, &min_pos, min_rank, sdbf)) {
+                scratch->loop.sliding = 1;
                 break;
-            sum += score_histo[k];
+            }
+        }      
+        min_rank = gen_minq_window( &scratch->minq, ranks, GEN_RING_MASK, i, pop_win, &min_pos);
+        if( min_rank > 0) {
+            scores[min_pos & GEN_RING_MASK]++;
+        } else {
+            // Featureless stretch (e.g., a run of a single byte value): windows starting on a zero rank score nothing
+            while( i+1 < stop && i+1 < scratch->rank_end && !ranks[(i+1) & GEN_RING_MASK])
+                i++;
         }
-        allowed = sdbf_sys.max_elem-sum;
-		gen_chunk_hash( file_buffer, chunk_pos, chunk_scores, chunk_size, sdbf);
-	} 
-	if( rem > 0) {
-		gen_chunk_ranks( file_buffer+qt*chunk_size, rem, chunk_ranks, 0);
-		gen_chunk_scores( chunk_ranks, rem, chunk_scores, 0);
-		gen_chunk_hash( file_buffer, chunk_pos, chunk_scores, rem, sdbf);
-	}
+    }
+    scratch->loop.i = i;
+    scratch->loop.min_pos = min_pos;
+    scratch->loop.min_rank = min_rank;
+    if( rank_final < chunk_size) {
+        // Suspended: hand over the final scores & forget the ranks that are not final
+        gen_emit_scores( scratch, chunk, chunk_size, i, sdbf);
+        if( GEN_STREAM_MODE( scratch, sdbf))
+            gen_stream_flush( scratch, sdbf);
+        scratch->rank_end = (scratch->rank_end < rank_final) ? scratch->rank_end : rank_final;
+        scratch->stripe_pos = scratch->stripe_end = scratch->rank_end;
+        return 0;
+    }
+    gen_emit_scores( scratch, chunk, chunk_size, chunk_size, sdbf);
+    if( GEN_STREAM_MODE( scratch, sdbf))
+        gen_stream_flush( scratch, sdbf);
+    return 1;
+}
+
+/**
+ * Single streaming rank/score pass over a chunk using a small ring buffer (stays in L1).
+ * Produces exactly the same scores as ranking the whole chunk & then scoring it (see test_scores.c); a score
+ * is final as soon as the popularity window has moved past it, at which point it is handed over.
+ */
+void gen_chunk_pass( uint8_t *chunk, const uint64_t chunk_size, gen_scratch_t *scratch, sdbf_t *sdbf) {
+    gen_pass_reset( scratch, sdbf);
+    gen_pass_run( chunk, chunk_size, chunk_size, scratch, sdbf);
+}
+
+/**
+ * Allocate the BF buffer for a stream SDBF (based on an estimate of its final size).
+ */
+uint64_t gen_chunk_alloc( uint64_t file_size, sdbf_t *sdbf) {
+    uint64_t buff_size = ((file_size >> 11) + 1) << 8; // Estimate sdbf size (reallocate later)
+    buff_size = (buff_size < 256) ? 256 : buff_size;                // Ensure min size
+    sdbf->buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, buff_size, "gen_chunk_sdbf", "sdbf_buffer", ERROR_EXIT);
+    return buff_size;
+}
+
+/**
+ * Make room in the BF buffer of a stream SDBF (of buff_size bytes) for the BFs of another chunk_size bytes of
+ * input, for inputs of unknown size; returns the new buffer size. Grows at least 2x, so the copies add up to O(final size).
+ */
+uint64_t gen_chunk_grow( sdbf_t *sdbf, uint64_t buff_size, uint64_t chunk_size) {
+    uint64_t new_size = sdbf->bf_count*sdbf->bf_size + (((chunk_size >> 11) + 1) << 8);
+
+    if( new_size <= buff_size)
+        return buff_size;
+    new_size = (new_size < 2*buff_size) ? 2*buff_size : new_size;
+    uint8_t *grown = (uint8_t *)alloc_check( ALLOC_ALIGN, new_size, "gen_chunk_grow", "sdbf_buffer", ERROR_EXIT);
+    memcpy( grown, sdbf->buffer, buff_size);
+    free( sdbf->buffer);
+    sdbf->buffer = grown;
+    return new_size;
+}
 
-	// Chop off last BF if its membership is too low (eliminates some FPs)
+/**
+ * Chop off last BF if its membership is too low (eliminates some FPs)
+ */
+static void gen_chunk_chop( sdbf_t *sdbf) {
 	if( sdbf->bf_count > 1 && sdbf->last_count < sdbf->max_elem/8) {
 		sdbf->bf_count = sdbf->bf_count-1;
-		sdbf->last_count = sdbf_sys.max_elem;
+		sdbf->last_count = sdbf->max_elem;
 	}
-	// Trim BF allocation to size
+}
+
+/**
+ * Finish a stream SDBF: drop a sparse last BF & trim the allocation.
+ */
+void gen_chunk_finish( sdbf_t *sdbf, uint64_t buff_size) {
+	gen_chunk_chop( sdbf);
+	// Trim BF allocation to size (copy rather than realloc to keep the buffer aligned)
 	if( sdbf->bf_count*sdbf->bf_size < buff_size) {
-		sdbf->buffer = realloc_check( sdbf->buffer, (sdbf->bf_count*sdbf->bf_size));
+		uint8_t *trimmed = (uint8_t *)alloc_check( ALLOC_ALIGN, sdbf->bf_count*sdbf->bf_size, "gen_chunk_sdbf", "sdbf_buffer", ERROR_EXIT);
+		memcpy( trimmed, sdbf->buffer, sdbf->bf_count*sdbf->bf_size);
+		free( sdbf->buffer);
+		sdbf->buffer = trimmed;
 	}
-	free( chunk_ranks);
-	free( chunk_scores);
+}
 
-	return sdbf;
+/**
+ * Resumable stream SDBF: load the suspended pass over the current chunk into scratch space.
+ */
+static void gen_state_load( gen_scratch_t *scratch, const sdbf_state_t *state, sdbf_t *sdbf) {
+    gen_pass_reset( scratch, sdbf);
+    memcpy( scratch->ranks, state->ranks, sizeof( state->ranks));
+    memcpy( scratch->scores, state->scores, sizeof( state->scores));
+    scratch->minq = state->minq;
+    scratch->loop = state->loop;
+    scratch->rank_end = state->rank_end;
+    scratch->emit_pos = state->emit_pos;
+    scratch->stripe_pos = scratch->stripe_end = state->rank_end;
+    scratch->base = state->tail_pos;
 }
+
 /**
- * Generate SDBF hash for a buffer--block version.
+ * Resumable stream SDBF: save the suspended pass over the current chunk (held in buffer, from chunk position
+ * scratch->base) & the digest so far. Only the bytes that the pass may still need are kept; returns -1 if they
+ * do not fit in the state, else 0.
  */
-sdbf_t *gen_block_sdbf( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_size, sdbf_t *sdbf) {
-  
-    uint32_t i, k, sum, allowed;
-    int32_t score_histo[66];
+static int gen_state_save( sdbf_state_t *state, const gen_scratch_t *scratch, const uint8_t *buffer, sdbf_t *sdbf) {
+    uint64_t tail_pos = (scratch->emit_pos < scratch->rank_end) ? scratch->emit_pos : scratch->rank_end;
+
+    // Ranks are regenerated from the start of their sync block
+    tail_pos -= tail_pos % sdbf_sys.block_size;
+    if( state->chunk_len-tail_pos > STATE_TAIL_SIZE)
+        return -1;
+    memmove( state->tail, buffer+tail_pos-scratch->base, state->chunk_len-tail_pos);
+    state->tail_pos = tail_pos;
+    memcpy( state->ranks, scratch->ranks, sizeof( state->ranks));
+    memcpy( state->scores, scratch->scores, sizeof( state->scores));
+    state->minq = scratch->minq;
+    state->loop = scratch->loop;
+    state->rank_end = scratch->rank_end;
+    state->emit_pos = scratch->emit_pos;
+    state->bf_count = sdbf->bf_count;
+    state->last_count = sdbf->last_count;
+    memcpy( state->last_bf, sdbf->buffer+(sdbf->bf_count-1)*sdbf->bf_size, sdbf->bf_size);
+    return 0;
+}
+
+/**
+ * Resumable stream SDBF: check that a state read back from a file is one that gen_state_save() could have
+ * produced for the SDBF (the pass indexes its rings & the tail with these positions). Returns 1 if so.
+ */
+int gen_state_check( const sdbf_state_t *state, const sdbf_t *sdbf) {
+    const gen_minq_t *q = &state->minq;
+    uint64_t k;
+
+    if( state->chunk_len >= STREAM_CHUNK_SIZE || state->total < state->chunk_len ||
+        state->rank_end > state->chunk_len || state->emit_pos > state->rank_end || state->rank_end-state->emit_pos > GEN_RING_SIZE ||
+        state->tail_pos > state->emit_pos || state->chunk_len-state->tail_pos > STATE_TAIL_SIZE)
+        return 0;
+    if( state->loop.i > state->rank_end || state->loop.min_pos > state->loop.i+sdbf_sys.pop_win_size ||
+        state->loop.started > 1 || state->loop.sliding > 1)
+        return 0;
+    if( q->head > q->tail || q->tail-q->head > GEN_MINQ_SIZE || q->next > state->rank_end)
+        return 0;
+    for( k=q->head; k<q->tail; k++)
+        if( q->end[k & GEN_MINQ_MASK] >= q->next)
+            return 0;
+    return state->bf_count && state->last_count <= sdbf->max_elem;
+}
+
+/**
+ * Resumable stream SDBF: take the digest back to the state as of the last update (before the tail of the
+ * current chunk was hashed) & make sure that the BF buffer is known to hold at least the committed BFs.
+ */
+static void gen_state_rewind( sdbf_t *sdbf, sdbf_state_t *state) {
+    uint64_t bf_size = sdbf->bf_size, end = (sdbf->bf_count+1)*bf_size;
+
+    if( state->buff_size < state->bf_count*bf_size) {
+        // Unknown allocation (state read back): copy what the digest has
+        uint64_t size = ((state->bf_count > sdbf->bf_count) ? state->bf_count : sdbf->bf_count)*bf_size;
+        uint8_t *grown = (uint8_t *)alloc_check( ALLOC_ALIGN, size, "gen_state_rewind", "sdbf_buffer", ERROR_EXIT);
+        memcpy( grown, sdbf->buffer, sdbf->bf_count*bf_size);
+        free( sdbf->buffer);
+        sdbf->buffer = grown;
+        state->buff_size = size;
+    }
+    // The tail may have filled the last BF & started another one (which may have been chopped off)
+    end = (end < state->buff_size) ? end : state->buff_size;
+    if( end > state->bf_count*bf_size)
+        bzero( sdbf->buffer+state->bf_count*bf_size, end-state->bf_count*bf_size);
+    memcpy( sdbf->buffer+(state->bf_count-1)*bf_size, state->last_bf, bf_size);
+    sdbf->bf_count = state->bf_count;
+    sdbf->last_count = state->last_count;
+}
+
+/**
+ * Append len bytes to a resumable stream SDBF. The pass over the current chunk is resumed, runs as far as the 
+ * data allows & is suspended again; the digest is then finished off with the tail of the chunk. The result is
+ * the same as hashing all of the data from scratch, for the cost of hashing the new bytes (plus a few KB).
+ * Returns -1 if the state could not be saved (the SDBF cannot be resumed), else 0.
+ */
+int gen_stream_update( sdbf_t *sdbf, sdbf_state_t *state, const uint8_t *data, uint64_t len) {
+    gen_scratch_t *scratch = gen_scratch_get();
+    uint64_t tail_len = state->chunk_len-state->tail_pos, take, rank_final;
+    uint64_t piece = (len < STREAM_CHUNK_SIZE) ? len : STREAM_CHUNK_SIZE;
+    // Tail of the current chunk + new bytes (+ the same padding as a mapped file has)
+    uint8_t *buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, STATE_TAIL_SIZE+piece+FILE_PAGE_SIZE, "gen_stream_update", "buffer", ERROR_EXIT);
+
+    gen_state_rewind( sdbf, state);
+    gen_state_load( scratch, state, sdbf);
+    memcpy( buffer, state->tail, tail_len);
+    do {
+        take = STREAM_CHUNK_SIZE-state->chunk_len;
+        take = (len < take) ? len : take;
+        memcpy( buffer+tail_len, data, take);
+        bzero( buffer+tail_len+take, FILE_PAGE_SIZE);
+        data += take;
+        len -= take;
+        state->chunk_len += take;
+        state->total += take;
+        state->buff_size = gen_chunk_grow( sdbf, state->buff_size, tail_len+take);
+        if( state->chunk_len == STREAM_CHUNK_SIZE) {
+            // Chunk complete: on to the next one
+            gen_pass_run( buffer, STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE, scratch, sdbf);
+            gen_pass_reset( scratch, sdbf);
+            state->chunk_len = 0;
+        } else {
+            // Only ranks of windows that end within the data are final
+            rank_final = (state->chunk_len > sdbf_sys.entr_win_size) ? state->chunk_len-sdbf_sys.entr_win_size : 0;
+            gen_pass_run( buffer, state->chunk_len, rank_final, scratch, sdbf);
+        }
+        if( gen_state_save( state, scratch, buffer, sdbf)) {
+            free( buffer);
+            return -1;
+        }
+        tail_len = state->chunk_len-state->tail_pos;
+        memcpy( buffer, state->tail, tail_len);
+    } while( len);
+    // Live digest: the chunk (so far) is finished off with a throwaway copy of the pass
+    if( state->chunk_len) {
+        gen_state_load( scratch, state, sdbf);
+        gen_pass_run( buffer, state->chunk_len, state->chunk_len, scratch, sdbf);
+    }
+    gen_chunk_chop( sdbf);
+    free( buffer);
+    return 0;
+}
+
+/**
+ * Generate SDBF hash for a buffer--stream version (dual != NULL: dd blocks are generated along the way).
+ */
+static sdbf_t *gen_chunk_sdbf_one( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf, const gen_dual_t *dual) {
+	assert( chunk_size > sdbf_sys.pop_win_size);
     
-	// Block-based computation
-	uint64_t qt = file_size/block_size;
-	uint64_t rem = file_size % block_size;
+    uint64_t buff_size = gen_chunk_alloc( file_size, sdbf);
+
+	// Chunk-based computation (chunks are processed independently in a single fused pass each)
+	gen_scratch_t *scratch = gen_scratch_get();
+	uint64_t chunk_pos;
+    scratch->dual = dual;
+	for( chunk_pos=0; chunk_pos<file_size; chunk_pos+=chunk_size) {
+		uint64_t size = (file_size-chunk_pos < chunk_size) ? file_size-chunk_pos : chunk_size;
+        scratch->dual_pos = chunk_pos;
+		gen_chunk_pass( file_buffer+chunk_pos, size, scratch, sdbf);
+	}
+    scratch->dual = NULL;
+	gen_chunk_finish( sdbf, buff_size);
+	return sdbf;
+}
 
-	uint64_t chunk_pos = 0;
-	uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_ranks", ERROR_EXIT);
-	uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_scores", ERROR_EXIT);
+/**
+ * Generate SDBF hash for a buffer--stream version.
+ */
+sdbf_t *gen_chunk_sdbf( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf) {
+    return gen_chunk_sdbf_one( file_buffer, file_size, chunk_size, sdbf, NULL);
+}
 
-	for( i=0; i<qt; i++, chunk_pos+=block_size) {
-		gen_chunk_ranks( file_buffer+block_size*i, block_size, chunk_ranks, 0);
-        bzero( score_histo, sizeof( score_histo));
-		gen_chunk_scores( chunk_ranks, block_size, chunk_scores, score_histo);
+/**
+ * Worker thread for chunk-parallel stream hash generation: claims chunks in order and collects their features.
+ */
+void *thread_gen_chunk_sdbf( void *task_param) {
+    chunkhash_task_t *task = (chunkhash_task_t *)task_param;
+	gen_scratch_t *scratch = gen_scratch_get();
+    uint64_t chunk;
 
-        // Calculate thresholding paremeters
-        for( k=65, sum=0; k>=sdbf_sys.threshold; k--) {
-            if( (sum <= sdbf_sys.max_elem) && (sum+score_histo[k] > sdbf_sys.max_elem))
-                break;
-            sum += score_histo[k];
+    while( 1) {
+        pthread_mutex_lock( &task->mutex);
+        while( task->next_chunk < task->chunk_count && task->next_chunk >= task->merged+task->window)
+            pthread_cond_wait( &task->cond, &task->mutex);
+        if( task->next_chunk >= task->chunk_count) {
+            pthread_mutex_unlock( &task->mutex);
+            break;
         }
-        allowed = sdbf_sys.max_elem-sum;
-		gen_block_hash( file_buffer, file_size, i, chunk_scores, block_size, sdbf, 0, k, allowed);
-	} 
-	if( rem >= MIN_FILE_SIZE) {
-		gen_chunk_ranks( file_buffer+block_size*qt, rem, chunk_ranks, 0);
-		gen_chunk_scores( chunk_ranks, rem, chunk_scores, NULL);
-		gen_block_hash( file_buffer, file_size, qt, chunk_scores, block_size, sdbf, rem, sdbf_sys.threshold, sdbf_sys.max_elem);     
+        chunk = task->next_chunk++;
+        pthread_mutex_unlock( &task->mutex);
+
+        uint64_t chunk_pos = chunk*task->chunk_size;
+		uint64_t size = (task->file_size-chunk_pos < task->chunk_size) ? task->file_size-chunk_pos : task->chunk_size;
+        scratch->feat_out = task->results + chunk % task->window;
+        scratch->feat_out->count = 0;
+        scratch->hash_id = task->hash_id;
+        scratch->dual = task->dual;
+        scratch->dual_pos = chunk_pos;
+		gen_chunk_pass( task->buffer+chunk_pos, size, scratch, NULL);
+        scratch->feat_out = NULL;
+        scratch->dual = NULL;
+
+        pthread_mutex_lock( &task->mutex);
+        task->done[chunk % task->window] = 1;
+        pthread_cond_broadcast( &task->cond);
+        pthread_mutex_unlock( &task->mutex);
     }
-	free( chunk_ranks);
-	free( chunk_scores);
+    return NULL;
+}
+
+/**
+ * Collects the features of one chunk of a buffer (in file order) for a later gen_chunk_merge().
+ */
+void gen_chunk_feats( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, uint64_t chunk, uint32_t hash_id, feat_list_t *feats) {
+	gen_scratch_t *scratch = gen_scratch_get();
+    uint64_t chunk_pos = chunk*chunk_size;
+    uint64_t size = (file_size-chunk_pos < chunk_size) ? file_size-chunk_pos : chunk_size;
+
+    scratch->feat_out = feats;
+    scratch->feat_out->count = 0;
+    scratch->hash_id = hash_id;
+    gen_chunk_pass( file_buffer+chunk_pos, size, scratch, NULL);
+    scratch->feat_out = NULL;
+}
+
+/**
+ * Adds the features of a chunk to a stream SDBF; chunks must be merged in file order.
+ */
+void gen_chunk_merge( sdbf_t *sdbf, const feat_list_t *feats) {
+    uint64_t i;
+
+    for( i=0; i<feats->count; i++)
+        gen_stream_insert( sdbf, feats->hashes+5*i);
+}
+
+/**
+ * Generate SDBF hash for a buffer--stream version, chunk-parallel. Workers produce the feature
+ * sequence of each chunk; the calling thread replays them in file order through the same BF-filling
+ * logic, so the result is identical to gen_chunk_sdbf(). 
+ */
+static sdbf_t *gen_chunk_sdbf_run( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf, uint32_t thread_cnt, 
+                                   const gen_dual_t *dual) {
+	uint64_t chunk_count = (file_size+chunk_size-1)/chunk_size;
+    // The calling thread merges, so the chunks need pool workers
+    if( thread_cnt < 2 || chunk_count < 2 || !pool_size())
+        return gen_chunk_sdbf_one( file_buffer, file_size, chunk_size, sdbf, dual);
+
+    uint64_t i, c, buff_size = gen_chunk_alloc( file_size, sdbf);
+    chunkhash_task_t task;
+    bzero( &task, sizeof( task));
+    task.buffer = file_buffer;
+    task.file_size = file_size;
+    task.chunk_size = chunk_size;
+    task.chunk_count = chunk_count;
+    task.window = 2*thread_cnt;
+    task.hash_id = sdbf->hash_id;
+    task.dual = dual;
+    task.results = (feat_list_t *)alloc_check( ALLOC_ZERO, task.window*sizeof( feat_list_t), "gen_chunk_sdbf_mt", "task.results", ERROR_EXIT);
+    task.done = (uint8_t *)alloc_check( ALLOC_ZERO, task.window, "gen_chunk_sdbf_mt", "task.done", ERROR_EXIT);
+    pthread_mutex_init( &task.mutex, NULL);
+    pthread_cond_init( &task.cond, NULL);
+
+    pool_job_t jobs[MAX_THREADS];
+    pool_batch_t batch;
+    thread_cnt = (thread_cnt > MAX_THREADS) ? MAX_THREADS : thread_cnt;
+    pool_submit( &batch, jobs, thread_gen_chunk_sdbf, (void *)&task, 0, thread_cnt);
+    // Deterministic merge, in chunk order
+    for( c=0; c<chunk_count; c++) {
+        feat_list_t *result = task.results + c % task.window;
+        pthread_mutex_lock( &task.mutex);
+        while( !task.done[c % task.window])
+            pthread_cond_wait( &task.cond, &task.mutex);
+        pthread_mutex_unlock( &task.mutex);
+
+        gen_chunk_merge( sdbf, result);
+
+        pthread_mutex_lock( &task.mutex);
+        task.done[c % task.window] = 0;
+        task.merged++;
+        pthread_cond_broadcast( &task.cond);
+        pthread_mutex_unlock( &task.mutex);
+    }
+    pool_wait( &batch);
+    for( i=0; i<task.window; i++) {
+        if( task.results[i].hashes)
+            free( task.results[i].hashes);
+    }
+    free( task.results);
+    free( task.done);
+    pthread_mutex_destroy( &task.mutex);
+    pthread_cond_destroy( &task.cond);
+
+	gen_chunk_finish( sdbf, buff_size);
 	return sdbf;
 }
+
 /**
- * Worker thread for multi-threaded block hash generation.
+ * Generate SDBF hash for a buffer--stream version, using up to thread_cnt threads.
  */
-void *thread_gen_block_sdbf( void *task_param) {
+sdbf_t *gen_chunk_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t chunk_size, sdbf_t *sdbf, uint32_t thread_cnt) {
+    return gen_chunk_sdbf_run( file_buffer, file_size, chunk_size, sdbf, thread_cnt, NULL);
+}
+
+/**
+ * Generate the BF for a single block (rem > 0 indicates a partial tail block of rem bytes).
+ */
+static void gen_block_one( uint8_t *file_buffer, uint64_t file_size, uint64_t block_num, uint64_t block_size, uint32_t rem, 
+                           sdbf_t *sdbf, gen_scratch_t *scratch) {
     uint32_t i, k, sum, allowed;
     int32_t  score_histo[66];
+
+    if( scratch->block_cap < block_size) {
+        if( scratch->block_scores)
+            free( scratch->block_scores);
+        scratch->block_scores = (uint16_t *)alloc_check( ALLOC_ALIGN, block_size*sizeof( uint16_t), "gen_block_one", "block_scores", ERROR_EXIT);
+        scratch->block_cap = block_size;
+    }
+    // A block holding a single byte value has no features (its BF & element count stay 0)
+    if( entr64_flat_end( file_buffer+block_size*block_num, 0, (rem > 0) ? rem : block_size) == ((rem > 0) ? rem : block_size))
+        return;
+    if( rem > 0) {
+        gen_chunk_pass( file_buffer+block_size*block_num, rem, scratch, NULL);
+        gen_block_hash( file_buffer, file_size, block_num, scratch->block_scores, block_size, sdbf, rem, sdbf_sys.threshold, sdbf->max_elem);     
+        return;
+    }
+    gen_chunk_pass( file_buffer+block_size*block_num, block_size, scratch, NULL);
+
+    // Calculate thresholding paremeters
+    bzero( score_histo, sizeof( score_histo));
+    for( i=0; i<block_size-sdbf_sys.pop_win_size; i++)
+        score_histo[scratch->block_scores[i]]++;
+    for( k=65, sum=0; k>=sdbf_sys.threshold; k--) {
+        if( (sum <= sdbf->max_elem) && (sum+score_histo[k] > sdbf->max_elem))
+            break;
+        sum += score_histo[k];
+    }
+    allowed = sdbf->max_elem-sum;
+    gen_block_hash( file_buffer, file_size, block_num, scratch->block_scores, block_size, sdbf, 0, k, allowed);
+}
+
+/**
+ * Generate SDBF hash for a buffer--block version.
+ */
+sdbf_t *gen_block_sdbf( uint8_t *file_buffer, uint64_t file_size, const uint64_t block_size, sdbf_t *sdbf) {
+    return gen_block_sdbf_mt( file_buffer, file_size, block_size, sdbf, 1);
+}
+
+/**
+ * Worker thread for block fingerprinting (first phase of block hash generation).
+ */
+void *thread_gen_block_fp( void *task_param) {
     blockhash_task_t *hashtask = (blockhash_task_t *)task_param;
-    uint64_t block_size = hashtask->block_size;
-    uint8_t *buffer = hashtask->buffer;
-    uint64_t file_size = hashtask->file_size;
-    
-	uint64_t qt = file_size/block_size;
-	uint64_t rem = file_size % block_size;
+	uint64_t i, qt = hashtask->file_size/hashtask->block_size;
+
+	for( i=hashtask->tid; i<qt; i+=hashtask->tcount)
+		xxh3_fingerprint( hashtask->buffer + i*hashtask->block_size, hashtask->block_size, hashtask->fp+2*i);
+	return NULL;
+}
+
+/**
+ * Worker thread for multi-threaded block hash generation; blocks that repeat an earlier one are left out.
+ */
+void *thread_gen_block_sdbf( void *task_param) {
+    blockhash_task_t *hashtask = (blockhash_task_t *)task_param;
+	gen_scratch_t *scratch = gen_scratch_get();
+	uint64_t i, qt = hashtask->file_size/hashtask->block_size;
+
+	for( i=hashtask->tid; i<qt; i+=hashtask->tcount) {
+		if( hashtask->src[i] == i)
+			gen_block_one( hashtask->buffer, hashtask->file_size, i, hashtask->block_size, 0, hashtask->sdbf, scratch);
+	} 
+	return NULL;
+}
+
+/**
+ * Runs one phase of block hash generation as thread_cnt pool jobs (on the calling thread if there is just one).
+ */
+static void gen_block_run( blockhash_task_t *tasks, uint32_t thread_cnt, void *(*worker)( void *)) {
+    pool_run( worker, tasks, sizeof( blockhash_task_t), thread_cnt);
+}
+
+/**
+ * Finds the blocks whose contents repeat an earlier block: src[i] is set to the first such block, or i itself.
+ * Fingerprint matches are confirmed by comparing the blocks. Returns the number of repeated blocks.
+ */
+static uint64_t gen_block_dedup( const uint8_t *file_buffer, uint64_t block_size, uint64_t block_cnt, const uint64_t *fp, uint64_t *src) {
+    uint64_t i, slot, mask, reused = 0, *table;
 
-	uint64_t chunk_pos = 0;
-	uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_ranks", ERROR_EXIT);
-	uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (block_size)*sizeof( uint16_t), "gen_block_sdbf", "chunk_scores", ERROR_EXIT);
-
-	for( i=hashtask->tid; i<qt; i+=hashtask->tcount, chunk_pos+=hashtask->tcount*block_size) {
-		gen_chunk_ranks( buffer+block_size*i, block_size, chunk_ranks, 0);
-        bzero( score_histo, sizeof( score_histo));
-		gen_chunk_scores( chunk_ranks, block_size, chunk_scores, score_histo);
-        // Calculate thresholding paremeters
-        for( k=65, sum=0; k>=sdbf_sys.threshold; k--) {
-            if( (sum <= sdbf_sys.max_elem) && (sum+score_histo[k] > sdbf_sys.max_elem))
+    for( mask=1; mask < 2*block_cnt; mask <<= 1)
+        ;
+    table = (uint64_t *)alloc_check( ALLOC_ZERO, mask*sizeof( uint64_t), "gen_block_dedup", "table", ERROR_EXIT);
+    mask--;
+    // Open addressing; entries are block numbers + 1 (0 is an empty slot)
+    for( i=0; i<block_cnt; i++) {
+        for( slot=fp[2*i] & mask; table[slot]; slot=(slot+1) & mask) {
+            uint64_t prev = table[slot]-1;
+            if( fp[2*prev] == fp[2*i] && fp[2*prev+1] == fp[2*i+1] && 
+                !memcmp( file_buffer+prev*block_size, file_buffer+i*block_size, block_size))
                 break;
-            sum += score_histo[k];
         }
-        allowed = sdbf_sys.max_elem-sum;
-		gen_block_hash( buffer, file_size, i, chunk_scores, block_size, hashtask->sdbf, 0, k, allowed);
-	} 
-	free( chunk_ranks);
-	free( chunk_scores);
+        if( table[slot]) {
+            src[i] = table[slot]-1;
+            reused++;
+        } else {
+            table[slot] = i+1;
+            src[i] = i;
+        }
+    }
+    free( table);
+    return reused;
 }
 
-sdbf_t *gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, sdbf_t *sdbf, uint32_t thread_cnt) {
-    if( thread_cnt < 2)
-        return gen_block_sdbf( file_buffer, file_size, block_size, sdbf);
-        
-    blockhash_task_t *tasks = (blockhash_task_t *) alloc_check( ALLOC_ONLY, thread_cnt*sizeof( blockhash_task_t), "gen_block_sdbf_mt", "tasks", ERROR_EXIT);
-    thread_pool = (pthread_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( pthread_t), "gen_block_sdbf_mt", "thread_pool", ERROR_EXIT);
-    int t;
+/**
+ * Fingerprints the full blocks of a buffer (on thread_cnt threads) and finds the repeated ones; see gen_block_dedup().
+ * Returns the src array (NULL if there are no full blocks); *reused is set to the number of repeated blocks.
+ */
+static uint64_t *gen_block_src( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, uint32_t thread_cnt, uint64_t *reused) {
+    uint64_t qt = file_size/block_size, *src;
+    uint32_t t;
+
+    *reused = 0;
+    if( !qt)
+        return NULL;
+    blockhash_task_t *tasks = (blockhash_task_t *) alloc_check( ALLOC_ONLY, thread_cnt*sizeof( blockhash_task_t), "gen_block_src", "tasks", ERROR_EXIT);
+    uint64_t *fp = (uint64_t *)alloc_check( ALLOC_ONLY, 2*qt*sizeof( uint64_t), "gen_block_src", "fp", ERROR_EXIT);
+    src = (uint64_t *)alloc_check( ALLOC_ONLY, qt*sizeof( uint64_t), "gen_block_src", "src", ERROR_EXIT);
     for( t=0; t<thread_cnt; t++) {
 		tasks[t].tid = t;
 		tasks[t].tcount = thread_cnt;
         tasks[t].buffer = file_buffer;
         tasks[t].file_size = file_size;
         tasks[t].block_size = block_size;
-        tasks[t].sdbf = sdbf;
-        if( pthread_create( &thread_pool[t], NULL, thread_gen_block_sdbf, (void *)(tasks+t) )) {
-            fprintf( stderr, "ERROR: Could not create thread.\n");
-            exit(-1);
-        }
+        tasks[t].fp = fp;
  	}
-    for( t=0; t<thread_cnt; t++) {
-        pthread_join( thread_pool[t], NULL);
+    gen_block_run( tasks, thread_cnt, thread_gen_block_fp);
+    *reused = gen_block_dedup( file_buffer, block_size, qt, fp, src);
+    free( fp);
+    free( tasks);
+    return src;
+}
+
+/**
+ * Copies the BF & element count of the first occurrence to each repeated block (block_cnt full blocks).
+ */
+static void gen_block_reuse( sdbf_t *sdbf, const uint64_t *src, uint64_t block_cnt) {
+    uint64_t i;
+
+    for( i=0; i<block_cnt; i++) {
+        if( src[i] == i)
+            continue;
+        memcpy( sdbf->buffer + i*sdbf->bf_size, sdbf->buffer + src[i]*sdbf->bf_size, sdbf->bf_size);
+        sdbf->elem_counts[i] = sdbf->elem_counts[src[i]];
     }
-    // Deal with the "tail" if necessary
-  	uint64_t qt = file_size/block_size;
+}
+
+/**
+ * Generate SDBF hash for a buffer--block version, using up to thread_cnt threads. Blocks are fingerprinted 
+ * first; a block with the same contents as an earlier one gets a copy of its BF instead of being hashed again.
+ */
+sdbf_t *gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t block_size, sdbf_t *sdbf, uint32_t thread_cnt) {
+  	uint64_t reused, qt = file_size/block_size;
 	uint64_t rem = file_size % block_size;
+    uint32_t t;
 
+    thread_cnt = (thread_cnt < 1) ? 1 : thread_cnt;
+    uint64_t *src = gen_block_src( file_buffer, file_size, block_size, thread_cnt, &reused);
+    if( src) {
+        blockhash_task_t *tasks = (blockhash_task_t *) alloc_check( ALLOC_ONLY, thread_cnt*sizeof( blockhash_task_t), "gen_block_sdbf_mt", "tasks", ERROR_EXIT);
+        for( t=0; t<thread_cnt; t++) {
+		    tasks[t].tid = t;
+		    tasks[t].tcount = thread_cnt;
+            tasks[t].buffer = file_buffer;
+            tasks[t].file_size = file_size;
+            tasks[t].block_size = block_size;
+            tasks[t].sdbf = sdbf;
+            tasks[t].src = src;
+ 	    }
+        gen_block_run( tasks, thread_cnt, thread_gen_block_sdbf);
+        gen_block_reuse( sdbf, src, qt);
+        free( tasks);
+        free( src);
+    }
+    // Deal with the "tail" if necessary
    	if( rem >= MIN_FILE_SIZE) {
-		uint16_t *chunk_ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (block_size)*sizeof( uint16_t), "gen_block_sdbf_mt", "chunk_ranks", ERROR_EXIT);
-        uint16_t *chunk_scores = (uint16_t *)alloc_check( ALLOC_ZERO, (block_size)*sizeof( uint16_t), "gen_block_sdbf_mt", "chunk_scores", ERROR_EXIT);
+		gen_block_one( file_buffer, file_size, qt, block_size, rem, sdbf, gen_scratch_get());
+		qt++;
+    }
+    __sync_fetch_and_add( &sdbf_sys.dd_block_cnt, qt);
+    __sync_fetch_and_add( &sdbf_sys.dd_reuse_cnt, reused);
+    return sdbf;
+}
+
+/**
+ * Sets up the table of hashed blocks for an image of block_cnt blocks.
+ */
+void gen_dedup_init( gen_dedup_t *dedup, uint64_t block_cnt, uint32_t bf_size) {
+    uint64_t slots;
+
+    for( slots=2; slots < 2*block_cnt && slots < DD_DEDUP_SLOTS; slots <<= 1)
+        ;
+    dedup->mask = slots-1;
+    dedup->count = 0;
+    dedup->fp = (uint64_t *)alloc_check( ALLOC_ONLY, 2*slots*sizeof( uint64_t), "gen_dedup_init", "dedup->fp", ERROR_EXIT);
+    dedup->block = (uint64_t *)alloc_check( ALLOC_ZERO, slots*sizeof( uint64_t), "gen_dedup_init", "dedup->block", ERROR_EXIT);
+    dedup->elem_counts = (uint16_t *)alloc_check( ALLOC_ONLY, slots*sizeof( uint16_t), "gen_dedup_init", "dedup->elem_counts", ERROR_EXIT);
+    dedup->bfs = (uint8_t *)alloc_check( ALLOC_ALIGN, slots*bf_size, "gen_dedup_init", "dedup->bfs", ERROR_EXIT);
+    pthread_mutex_init( &dedup->mutex, NULL);
+}
+
+/**
+ * Releases the table of hashed blocks.
+ */
+void gen_dedup_free( gen_dedup_t *dedup) {
+    free( dedup->fp);
+    free( dedup->block);
+    free( dedup->elem_counts);
+    free( dedup->bfs);
+    pthread_mutex_destroy( &dedup->mutex);
+}
 
-        gen_chunk_ranks( file_buffer+block_size*qt, rem, chunk_ranks, 0);
-		gen_chunk_scores( chunk_ranks, rem, chunk_scores, NULL);
-		gen_block_hash( file_buffer, file_size, qt, chunk_scores, block_size, sdbf, rem, sdbf_sys.threshold, sdbf_sys.max_elem);     
+/**
+ * Looks up a block fingerprint: returns its slot (set or, if the fingerprint is not there, empty).
+ */
+static uint64_t gen_dedup_find( gen_dedup_t *dedup, const uint64_t *fp) {
+    uint64_t slot;
 
-        free( chunk_ranks);
-        free( chunk_scores);
+    for( slot=fp[0] & dedup->mask; dedup->block[slot]; slot=(slot+1) & dedup->mask) {
+        if( dedup->fp[2*slot] == fp[0] && dedup->fp[2*slot+1] == fp[1])
+            break;
     }
+    return slot;
+}
+
+/**
+ * Generate the BFs of a range of blocks, starting with block first, for pipelined dd hashing: window holds the
+ * range's BFs (block numbers relative to first). A block with the same contents as one hashed before (by any
+ * range of the image) gets a copy of its BF; fingerprint matches are confirmed by comparing the blocks.
+ */
+void gen_block_range( uint8_t *file_buffer, uint64_t file_size, uint64_t first, sdbf_t *window, gen_dedup_t *dedup) {
+    uint64_t block_size = window->dd_block_size, qt = file_size/block_size, rem = file_size % block_size;
+    uint64_t i, slot, src, fp[2], reused = 0;
+    uint8_t *range = file_buffer + first*block_size;
+    uint32_t bf_size = window->bf_size;
+    gen_scratch_t *scratch = gen_scratch_get();
+
+    for( i=0; i<window->bf_count; i++) {
+        if( first+i == qt) {
+            gen_block_one( range, file_size-first*block_size, i, block_size, rem, window, scratch);
+            break;
+        }
+        xxh3_fingerprint( range + i*block_size, block_size, fp);
+        pthread_mutex_lock( &dedup->mutex);
+        slot = gen_dedup_find( dedup, fp);
+        src = dedup->block[slot];
+        pthread_mutex_unlock( &dedup->mutex);
+        if( src && !memcmp( file_buffer + (src-1)*block_size, range + i*block_size, block_size)) {
+            memcpy( window->buffer + i*bf_size, dedup->bfs + slot*bf_size, bf_size);
+            window->elem_counts[i] = dedup->elem_counts[slot];
+            reused++;
+            continue;
+        }
+        gen_block_one( range, file_size-first*block_size, i, block_size, 0, window, scratch);
+        pthread_mutex_lock( &dedup->mutex);
+        slot = gen_dedup_find( dedup, fp);
+        if( !dedup->block[slot] && 2*(dedup->count+1) <= dedup->mask+1) {
+            dedup->fp[2*slot] = fp[0];
+            dedup->fp[2*slot+1] = fp[1];
+            memcpy( dedup->bfs + slot*bf_size, window->buffer + i*bf_size, bf_size);
+            dedup->elem_counts[slot] = window->elem_counts[i];
+            dedup->block[slot] = first+i+1;
+            dedup->count++;
+        }
+        pthread_mutex_unlock( &dedup->mutex);
+    }
+    __sync_fetch_and_add( &sdbf_sys.dd_block_cnt, window->bf_count);
+    __sync_fetch_and_add( &sdbf_sys.dd_reuse_cnt, reused);
+}
+
+/**
+ * Dual runs: generate the dd blocks that start in the stripe just ranked ([pos, pos+size) of the current chunk).
+ * Blocks never straddle stripes, so each one is scored from a slice of the stream ranks.
+ */
+static void gen_dual_blocks( gen_scratch_t *scratch, uint64_t pos, uint64_t size) {
+    const gen_dual_t *dual = scratch->dual;
+    uint64_t blk, start = scratch->dual_pos+pos;
+    uint64_t qt = dual->file_size/dual->block_size, rem = dual->file_size % dual->block_size;
+
+    if( !scratch->dual_scratch)
+        scratch->dual_scratch = (gen_scratch_t *)alloc_check( ALLOC_ALIGN, sizeof( gen_scratch_t), "gen_dual_blocks", "dual_scratch", ERROR_EXIT);
+    for( blk=start/dual->block_size; blk*dual->block_size < start+size; blk++) {
+        if( blk < qt && dual->src[blk] != blk)
+            continue;
+        if( blk == qt && rem < MIN_FILE_SIZE)
+            break;
+        scratch->dual_scratch->rank_src = scratch->stripe + (blk*dual->block_size - start);
+        gen_block_one( dual->buffer, dual->file_size, blk, dual->block_size, (blk < qt) ? 0 : rem, dual->sdbf, scratch->dual_scratch);
+    }
+}
+
+/**
+ * Generate both the stream SDBF and the block-aligned dd_sdbf (BFs allocated by the caller) of a buffer in a 
+ * single pass: the ranks of each stripe feed the stream scores and the dd blocks that start in it. The results
+ * are identical to those of gen_chunk_sdbf_mt() and gen_block_sdbf_mt().
+ */
+sdbf_t *gen_dual_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, sdbf_t *sdbf, sdbf_t *dd_sdbf, uint64_t dd_block_size, uint32_t thread_cnt) {
+    uint64_t reused, qt = file_size/dd_block_size;
+    gen_dual_t dual;
+
+    // Blocks must not straddle rank stripes or chunks; if they would, the buffer is hashed twice
+    if( (ENTR_LANES*sdbf_sys.block_size) % dd_block_size || STREAM_CHUNK_SIZE % dd_block_size) {
+        gen_chunk_sdbf_mt( file_buffer, file_size, STREAM_CHUNK_SIZE, sdbf, thread_cnt);
+        gen_block_sdbf_mt( file_buffer, file_size, dd_block_size, dd_sdbf, thread_cnt);
+        return sdbf;
+    }
+    thread_cnt = (thread_cnt < 1) ? 1 : thread_cnt;
+    dual.sdbf = dd_sdbf;
+    dual.buffer = file_buffer;
+    dual.file_size = file_size;
+    dual.block_size = dd_block_size;
+    dual.src = gen_block_src( file_buffer, file_size, dd_block_size, thread_cnt, &reused);
+    gen_chunk_sdbf_run( file_buffer, file_size, STREAM_CHUNK_SIZE, sdbf, thread_cnt, &dual);
+    if( dual.src) {
+        gen_block_reuse( dd_sdbf, dual.src, qt);
+        free( (void *)dual.src);
+    }
+    qt += (file_size % dd_block_size >= MIN_FILE_SIZE) ? 1 : 0;
+    __sync_fetch_and_add( &sdbf_sys.dd_block_cnt, qt);
+    __sync_fetch_and_add( &sdbf_sys.dd_reuse_cnt, reused);
     return sdbf;
 }
 
@@ -336,27 +1188,270 @@ sdbf_t *gen_block_sdbf_mt( uint8_t *file_buffer, uint64_t file_size, uint64_t bl
  * Threading envelope for sdbf_max_score
  */
 void *thread_sdbf_max_score( void *task_param) {
-    sdbf_task_t *task = (sdbf_task_t *)task_param;
-    uint32_t i;
-    while( 1) {
-        sem_wait( &task->sem_start);
-        sdbf_max_score( (sdbf_task_t *)task, FLAG_OFF);
-        sem_post( &task->sem_end);
+    sdbf_max_score( (sdbf_task_t *)task_param, FLAG_OFF);
+    return NULL;
+}
+
+static pthread_key_t cmp_key;
+static pthread_once_t cmp_once = PTHREAD_ONCE_INIT;
+
+static void cmp_scratch_free( void *ptr) {
+    cmp_scratch_t *scratch = (cmp_scratch_t *)ptr;
+    free( scratch->ref_idx);
+    free( scratch->scores);
+    free( scratch->tgt_idx);
+    free( scratch->tgt_elem);
+    free( scratch->tgt_hamming);
+    free( scratch);
+}
+
+static void cmp_scratch_key_init() {
+    pthread_key_create( &cmp_key, cmp_scratch_free);
+}
+
+/**
+ * Returns the calling thread's comparison scratch space, with room for ref_cnt reference & tgt_cnt target BFs.
+ */
+static cmp_scratch_t *cmp_scratch_get( uint64_t ref_cnt, uint64_t tgt_cnt) {
+    pthread_once( &cmp_once, cmp_scratch_key_init);
+    cmp_scratch_t *scratch = (cmp_scratch_t *)pthread_getspecific( cmp_key);
+    if( !scratch) {
+        scratch = (cmp_scratch_t *)alloc_check( ALLOC_ZERO, sizeof( cmp_scratch_t), "cmp_scratch_get", "scratch", ERROR_EXIT);
+        pthread_setspecific( cmp_key, scratch);
+    }
+    if( scratch->ref_cap < ref_cnt) {
+        free( scratch->ref_idx);
+        free( scratch->scores);
+        scratch->ref_idx = (uint64_t *)alloc_check( ALLOC_ONLY, ref_cnt*sizeof( uint64_t), "cmp_scratch_get", "scratch->ref_idx", ERROR_EXIT);
+        scratch->scores = (double *)alloc_check( ALLOC_ONLY, ref_cnt*sizeof( double), "cmp_scratch_get", "scratch->scores", ERROR_EXIT);
+        scratch->ref_cap = ref_cnt;
+    }
+    if( scratch->tgt_cap < tgt_cnt) {
+        free( scratch->tgt_idx);
+        free( scratch->tgt_elem);
+        free( scratch->tgt_hamming);
+        scratch->tgt_idx = (uint64_t *)alloc_check( ALLOC_ONLY, tgt_cnt*sizeof( uint64_t), "cmp_scratch_get", "scratch->tgt_idx", ERROR_EXIT);
+        scratch->tgt_elem = (uint16_t *)alloc_check( ALLOC_ONLY, tgt_cnt*sizeof( uint16_t), "cmp_scratch_get", "scratch->tgt_elem", ERROR_EXIT);
+        scratch->tgt_hamming = (uint16_t *)alloc_check( ALLOC_ONLY, tgt_cnt*sizeof( uint16_t), "cmp_scratch_get", "scratch->tgt_hamming", ERROR_EXIT);
+        scratch->tgt_cap = tgt_cnt;
+    }
+    return scratch;
+}
+
+/**
+ * Computes the max score of every BF of ref against the BFs of tgt (as sdbf_max_score() does, one BF at a time).
+ * The reference BFs are taken in panels of CMP_REF_PANEL; the target BFs of a panel in tiles of CMP_TILE_BFS, and
+ * each tile is run through by all of the reference BFs of the panel, CMP_REF_BLOCK at a time, before moving on:
+ * the target BFs are loaded from cache rather than memory, and once for several reference BFs. BFs that take no
+ * part in the comparison are left out up front, & a reference BF is done with at its first perfect match.
+ * Only the target BFs in [tgt_first, tgt_end) are compared against (a part of a split pair). With min_score > 0,
+ * the scores of the panels so far bound the score of the pair (each BF scores at most 1); returns 1 (& leaves
+ * the scores unfinished) as soon as the pair cannot reach min_score, else 0.
+ */
+static int sdbf_score_tiled( const bf_est_t *est_tab, sdbf_t *ref, sdbf_t *tgt, uint64_t tgt_first, uint64_t tgt_end,
+                             int32_t min_score, double *scores) {
+    cmp_scratch_t *scratch = cmp_scratch_get( ref->bf_count, tgt_end-tgt_first);
+    const uint16_t *ref_hamming = get_hamming( ref), *tgt_hamming = get_hamming( tgt);
+    uint64_t i, j, p0, p1, r, t0, t1, ref_cnt = 0, tgt_cnt = 0, done = 0, panel;
+    uint32_t q, block, full, bf_size = ref->bf_size, slack = 48;
+    uint8_t *bf_1[CMP_REF_BLOCK];
+    uint64_t idx[CMP_REF_BLOCK];
+    const uint16_t *est[CMP_REF_BLOCK];
+    uint32_t e1[CMP_REF_BLOCK], max_est[CMP_REF_BLOCK], cut_off[CMP_REF_BLOCK], match[CMP_REF_BLOCK];
+    double score, score_sum = -1, max_score[CMP_REF_BLOCK];
+
+    for( i=0; i<ref->bf_count; i++) {
+        scores[i] = -1;
+        if( get_elem_count( ref, i) >= MIN_ELEM_COUNT)
+            scratch->ref_idx[ref_cnt++] = i;
+    }
+    for( j=tgt_first; j<tgt_end; j++) {
+        uint32_t s2 = get_elem_count( tgt, j);
+        if( ref->bf_count > 1 && s2 < MIN_REF_ELEM_COUNT)
+            continue;
+        scratch->tgt_idx[tgt_cnt] = j;
+        scratch->tgt_elem[tgt_cnt] = s2;
+        scratch->tgt_hamming[tgt_cnt++] = tgt_hamming[j];
+    }
+    scratch->stats.bf_total += ref_cnt*tgt_cnt;
+    if( !ref_cnt || !tgt_cnt)
+        return 0;
+    // (with a single tile, the bound is checked after every block)
+    panel = (tgt_cnt > CMP_TILE_BFS) ? CMP_REF_PANEL : CMP_REF_BLOCK;
+    for( p0=0; p0<ref_cnt; p0=p1) {
+        p1 = (p0+panel < ref_cnt) ? p0+panel : ref_cnt;
+        for( t0=0; t0<tgt_cnt; t0=t1) {
+            t1 = (t0+CMP_TILE_BFS < tgt_cnt) ? t0+CMP_TILE_BFS : tgt_cnt;
+            for( r=p0; r<p1; ) {
+                // Next block of the panel's BFs without a perfect match yet (a short one is compared one BF at a time)
+                for( block=0; block<CMP_REF_BLOCK && r<p1; r++) {
+                    i = scratch->ref_idx[r];
+                    if( scores[i] >= 1.0)
+                        continue;
+                    idx[block] = i;
+                    bf_1[block] = ref->buffer + i*bf_size;
+                    est[block] = est_tab->est[get_elem_count( ref, i)];
+                    e1[block] = ref_hamming[i];
+                    max_score[block++] = scores[i];
+                }
+                for( j=t0, full=0; j<t1 && full<block; j++) {
+                    uint32_t s2 = scratch->tgt_elem[j], e2 = scratch->tgt_hamming[j];
+                    uint8_t *bf_2 = tgt->buffer + scratch->tgt_idx[j]*bf_size;
+                    if( j+CMP_PREFETCH < t1)
+                        __builtin_prefetch( tgt->buffer + scratch->tgt_idx[j+CMP_PREFETCH]*bf_size);
+                    // Max/min number of matching bits & zero cut off
+                    for( q=0; q<block; q++) {
+                        uint32_t min_est = est[q][s2];
+                        max_est[q] = (e1[q] < e2) ? e1[q] : e2;
+                        cut_off[q] = lround( SD_SCORE_SCALE*(double)(max_est[q]-min_est)+(double)min_est);
+                    }
+                    if( block == CMP_REF_BLOCK)
+                        bf_bitcount_cut_256_x4( bf_1, bf_2, cut_off, slack, match);
+                    else {
+                        for( q=0; q<block; q++)
+                            match[q] = bf_bitcount_cut_256( bf_1[q], bf_2, cut_off[q], slack);
+                    }
+                    for( q=0; q<block; q++) {
+                        score = (match[q] <= cut_off[q]) ? 0 : (double)(match[q]-cut_off[q])/(max_est[q]-cut_off[q]);
+                        if( score > max_score[q]) {
+                            max_score[q] = score;
+                            full += (score >= 1.0);
+                        }
+                    }
+                    scratch->stats.bf_cmp += block;
+                }
+                scratch->stats.full_cnt += full;
+                for( q=0; q<block; q++)
+                    scores[idx[q]] = max_score[q];
+            }
+        }
+        if( min_score <= 0 || p1 == ref_cnt)
+            continue;
+        // Sum so far (as sdbf_score_ctx() takes it: a negative sum is replaced by the next score) plus the most the
+        // BFs left could add, against the least that rounds to min_score (with a margin for rounding errors)
+        for( ; done<=scratch->ref_idx[p1-1]; done++)
+            score_sum = (score_sum < 0) ? scores[done] : score_sum + scores[done];
+        if( 100.0*(((score_sum > 0) ? score_sum : 0) + (ref_cnt-p1))/ref->bf_count + 1e-6 < min_score - 0.5) {
+            scratch->stats.cut_cnt++;
+            return 1;
+        }
     }
+    return 0;
+}
+
+/**
+ * Pair prefilter: returns 1 if, by the summaries of the digests, no BF of ref can score against a BF of tgt (as
+ * sdbf_score_tiled() compares them). Two BFs have no more bits in common than the ORs of their digests, & score
+ * only with more than the cut off, which is at least that of the least Hamming weights & element counts of the
+ * BFs compared (less than that, a pair of BFs has a max estimate under its min estimate & does not score at all).
+ */
+static int sdbf_hopeless( const bf_est_t *est_tab, sdbf_t *ref, sdbf_t *tgt) {
+    const sdbf_summary_t *sum_1 = get_summary( ref), *sum_2 = get_summary( tgt);
+    uint32_t c = (ref->bf_count > 1) ? SUM_TGT : SUM_ANY, min_e, min_est, cut_off;
+
+    if( !sum_1 || !sum_2 || !sum_1->count[SUM_REF] || !sum_2->count[c])
+        return 0;
+    min_e = (sum_1->min_e[SUM_REF] < sum_2->min_e[c]) ? sum_1->min_e[SUM_REF] : sum_2->min_e[c];
+    min_est = est_tab->est[sum_1->min_s[SUM_REF]][sum_2->min_s[c]];
+    // (with a margin for rounding errors)
+    cut_off = lround( SD_SCORE_SCALE*min_e + (1-SD_SCORE_SCALE)*min_est - 1e-6);
+    if( bf_bitcount_cut_256( sum_1->bits, sum_2->bits, 0, 0) > cut_off)
+        return 0;
+    cmp_scratch_t *scratch = cmp_scratch_get( 0, 0);
+    scratch->stats.skip_cnt++;
+    scratch->stats.bf_total += sum_1->count[SUM_REF]*sum_2->count[c];
+    return 1;
+}
+
+/**
+ * Threading envelope for sdbf_score_tiled(): the task's part of the target BFs, into its own scores.
+ */
+static void *thread_sdbf_score_part( void *task_param) {
+    sdbf_task_t *task = (sdbf_task_t *)task_param;
+    sdbf_score_tiled( task->est, task->ref_sdbf, task->tgt_sdbf, task->tgt_first, task->tgt_end, 0, task->scores);
+    bzero( &task->stats, sizeof( cmp_stats_t));
+    sdbf_score_stats( &task->stats);
+    return NULL;
+}
+
+/**
+ * Adds the scoring counters from to stats.
+ */
+void cmp_stats_add( cmp_stats_t *stats, const cmp_stats_t *from) {
+    stats->pair_cnt += from->pair_cnt;
+    stats->cut_cnt += from->cut_cnt;
+    stats->skip_cnt += from->skip_cnt;
+    stats->full_cnt += from->full_cnt;
+    stats->bf_total += from->bf_total;
+    stats->bf_cmp += from->bf_cmp;
+}
+
+/**
+ * Adds the scoring counters of the calling thread to stats (unless NULL) & clears them.
+ */
+void sdbf_score_stats( cmp_stats_t *stats) {
+    cmp_scratch_t *scratch = cmp_scratch_get( 0, 0);
+
+    if( stats)
+        cmp_stats_add( stats, &scratch->stats);
+    bzero( &scratch->stats, sizeof( cmp_stats_t));
+}
+
+/**
+ * Returns a comparison context for thread_cnt threads per comparison, with the warnings & output threshold of
+ * sdbf_sys (starts the worker pool for thread_cnt if it is not running).
+ */
+sdbf_ctx_t *sdbf_ctx_create( uint32_t thread_cnt) {
+    sdbf_ctx_t *ctx = (sdbf_ctx_t *)alloc_check( ALLOC_ZERO, sizeof( sdbf_ctx_t), "sdbf_ctx_create", "ctx", ERROR_EXIT);
+
+    ctx->thread_cnt = (thread_cnt < 1) ? 1 : thread_cnt;
+    ctx->warnings = sdbf_sys.warnings;
+    ctx->output_threshold = sdbf_sys.output_threshold;
+    ctx->min_score = 0;
+    ctx->est = bf_est_table( 8*sdbf_sys.bf_size, 5);
+    pool_init( ctx->thread_cnt);
+    return ctx;
+}
+
+/**
+ * Releases a comparison context (the worker pool & the estimate tables stay).
+ */
+void sdbf_ctx_free( sdbf_ctx_t *ctx) {
+    free( ctx);
 }
 
 /**
  * Calculates the score between two digests
  */
 int sdbf_score( sdbf_t *sdbf_1, sdbf_t *sdbf_2, uint32_t map_on, int *swap) {
+    return sdbf_score_ctx( sdbf_sys.ctx, sdbf_1, sdbf_2, map_on, swap);
+}
+
+/**
+ * Calculates the score between two digests in a comparison context; any number of threads may call it at once
+ * (the digests are only read, once their Hamming weights are in place). With more than one thread per comparison,
+ * the target BFs are split in as many parts, which are scored (tiled) as one pool batch & whose results are
+ * merged. A map (map_on) is printed BF by BF. Without a map, pairs that the digest summaries show cannot score
+ * are not compared BF by BF; without a map or threads, a pair that cannot reach the min score of the context is
+ * abandoned as soon as that is certain: its score is then SD_SCORE_CUT.
+ */
+int sdbf_score_ctx( const sdbf_ctx_t *ctx, sdbf_t *sdbf_1, sdbf_t *sdbf_2, uint32_t map_on, int *swap) {
     *swap = 0;
     double max_score, score_sum = -1;
-    uint32_t i, t, thread_cnt = sdbf_sys.thread_cnt;
+    uint64_t i;
+    uint32_t t, thread_cnt = ctx->thread_cnt;
+    sdbf_task_t *tasks;
+
+    // Digests built with different feature hashes have nothing in common
+    if( sdbf_1->hash_id != sdbf_2->hash_id) {
+        if( ctx->warnings)
+            fprintf( stderr, "WARNING: Cannot compare %s (%s) and %s (%s): different feature hashes.\n", 
+                     sdbf_1->name, HASH_NAMES[sdbf_1->hash_id], sdbf_2->name, HASH_NAMES[sdbf_2->hash_id]);
+        return -1;
+    }
 
-    if( !sdbf_1->hamming)
-        compute_hamming( sdbf_1);
-    if( !sdbf_2->hamming)
-        compute_hamming( sdbf_2);
+    compute_hamming( sdbf_1);
+    compute_hamming( sdbf_2);
         
 	// Make sure |sdbf_1| <<< |sdbf_2|
     if( (sdbf_1->bf_count > sdbf_2->bf_count) ||
@@ -369,46 +1464,78 @@ int sdbf_score( sdbf_t *sdbf_1, sdbf_t *sdbf_2, uint32_t map_on, int *swap) {
             *swap = 1;
     }
     
-    if( !tasklist)
-        tasklist = (sdbf_task_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( sdbf_task_t), "sdbf_score", "tasklist", ERROR_EXIT);
-	// Initialize common data for thread task(s)
-	for( t=0; t<thread_cnt; t++) {
-		tasklist[t].tid = t;
-		tasklist[t].tcount = thread_cnt;
-		tasklist[t].ref_sdbf = sdbf_1;
-		tasklist[t].tgt_sdbf = sdbf_2;
-	}
-    // Create thread pool & semaphores
-    if( !thread_pool && thread_cnt > 1) {
-        thread_pool = (pthread_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( pthread_t), "sdbf_score", "thread_pool", ERROR_EXIT);
-        for( t=0; t<thread_cnt; t++) {
-            if( pthread_create( &thread_pool[t], NULL, thread_sdbf_max_score, (void *)(tasklist+t) )) {
-                fprintf( stderr, "ERROR: Could not create thread.\n");
-                exit(-1);
+    // No map: all of the BFs at once, tiled
+    if( map_on != FLAG_ON) {
+        const bf_est_t *est = ctx->est;
+        if( est->m != 8*sdbf_1->bf_size || est->k != sdbf_1->hash_count)
+            est = bf_est_table( 8*sdbf_1->bf_size, sdbf_1->hash_count);
+        double *scores;
+        cmp_scratch_get( 0, 0)->stats.pair_cnt++;
+        if( sdbf_hopeless( est, sdbf_1, sdbf_2)) {
+            // Every reference BF that is compared scores 0
+            if( ctx->min_score > 0)
+                return SD_SCORE_CUT;
+            scores = cmp_scratch_get( sdbf_1->bf_count, 0)->scores;
+            for( i=0; i<sdbf_1->bf_count; i++)
+                scores[i] = (get_elem_count( sdbf_1, i) >= MIN_ELEM_COUNT) ? 0 : -1;
+        } else if( thread_cnt < 2) {
+            scores = cmp_scratch_get( sdbf_1->bf_count, 0)->scores;
+            if( sdbf_score_tiled( est, sdbf_1, sdbf_2, 0, sdbf_2->bf_count, ctx->min_score, scores))
+                return SD_SCORE_CUT;
+        } else {
+            // One part of the target BFs per thread
+            tasks = (sdbf_task_t *)alloc_check( ALLOC_ALIGN, thread_cnt*sizeof( sdbf_task_t), "sdbf_score_ctx", "tasks", ERROR_EXIT);
+            double *part_scores = (double *)alloc_check( ALLOC_ONLY, thread_cnt*sdbf_1->bf_count*sizeof( double), "sdbf_score_ctx", "part_scores", ERROR_EXIT);
+            for( t=0; t<thread_cnt; t++) {
+                tasks[t].tid = t;
+                tasks[t].tcount = thread_cnt;
+                tasks[t].ref_sdbf = sdbf_1;
+                tasks[t].tgt_sdbf = sdbf_2;
+                tasks[t].tgt_first = sdbf_2->bf_count*t/thread_cnt;
+                tasks[t].tgt_end = sdbf_2->bf_count*(t+1)/thread_cnt;
+                tasks[t].scores = part_scores + t*sdbf_1->bf_count;
+                tasks[t].est = est;
             }
-            if( sem_init( &tasklist[t].sem_start, 0, 0) || sem_init( &tasklist[t].sem_end, 0, 0)) {
-                fprintf( stderr, "ERROR: Could not create semaphores.\n");
-                exit(-1);
+            pool_run( thread_sdbf_score_part, tasks, sizeof( sdbf_task_t), thread_cnt);
+            // (the scratch may have been regrown by jobs run on this thread while waiting)
+            cmp_scratch_t *scratch = cmp_scratch_get( sdbf_1->bf_count, 0);
+            scores = scratch->scores;
+            for( t=0; t<thread_cnt; t++)
+                cmp_stats_add( &scratch->stats, &tasks[t].stats);
+            for( i=0; i<sdbf_1->bf_count; i++) {
+                scores[i] = tasks[0].scores[i];
+                for( t=1; t<thread_cnt; t++)
+                    scores[i] = (tasks[t].scores[i] > scores[i]) ? tasks[t].scores[i] : scores[i];
             }
+            free( part_scores);
+            free( tasks);
         }
+        for( i=0; i<sdbf_1->bf_count; i++)
+            score_sum = (score_sum < 0) ? scores[i] : score_sum + scores[i];
+        return (score_sum < 0) ? -1 : lround( 100.0*score_sum/(sdbf_1->bf_count));
     }
+    tasks = (sdbf_task_t *) alloc_check( ALLOC_ALIGN, thread_cnt*sizeof( sdbf_task_t), "sdbf_score_ctx", "tasks", ERROR_EXIT);
+	// Initialize common data for thread task(s)
+	for( t=0; t<thread_cnt; t++) {
+		tasks[t].tid = t;
+		tasks[t].tcount = thread_cnt;
+		tasks[t].ref_sdbf = sdbf_1;
+		tasks[t].tgt_sdbf = sdbf_2;
+	}
     for( i=0; i<sdbf_1->bf_count; i++) {
 		// No threading
 		if( thread_cnt < 2) {
-			tasklist[0].ref_index=i;
-			max_score = sdbf_max_score( tasklist, map_on);
+			tasks[0].ref_index=i;
+			max_score = sdbf_max_score( tasks, map_on);
 		// === Threading ===
 		} else {
             for( t=0; t<thread_cnt; t++) {
-                tasklist[t].ref_index=i;
-                sem_post( &(tasklist[t].sem_start));
+                tasks[t].ref_index=i;
             }
-            for( t=0; t<thread_cnt; t++) {
-                sem_wait( &tasklist[t].sem_end);
-            }
-            max_score = tasklist[0].result;
+            pool_run( thread_sdbf_max_score, tasks, sizeof( sdbf_task_t), thread_cnt);
+            max_score = tasks[0].result;
             for( t=1; t<thread_cnt; t++) {
-                max_score = (tasklist[t].result > max_score) ? tasklist[t].result : max_score;
+                max_score = (tasks[t].result > max_score) ? tasks[t].result : max_score;
             }
 		// === Done threading ===
 		}
@@ -417,6 +1544,7 @@ int sdbf_score( sdbf_t *sdbf_1, sdbf_t *sdbf_2, uint32_t map_on, int *swap) {
             printf( "  %5.3f\n", max_score);
         }
     }
+    free( tasks);
     uint64_t denom = sdbf_1->bf_count;
     // Adjust for the case where s2 for the last BF of sdbf_2 is less then MIN_REF_ELEM_COUNT
     /*
@@ -434,23 +1562,26 @@ double sdbf_max_score( sdbf_task_t *task, uint32_t map_on) {
 	assert( task != NULL);
 
     double score, max_score=-1;
-    uint32_t i, s1, s2, min_est, max_est, match, cut_off, slack=48;
+    uint64_t i, comp_cnt = task->tgt_sdbf->bf_count;
+    uint32_t s1, s2, min_est, max_est, match, cut_off, slack=48;
     uint32_t bf_size = task->ref_sdbf->bf_size;
     uint16_t *bf_1, *bf_2;
 	
     s1 = get_elem_count( task->ref_sdbf, task->ref_index);
 	// Are there enough elements to even consider comparison?
-	if( s1 < MIN_ELEM_COUNT)
+	if( s1 < MIN_ELEM_COUNT) {
+        task->result = max_score;
 		return max_score;
+    }
     bf_1 = (uint16_t *)(task->ref_sdbf->buffer + task->ref_index*bf_size);
-	uint32_t e1_cnt = task->ref_sdbf->hamming[task->ref_index];
-	uint32_t comp_cnt = task->tgt_sdbf->bf_count;
+	uint32_t e1_cnt = get_hamming( task->ref_sdbf)[task->ref_index];
+	const uint16_t *tgt_hamming = get_hamming( task->tgt_sdbf);
 	for( i=task->tid; i<comp_cnt; i+=task->tcount) {
 		bf_2 = (uint16_t *)(task->tgt_sdbf->buffer + i*bf_size);
         s2 = get_elem_count( task->tgt_sdbf, i);
 		if( task->ref_sdbf->bf_count > 1 && s2 < MIN_REF_ELEM_COUNT)
 			continue;
-		uint32_t e2_cnt = task->tgt_sdbf->hamming[i];
+		uint32_t e2_cnt = tgt_hamming[i];
 
 		// Max/min number of matching bits & zero cut off
 		max_est = (e1_cnt < e2_cnt) ? e1_cnt : e2_cnt;
@@ -463,7 +1594,7 @@ double sdbf_max_score( sdbf_task_t *task, uint32_t map_on) {
 			match = bf_bitcount_cut_256( (uint8_t *)bf_1, (uint8_t *)bf_2, 0, 0);
 		}
 		score = (match <= cut_off) ? 0 : (double)(match-cut_off)/(max_est-cut_off);
-		if( map_on == FLAG_ON && sdbf_sys.thread_cnt == 1) {
+		if( map_on == FLAG_ON && task->tcount == 1) {
 			printf( "%s", (score > 0) ? "+" : ".");
 		}
 		max_score = (score > max_score) ? score : max_score;
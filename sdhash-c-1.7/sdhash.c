@@ -7,20 +7,21 @@
 
 // Global parameters
 sdbf_parameters_t sdbf_sys = {
-    1,               // threads
-    64,              // entr_win_size
-    256,             // BF size
-    4*KB,            // block_size
-    64,              // pop_win_size
-    16,              // threshold
-    _MAX_ELEM_COUNT, // max_elem
-    1,               // output_threshold
-    FLAG_OFF,        // warnings
-    0 		     // sample size off
+    .thread_cnt       = 1,
+    .entr_win_size    = 64,
+    .bf_size          = 256,
+    .block_size       = 4*KB,
+    .pop_win_size     = 64,
+    .threshold        = 16,
+    .max_elem         = _MAX_ELEM_COUNT,
+    .output_threshold = 1,
+    .warnings         = FLAG_OFF,
+    .sample_size      = 0,           // sample size off
+    .hash_id          = HASH_SHA1    // feature hash (the other fields start out 0/NULL)
 };
 
 int main( int argc, char **argv) {
-    uint32_t  i, j, k, file_cnt;
+    uint32_t  i, k, file_cnt;
     uint32_t opts[OPT_MAX];
     uint32_t first_size, all_size;
     sdbf_t* tmp;
@@ -40,11 +41,48 @@ int main( int argc, char **argv) {
     
     // Generate SDBFs from source files
     if( opts[OPT_MODE] & MODE_GEN) {
+        if( sdbf_sys.cache_path)
+            sdbf_sys.cache = cache_open( sdbf_sys.cache_path, sdbf_sys.cache_verify);
 #ifdef _DD_BLOCK
-        sdbf_hash_files_dd( argv+file_start, file_cnt, opts[OPT_MODE], _DD_BLOCK*KB);
+        for( i=file_start; i<argc; i++) {
+            if( !strcmp( argv[i], STDIN_ARG)) {
+                fprintf( stderr, "ERROR: Hashing standard input ('-') is done by the stream version of sdhash.\n");
+                return -1;
+            }
+        }
+        if( opts[OPT_DUAL]) {
+            fprintf( stderr, "ERROR: Dual generation (-d) is done by the stream version of sdhash.\n");
+            return -1;
+        }
+        if( opts[OPT_WATCH])
+            watch_files( argv+file_start, file_cnt, opts[OPT_MODE], _DD_BLOCK*KB, 0);
+        else if( opts[OPT_RECURSE])
+            sdbf_hash_tree( argv+file_start, file_cnt, opts[OPT_MODE], _DD_BLOCK*KB, 0);
+        else
+            sdbf_hash_files_dd( argv+file_start, file_cnt, opts[OPT_MODE], _DD_BLOCK*KB);
 #else
-        sdbf_hash_files( argv+file_start, file_cnt, opts[OPT_MODE]);
+        for( i=file_start; i<argc && opts[OPT_DUAL]; i++) {
+            if( !strcmp( argv[i], STDIN_ARG)) {
+                fprintf( stderr, "ERROR: Standard input ('-') cannot be hashed in dual (-d) mode.\n");
+                return -1;
+            }
+        }
+        if( opts[OPT_WATCH])
+            watch_files( argv+file_start, file_cnt, opts[OPT_MODE], opts[OPT_DUAL] ? DUAL_DD_BLOCK*KB : 0, opts[OPT_DUAL]);
+        else if( opts[OPT_RECURSE])
+            sdbf_hash_tree( argv+file_start, file_cnt, opts[OPT_MODE], opts[OPT_DUAL] ? DUAL_DD_BLOCK*KB : 0, opts[OPT_DUAL]);
+        else if( opts[OPT_DUAL])
+            sdbf_hash_files_dual( argv+file_start, file_cnt, opts[OPT_MODE], DUAL_DD_BLOCK*KB);
+        else
+            sdbf_hash_files( argv+file_start, file_cnt, opts[OPT_MODE]);
 #endif
+        if( sdbf_sys.verbose && sdbf_sys.dd_block_cnt)
+            fprintf( stderr, "dd blocks: %llu, reused: %llu (%.1f%%)\n", (unsigned long long)sdbf_sys.dd_block_cnt, 
+                     (unsigned long long)sdbf_sys.dd_reuse_cnt, 100.0*sdbf_sys.dd_reuse_cnt/sdbf_sys.dd_block_cnt);
+        if( sdbf_sys.cache) {
+            cache_close( sdbf_sys.cache);
+            sdbf_sys.cache = NULL;
+        }
     // Load SDBFs from a file
     } else if( opts[OPT_MODE] & MODE_COMP) {
            struct stat stat_res;
@@ -60,31 +98,20 @@ int main( int argc, char **argv) {
         fprintf( stderr, "ERROR: Inconsistent command line options: load and generate\n");
         exit( -1);
     }
-    int score, swap;
+    cmp_pairs_t pairs;
+    bzero( &pairs, sizeof( cmp_pairs_t));
     // Perform pairs comparison
     if( opts[OPT_MODE] & MODE_PAIR) {
-        for( j=1; j<sdbf_get_size(); j++) {
-            score = sdbf_compare( 0, j, opts[OPT_MAP], &swap);
-            if( score >= sdbf_sys.output_threshold) {
-                if( swap)
-                    printf( "%s|%s|%03d\n", sdbf_get_name(j), sdbf_get_name(0), score);
-                else
-                    printf( "%s|%s|%03d\n", sdbf_get_name(0), sdbf_get_name(j), score);
-            }
-        }
+        pairs.ref_end = 1;
+        pairs.tgt_first = 1;
+        pairs.tgt_end = sdbf_get_size();
+        sdbf_compare_pairs( sdbf_sys.ctx, &pairs, opts[OPT_MAP]);
     // Perform all-pairs comparison
     } else if( opts[OPT_MODE] & MODE_DIR) {
-        for( k=0; k<sdbf_get_size()-1; k++) {
-            for( j=k+1; j<sdbf_get_size(); j++) {
-                score = sdbf_compare( k, j, opts[OPT_MAP], &swap);
-                if( score >= sdbf_sys.output_threshold) {
-                    if( swap)
-                        printf( "%s|%s|%03d\n", sdbf_get_name(j), sdbf_get_name(k), score);
-                    else
-                        printf( "%s|%s|%03d\n", sdbf_get_name(k), sdbf_get_name(j), score);
-                }
-            }
-        }
+        pairs.ref_end = sdbf_get_size() ? sdbf_get_size()-1 : 0;
+        pairs.tgt_end = sdbf_get_size();
+        pairs.triangle = 1;
+        sdbf_compare_pairs( sdbf_sys.ctx, &pairs, opts[OPT_MAP]);
     // perform first file against second file comparison.  need to extend to "all files" 
     } else if (opts[OPT_MODE] & MODE_FIRST) {
         first_size=sdbf_get_size();	
@@ -101,32 +128,16 @@ int main( int argc, char **argv) {
 		    tmp->bf_count = sdbf_sys.sample_size;
 	    }
 	}
+	pairs.ref_end = first_size ? first_size-1 : 0;
+	pairs.tgt_first = first_size;
 	if (all_size == first_size+1) {
 		// we have a (single) hash target.  
-	    j=first_size;
-	    for (k=0;k<first_size-1;k++) {
-		score = sdbf_compare( k, j, opts[OPT_MAP], &swap);
-		if( score >= sdbf_sys.output_threshold) {
-		    if( swap)
-			printf( "%s|%s|%03d\n", sdbf_get_name(j), sdbf_get_name(k), score);
-		    else
-			printf( "%s|%s|%03d\n", sdbf_get_name(k), sdbf_get_name(j), score);
-		}
-	    }
+	    pairs.tgt_end = all_size;
 	// we have a multi-hash target   
 	} else {
-	    for( k=0; k<first_size-1; k++) {
-		for( j=first_size; j<all_size-1; j++) {
-		    score = sdbf_compare( k, j, opts[OPT_MAP], &swap);
-		    if( score >= sdbf_sys.output_threshold) {
-			if( swap)
-			    printf( "%s|%s|%03d\n", sdbf_get_name(j), sdbf_get_name(k), score);
-			else
-			    printf( "%s|%s|%03d\n", sdbf_get_name(k), sdbf_get_name(j), score);
-		    }
-		}
-	    }
+	    pairs.tgt_end = all_size-1;
 	}
+	sdbf_compare_pairs( sdbf_sys.ctx, &pairs, opts[OPT_MAP]);
     }
     sdbf_finalize();
     return 0;
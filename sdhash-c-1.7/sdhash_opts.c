@@ -10,12 +10,15 @@ int process_opts( int argc, char **argv, uint32_t *opts) {
     uint32_t i, opt_cnt=0;
     char opt;
 
-    while( (opt = getopt (argc, argv, ":cgmwp:t:s:")) != -1) {
+    while( (opt = getopt (argc, argv, ":cdgmnuwvKRWp:t:s:r:M:H:C:")) != -1) {
         switch( opt) {
             case 'c':
                 opts[OPT_MODE] |= MODE_COMP;
 //                opts[OPT_MODE] |= MODE_DIR;
                 break;
+            case 'd':
+                opts[OPT_DUAL] = FLAG_ON;
+                break;
             case 'g':
                 opts[OPT_MODE] |= MODE_GEN;
                 opts[OPT_MODE] |= MODE_DIR;
@@ -23,9 +26,33 @@ int process_opts( int argc, char **argv, uint32_t *opts) {
             case 'm':
                 opts[OPT_MAP] = FLAG_ON;
                 break;
+            case 'u':
+                sdbf_sys.write_any = FLAG_ON;
+                break;
+            case 'M':
+                sdbf_sys.write_budget = atoi( optarg);
+                break;
+            case 'R':
+                opts[OPT_RECURSE] = FLAG_ON;
+                break;
+            case 'W':
+                opts[OPT_WATCH] = FLAG_ON;
+                break;
+            case 'C':
+                sdbf_sys.cache_path = optarg;
+                break;
+            case 'K':
+                sdbf_sys.cache_verify = FLAG_ON;
+                break;
+            case 'n':
+                sdbf_sys.no_split = FLAG_ON;
+                break;
             case 'w':
                 sdbf_sys.warnings = FLAG_ON;
                 break;
+            case 'v':
+                sdbf_sys.verbose = FLAG_ON;
+                break;
             case 'p':
                 sdbf_sys.thread_cnt = atoi( optarg);
                 break;
@@ -35,6 +62,16 @@ int process_opts( int argc, char **argv, uint32_t *opts) {
             case 's':
                 sdbf_sys.sample_size = atoi( optarg);
                 break;
+            case 'r':
+                sdbf_sys.read_ahead = atoi( optarg);
+                break;
+            case 'H':
+                if( sdbf_hash_lookup( optarg) < 0) {
+                    fprintf( stderr, ">>> ERROR: Unknown feature hash '%s' (expecting sha1 or xxh3).\n", optarg);
+                    return -1;
+                }
+                sdbf_sys.hash_id = sdbf_hash_lookup( optarg);
+                break;
             case ':':
                 fprintf( stderr, ">>> ERROR: Missing parameter for option -%c.\n", optopt);
                 return -1;
@@ -50,10 +87,40 @@ int process_opts( int argc, char **argv, uint32_t *opts) {
 		fprintf( stderr, ">>> ERROR: Incompatible options: 'c' and 'g'\n");
 		return -1;
 	}
+    if( opts[OPT_DUAL] && opts[OPT_MODE] != MODE_GEN) {
+		fprintf( stderr, ">>> ERROR: Option 'd' only applies to generation (no 'c' or 'g').\n");
+		return -1;
+	}
+    if( opts[OPT_RECURSE] && !(opts[OPT_MODE] & MODE_GEN)) {
+		fprintf( stderr, ">>> ERROR: Option 'R' only applies to generation (no 'c').\n");
+		return -1;
+	}
+    if( opts[OPT_WATCH] && opts[OPT_MODE] != MODE_GEN) {
+		fprintf( stderr, ">>> ERROR: Option 'W' only applies to generation (no 'c' or 'g').\n");
+		return -1;
+	}
+    if( sdbf_sys.cache_path && (!(opts[OPT_MODE] & MODE_GEN) || opts[OPT_DUAL])) {
+		fprintf( stderr, ">>> ERROR: Option 'C' only applies to generation (no 'c' or 'd').\n");
+		return -1;
+	}
+    if( sdbf_sys.cache_verify && !sdbf_sys.cache_path) {
+		fprintf( stderr, ">>> ERROR: Option 'K' requires a cache ('C').\n");
+		return -1;
+	}
     if( sdbf_sys.thread_cnt < 1 || sdbf_sys.thread_cnt > MAX_THREADS) {
 		fprintf( stderr, ">>> ERROR: Parallelization parameter must be between 1 and %d.\n", MAX_THREADS);
 		return -1;
 	}
+    if( sdbf_sys.read_ahead < 2 || sdbf_sys.read_ahead > 1024) {
+        if( sdbf_sys.read_ahead)
+            fprintf( stderr, "Error: invalid read-ahead depth (%d); resetting to %d.\n", sdbf_sys.read_ahead, INGEST_DEPTH);
+        sdbf_sys.read_ahead = INGEST_DEPTH;
+    }
+    if( sdbf_sys.write_budget < 1 || sdbf_sys.write_budget > 1024*1024) {
+        if( sdbf_sys.write_budget)
+            fprintf( stderr, "Error: invalid output memory budget (%d MB); resetting to %d.\n", sdbf_sys.write_budget, WRITE_BUDGET);
+        sdbf_sys.write_budget = WRITE_BUDGET;
+    }
     if( sdbf_sys.output_threshold < 0 || sdbf_sys.output_threshold > 100) {
         fprintf( stderr, "Error: invalid output threshhold (%d); resetting to 1.\n", sdbf_sys.output_threshold);
         sdbf_sys.output_threshold = 1;
@@ -74,15 +141,26 @@ int process_opts( int argc, char **argv, uint32_t *opts) {
  */
 void print_usage( char *version_info, char *command) {
     printf( "%s\n", version_info);
-    printf( "  sdhash <files>         : 'gen' mode: generate base64-encoded SDBFs for files to stdout.\n");
+    printf( "  sdhash <files>         : 'gen' mode: generate base64-encoded SDBFs for files to stdout ('-' reads stdin).\n");
     printf( "     -g <files>          : 'all-gen' mode: generate hashes and compare all pairs.\n");
     printf( "     -c <sdbf-file>      : 'all-comp' mode: load hashes from file and compare all pairs.\n");
     printf( "     -c <query> <target> : 'query': searches for <query>.sdbf in <target>.sdbf\n");
     printf( "     -p <number>         : 'parallelization factor': run the computation at the given concurrency factor.\n");
     printf( "     -t <0-100>          : 'threshold': only show results greater than or equal to parameter; default is 1.\n");
     printf( "     -s <1-16>           : 'sample': for -c comparisons, use N or fewer filters to match; default is off.\n");
+    printf( "     -r <2-1024>         : 'read-ahead': number of files read ahead of hashing; default is %d.\n", INGEST_DEPTH);
+    printf( "     -d                  : 'dual': also generate block-aligned digests (sdbf-dd, %dKB blocks) in the same pass.\n", DUAL_DD_BLOCK);
+    printf( "     -H <sha1|xxh3>      : 'hash': feature hash for generated SDBFs; xxh3 is much faster, but only compares to xxh3 SDBFs.\n");
     printf( "     -m                  : 'map' comparisons: show a heat map of BF matches (requires -g or -c and no parallelism).\n");
+    printf( "     -u                  : 'unordered': with -p, write digests as they complete (default: in input order).\n");
+    printf( "     -M <MB>             : 'memory': with -p, memory for digests waiting to be written; default is %d.\n", WRITE_BUDGET);
+    printf( "     -R                  : 'recursive': hash the files in directory trees (walked in parallel; hashing starts right away).\n");
+    printf( "     -W                  : 'watch': like -R, then keep hashing files as they are created or changed (until interrupted).\n");
+    printf( "     -C <file>           : 'cache': reuse the digests of unchanged files from the cache file & add new ones to it.\n");
+    printf( "     -K                  : 'check': with -C, also compare a checksum of the start & end of each file (default: size & time).\n");
+    printf( "     -n                  : 'no-split': with -p, hash each file in a single task (default: files over %dMB are split).\n", STREAM_CHUNK_SIZE/MB);
     printf( "     -w                  : 'warnings': turn on warnings (default is OFF).\n");
+    printf( "     -v                  : 'verbose': print generation & scheduling statistics to stderr (default is OFF).\n");
 }
 
 
@@ -0,0 +1,253 @@
+/**
+ * sha1_mb.c: Batched SHA1 for 64-byte features (SHA-NI and multi-buffer AVX2/AVX-512)
+ */
+
+#include "sdbf.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SHA1_X86_KERNELS
+#endif
+
+#define SHA1_H0 0x67452301
+#define SHA1_H1 0xEFCDAB89
+#define SHA1_H2 0x98BADCFE
+#define SHA1_H3 0x10325476
+#define SHA1_H4 0xC3D2E1F0
+
+// Second (padding) block of a 64-byte message: 0x80, zeroes, and a 512-bit length
+static const uint8_t SHA1_PAD_64[64] = {
+    0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00
+};
+static const uint32_t SHA1_K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+// K+W for the padding block (identical for all 64-byte messages)
+static uint32_t sha1_pad_kw[80];
+
+/**
+ * Portable version: one-shot OpenSSL call per feature.
+ */
+static void sha1_batch_64_ssl( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    uint32_t i;
+    for( i=0; i<count; i++)
+        SHA1( data[i], 64, (uint8_t *)(hashes+5*i));
+}
+
+static void (*sha1_batch_kernel)( const uint8_t **, uint32_t, uint32_t *) = sha1_batch_64_ssl;
+
+#ifdef SHA1_X86_KERNELS
+/**
+ * SHA-NI: 4 rounds of the SHA1 compression function (group g of 20).
+ */
+#define SHA1NI_GROUP( g, abcd, msg, e_cur, e_nxt) \
+    e_cur = _mm_sha1nexte_epu32( e_cur, msg[(g)&3]); \
+    e_nxt = abcd; \
+    if( (g) >= 3 && (g) <= 18) msg[((g)+1)&3] = _mm_sha1msg2_epu32( msg[((g)+1)&3], msg[(g)&3]); \
+    abcd = _mm_sha1rnds4_epu32( abcd, e_cur, (g)/5); \
+    if( (g) >= 1 && (g) <= 16) msg[((g)+3)&3] = _mm_sha1msg1_epu32( msg[((g)+3)&3], msg[(g)&3]); \
+    if( (g) >= 2 && (g) <= 17) msg[((g)+2)&3] = _mm_xor_si128( msg[((g)+2)&3], msg[(g)&3]);
+
+// Two independent streams are interleaved to hide the latency of the SHA instructions
+#define SHA1NI_GROUP_X2( g, e_cur, e_nxt) \
+    SHA1NI_GROUP( g, abcd_a, msg_a, e_cur##_a, e_nxt##_a) \
+    SHA1NI_GROUP( g, abcd_b, msg_b, e_cur##_b, e_nxt##_b)
+
+/**
+ * SHA-NI: compress one 64-byte block for each of two states
+ * (abcd in reversed word order, e in the top word).
+ */
+__attribute__((target("sha,sse4.1")))
+static inline void sha1_ni_block_x2( __m128i *state, const uint8_t *block_a, const uint8_t *block_b) {
+    const __m128i bswap = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd_a = state[0], e0_a = state[1], e1_a, msg_a[4];
+    __m128i abcd_b = state[2], e0_b = state[3], e1_b, msg_b[4];
+    uint32_t j;
+
+    for( j=0; j<4; j++) {
+        msg_a[j] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(block_a+16*j)), bswap);
+        msg_b[j] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(block_b+16*j)), bswap);
+    }
+    e0_a = _mm_add_epi32( e0_a, msg_a[0]);
+    e0_b = _mm_add_epi32( e0_b, msg_b[0]);
+    e1_a = abcd_a;
+    e1_b = abcd_b;
+    abcd_a = _mm_sha1rnds4_epu32( abcd_a, e0_a, 0);
+    abcd_b = _mm_sha1rnds4_epu32( abcd_b, e0_b, 0);
+    SHA1NI_GROUP_X2(  1, e1, e0) SHA1NI_GROUP_X2(  2, e0, e1) SHA1NI_GROUP_X2(  3, e1, e0) SHA1NI_GROUP_X2(  4, e0, e1)
+    SHA1NI_GROUP_X2(  5, e1, e0) SHA1NI_GROUP_X2(  6, e0, e1) SHA1NI_GROUP_X2(  7, e1, e0) SHA1NI_GROUP_X2(  8, e0, e1)
+    SHA1NI_GROUP_X2(  9, e1, e0) SHA1NI_GROUP_X2( 10, e0, e1) SHA1NI_GROUP_X2( 11, e1, e0) SHA1NI_GROUP_X2( 12, e0, e1)
+    SHA1NI_GROUP_X2( 13, e1, e0) SHA1NI_GROUP_X2( 14, e0, e1) SHA1NI_GROUP_X2( 15, e1, e0) SHA1NI_GROUP_X2( 16, e0, e1)
+    SHA1NI_GROUP_X2( 17, e1, e0) SHA1NI_GROUP_X2( 18, e0, e1) SHA1NI_GROUP_X2( 19, e1, e0)
+
+    state[1] = _mm_sha1nexte_epu32( e0_a, state[1]);
+    state[0] = _mm_add_epi32( abcd_a, state[0]);
+    state[3] = _mm_sha1nexte_epu32( e0_b, state[3]);
+    state[2] = _mm_add_epi32( abcd_b, state[2]);
+}
+
+/**
+ * SHA-NI version: two blocks (data + constant padding) per feature, two features at a time.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha1_batch_64_ni( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    const __m128i bswap_w = _mm_set_epi8( 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i state[4];
+    uint32_t i, j;
+
+    for( i=0; i<count; i+=2) {
+        const uint8_t *data_b = (i+1 < count) ? data[i+1] : data[i];
+        state[0] = state[2] = _mm_set_epi32( SHA1_H0, SHA1_H1, SHA1_H2, SHA1_H3);
+        state[1] = state[3] = _mm_set_epi32( SHA1_H4, 0, 0, 0);
+        sha1_ni_block_x2( state, data[i], data_b);
+        sha1_ni_block_x2( state, SHA1_PAD_64, SHA1_PAD_64);
+        // Digest bytes are big-endian: h0..h3 come out of abcd in reverse, byte-swapped order
+        for( j=0; j<2 && i+j<count; j++) {
+            uint32_t *hash = hashes+5*(i+j);
+            _mm_storeu_si128( (__m128i *)hash, _mm_shuffle_epi8( _mm_shuffle_epi32( state[2*j], 0x1B), bswap_w));
+            hash[4] = __builtin_bswap32( (uint32_t)_mm_extract_epi32( state[2*j+1], 3));
+        }
+    }
+}
+
+/**
+ * Multi-buffer helper: transpose (and byte swap) the message words of up to 16 features.
+ */
+static inline void sha1_mb_transpose( const uint8_t **data, uint32_t lanes, uint32_t *words) {
+    uint32_t l, j, w;
+    for( l=0; l<lanes; l++) {
+        for( j=0; j<16; j++) {
+            memcpy( &w, data[l]+4*j, 4);
+            words[j*lanes+l] = __builtin_bswap32( w);
+        }
+    }
+}
+
+#define SHA1_MB_F1( b, c, d)  V_XOR( d, V_AND( b, V_XOR( c, d)))
+#define SHA1_MB_F2( b, c, d)  V_XOR( b, V_XOR( c, d))
+#define SHA1_MB_F3( b, c, d)  V_OR( V_AND( b, c), V_AND( d, V_OR( b, c)))
+
+/**
+ * Multi-buffer SHA1 body, shared by the AVX2 (8 lanes) and AVX-512 (16 lanes) versions.
+ */
+#define SHA1_MB_BODY( LANES) \
+    uint32_t words[16*LANES] __attribute__((aligned(64))), out[5*LANES] __attribute__((aligned(64))); \
+    const uint8_t *lane_data[LANES]; \
+    uint32_t i, l, t, n; \
+    for( i=0; i<count; i+=LANES) { \
+        n = (count-i < LANES) ? count-i : LANES; \
+        for( l=0; l<LANES; l++) \
+            lane_data[l] = data[i + ((l < n) ? l : 0)]; \
+        sha1_mb_transpose( lane_data, LANES, words); \
+        V_T w[16], a, b, c, d, e, f, tmp; \
+        for( t=0; t<16; t++) \
+            w[t] = V_LOAD( words+t*LANES); \
+        a = V_SET1( SHA1_H0); b = V_SET1( SHA1_H1); c = V_SET1( SHA1_H2); d = V_SET1( SHA1_H3); e = V_SET1( SHA1_H4); \
+        for( t=0; t<80; t++) { \
+            if( t >= 16) \
+                w[t&15] = V_ROL( V_XOR( V_XOR( w[(t-3)&15], w[(t-8)&15]), V_XOR( w[(t-14)&15], w[t&15])), 1); \
+            f = (t < 20) ? SHA1_MB_F1( b, c, d) : (t < 40 || t >= 60) ? SHA1_MB_F2( b, c, d) : SHA1_MB_F3( b, c, d); \
+            tmp = V_ADD( V_ADD( V_ROL( a, 5), f), V_ADD( V_ADD( e, w[t&15]), V_SET1( SHA1_K[t/20]))); \
+            e = d; d = c; c = V_ROL( b, 30); b = a; a = tmp; \
+        } \
+        V_T h0 = V_ADD( a, V_SET1( SHA1_H0)), h1 = V_ADD( b, V_SET1( SHA1_H1)), h2 = V_ADD( c, V_SET1( SHA1_H2)); \
+        V_T h3 = V_ADD( d, V_SET1( SHA1_H3)), h4 = V_ADD( e, V_SET1( SHA1_H4)); \
+        a = h0; b = h1; c = h2; d = h3; e = h4; \
+        for( t=0; t<80; t++) { \
+            f = (t < 20) ? SHA1_MB_F1( b, c, d) : (t < 40 || t >= 60) ? SHA1_MB_F2( b, c, d) : SHA1_MB_F3( b, c, d); \
+            tmp = V_ADD( V_ADD( V_ROL( a, 5), f), V_ADD( e, V_SET1( sha1_pad_kw[t]))); \
+            e = d; d = c; c = V_ROL( b, 30); b = a; a = tmp; \
+        } \
+        V_STORE( out,          V_ADD( a, h0)); \
+        V_STORE( out+LANES,   V_ADD( b, h1)); \
+        V_STORE( out+2*LANES, V_ADD( c, h2)); \
+        V_STORE( out+3*LANES, V_ADD( d, h3)); \
+        V_STORE( out+4*LANES, V_ADD( e, h4)); \
+        for( l=0; l<n; l++) \
+            for( t=0; t<5; t++) \
+                hashes[5*(i+l)+t] = __builtin_bswap32( out[t*LANES+l]); \
+    }
+
+#define V_T            __m256i
+#define V_LOAD( p)     _mm256_load_si256( (const __m256i *)(p))
+#define V_STORE( p, v) _mm256_store_si256( (__m256i *)(p), v)
+#define V_SET1( x)     _mm256_set1_epi32( (int)(x))
+#define V_ADD          _mm256_add_epi32
+#define V_AND          _mm256_and_si256
+#define V_OR           _mm256_or_si256
+#define V_XOR          _mm256_xor_si256
+#define V_ROL( v, r)   _mm256_or_si256( _mm256_slli_epi32( v, r), _mm256_srli_epi32( v, 32-(r)))
+
+/**
+ * AVX2 version: 8 features per pass.
+ */
+__attribute__((target("avx2")))
+static void sha1_batch_64_avx2( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    SHA1_MB_BODY( 8)
+}
+
+#undef V_T
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ROL
+#define V_T            __m512i
+#define V_LOAD( p)     _mm512_load_si512( (const void *)(p))
+#define V_STORE( p, v) _mm512_store_si512( (void *)(p), v)
+#define V_SET1( x)     _mm512_set1_epi32( (int)(x))
+#define V_ADD          _mm512_add_epi32
+#define V_AND          _mm512_and_si512
+#define V_OR           _mm512_or_si512
+#define V_XOR          _mm512_xor_si512
+#define V_ROL( v, r)   _mm512_rol_epi32( v, r)
+
+/**
+ * AVX-512 version: 16 features per pass.
+ */
+__attribute__((target("avx512f")))
+static void sha1_batch_64_avx512( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    SHA1_MB_BODY( 16)
+}
+#endif
+
+/**
+ * Selects the fastest SHA1 batch kernel supported by the CPU (to be called once).
+ */
+void sha1_batch_init() {
+    uint32_t t, w[80];
+
+    // Pre-compute the message schedule of the padding block
+    for( t=0; t<16; t++)
+        w[t] = ((uint32_t)SHA1_PAD_64[4*t] << 24) | ((uint32_t)SHA1_PAD_64[4*t+1] << 16) |
+               ((uint32_t)SHA1_PAD_64[4*t+2] << 8) | SHA1_PAD_64[4*t+3];
+    for( t=16; t<80; t++) {
+        uint32_t x = w[t-3] ^ w[t-8] ^ w[t-14] ^ w[t-16];
+        w[t] = (x << 1) | (x >> 31);
+    }
+    for( t=0; t<80; t++)
+        sha1_pad_kw[t] = w[t] + SHA1_K[t/20];
+
+    sha1_batch_kernel = sha1_batch_64_ssl;
+#ifdef SHA1_X86_KERNELS
+    __builtin_cpu_init();
+    // 16 lanes of AVX-512 outrun the (latency-bound) SHA-NI rounds where both are available
+    if( __builtin_cpu_supports( "avx512f"))
+        sha1_batch_kernel = sha1_batch_64_avx512;
+    else if( __builtin_cpu_supports( "sha") && __builtin_cpu_supports( "sse4.1"))
+        sha1_batch_kernel = sha1_batch_64_ni;
+    else if( __builtin_cpu_supports( "avx2"))
+        sha1_batch_kernel = sha1_batch_64_avx2;
+#endif
+}
+
+/**
+ * Computes the SHA1 hashes of count 64-byte features; hashes receives 5 words per feature,
+ * laid out exactly as SHA1() would write them.
+ */
+void sha1_batch_64( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    sha1_batch_kernel( data, count, hashes);
+}
@@ -0,0 +1,191 @@
+/**
+ * test_scores: Differential test of the popularity scorer. The fused pass (gen_pass_run(), run deque over the rank
+ * ring) is checked against the legacy rescan on random & adversarial rank streams, at lengths around the window,
+ * ring & stripe boundaries, both in one go & suspended/resumed on growing data as sdbf_update() runs it (make test).
+ */
+
+#include "sdbf.h"
+
+// Global parameters (only entr_win_size, block_size & pop_win_size are used)
+sdbf_parameters_t sdbf_sys = {
+    .thread_cnt       = 1,
+    .entr_win_size    = 64,
+    .bf_size          = 256,
+    .block_size       = 4*KB,
+    .pop_win_size     = 64,
+    .threshold        = 16,
+    .max_elem         = _MAX_ELEM_COUNT,
+    .output_threshold = 1,
+    .warnings         = FLAG_OFF,
+    .sample_size      = 0,           // sample size off
+    .hash_id          = HASH_SHA1    // feature hash (the other fields start out 0/NULL)
+};
+
+#define TEST_SEEDS      16      // Runs of each random pattern
+
+static const char *PATTERNS[] = {
+    "random", "random (0-3)", "constant zero", "constant", "rising", "falling", "rising runs (w)",
+    "rising runs (w+1)", "alternating", "alternating with zero", "plateaus", "random, zero tail"
+};
+#define PATTERN_COUNT   (sizeof( PATTERNS)/sizeof( PATTERNS[0]))
+
+static uint64_t rng_state;
+
+/**
+ * xorshift64: deterministic pseudo-random numbers.
+ */
+static uint64_t rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Fills ranks[0, len) with a pattern for a window of pop_win.
+ */
+static void fill_ranks( uint16_t *ranks, uint64_t len, uint32_t pattern, uint32_t pop_win) {
+    uint64_t i, run = 0;
+    uint16_t value = 0;
+
+    for( i=0; i<len; i++) {
+        switch( pattern) {
+        case 0:  ranks[i] = rng_next() % 1000; break;
+        case 1:  ranks[i] = rng_next() % 4; break;
+        case 2:  ranks[i] = 0; break;
+        case 3:  ranks[i] = 7; break;
+        case 4:  ranks[i] = 1 + i % 60000; break;
+        case 5:  ranks[i] = 60000 - i % 60000; break;
+        case 6:  ranks[i] = 1 + i % pop_win; break;
+        case 7:  ranks[i] = 1 + i % (pop_win+1); break;
+        case 8:  ranks[i] = 1 + (i & 1); break;
+        case 9:  ranks[i] = (i & 1) ? 5 : 0; break;
+        case 10:
+            if( !run) {
+                run = 1 + rng_next() % (2*pop_win);
+                value = rng_next() % 8;
+            }
+            ranks[i] = value;
+            run--;
+            break;
+        default: ranks[i] = (i < len*3/4) ? rng_next() % 1000 : 0; break;
+        }
+    }
+}
+
+/**
+ * Legacy popularity scorer (the original gen_chunk_scores()): rescans a whole window whenever its minimum cannot
+ * be slid on the cheap. The cheap slide reads ranks (& writes scores) up to a window past chunk_size.
+ */
+static void scores_legacy( const uint16_t *chunk_ranks, const uint64_t chunk_size, uint16_t *chunk_scores) {
+    uint64_t i, j;
+    uint32_t pop_win = sdbf_sys.pop_win_size;
+    uint64_t min_pos = 0;
+    uint16_t min_rank = chunk_ranks[min_pos];
+
+    bzero( chunk_scores, chunk_size*sizeof( uint16_t));
+    for( i=0; i<chunk_size-pop_win; i++) {
+        // try sliding on the cheap
+        if( i>0 && min_rank>0) {
+            while( chunk_ranks[i+pop_win] >= min_rank && i<min_pos && i<chunk_size-pop_win+1) {
+                if( chunk_ranks[i+pop_win] == min_rank)
+                    min_pos = i+pop_win;
+                chunk_scores[min_pos]++;
+                i++;
+            }
+        }
+        min_pos = i;
+        min_rank = chunk_ranks[min_pos];
+        for( j=i+1; j<i+pop_win; j++) {
+            if( chunk_ranks[j] < min_rank && chunk_ranks[j]) {
+                min_rank = chunk_ranks[j];
+                min_pos = j;
+            } else if( min_pos == j-1 && chunk_ranks[j] == min_rank) {
+                min_pos = j;
+            }
+        }
+        if( chunk_ranks[min_pos] > 0) {
+            chunk_scores[min_pos]++;
+        }
+    }
+}
+
+/**
+ * Scores ranks[0, chunk_size) with the fused pass (block mode: the scores land in scratch->block_scores), the ranks
+ * being fed in through rank_src. With resume, the pass runs on growing prefixes of the chunk first, with garbage
+ * past each prefix--as sdbf_update() suspends it, only the ranks of windows that end within the data may be used.
+ */
+static void scores_pass( gen_scratch_t *scratch, const uint16_t *ranks, uint64_t chunk_size, uint16_t *src, uint32_t resume) {
+    uint32_t pop_win = sdbf_sys.pop_win_size, entr_win = sdbf_sys.entr_win_size;
+    uint64_t avail = 0, i, step;
+
+    scratch->rank_src = src;
+    gen_pass_reset( scratch, NULL);
+    while( resume && avail < chunk_size) {
+        step = 1 + rng_next() % ((rng_next() & 1) ? 3*pop_win : 5000);
+        avail = (avail+step < chunk_size) ? avail+step : chunk_size;
+        memcpy( src, ranks, avail*sizeof( uint16_t));
+        for( i=avail; i<chunk_size+pop_win; i++)
+            src[i] = rng_next();
+        if( avail < chunk_size)
+            gen_pass_run( NULL, avail, (avail > entr_win) ? avail-entr_win : 0, scratch, NULL);
+    }
+    memcpy( src, ranks, (chunk_size+pop_win)*sizeof( uint16_t));
+    gen_pass_run( NULL, chunk_size, chunk_size, scratch, NULL);
+    scratch->rank_src = NULL;
+}
+
+int main() {
+    static const uint32_t POP_WINS[] = { 64, 16, 7, 1};
+    uint32_t w, p, seed, k, resume, case_cnt = 0, fail_cnt = 0;
+    uint32_t entr_win = sdbf_sys.entr_win_size;
+    uint64_t i, chunk_size;
+    gen_scratch_t *scratch = gen_scratch_get();
+
+    for( w=0; w<sizeof( POP_WINS)/sizeof( POP_WINS[0]); w++) {
+        uint32_t pop_win = sdbf_sys.pop_win_size = POP_WINS[w];
+        // Lengths around the window boundaries (past the zero ranks at the end of a chunk), the rank ring & the stripes
+        uint64_t sizes[] = { entr_win+pop_win+1, entr_win+pop_win+2, entr_win+2*pop_win-1, entr_win+2*pop_win+1,
+                             entr_win+3*pop_win+5, 1000, GEN_RING_SIZE+entr_win+1, 4*KB+1, 64*KB+13, 200*KB+7};
+        for( k=0; k<sizeof( sizes)/sizeof( sizes[0]); k++) {
+            chunk_size = sizes[k];
+            // The cheap slide reads (& the legacy scorer writes) past chunk_size
+            uint16_t *ranks = (uint16_t *)alloc_check( ALLOC_ONLY, (chunk_size+pop_win)*sizeof( uint16_t), "main", "ranks", ERROR_EXIT);
+            uint16_t *src = (uint16_t *)alloc_check( ALLOC_ONLY, (chunk_size+pop_win)*sizeof( uint16_t), "main", "src", ERROR_EXIT);
+            uint16_t *expected = (uint16_t *)alloc_check( ALLOC_ONLY, (chunk_size+pop_win)*sizeof( uint16_t), "main", "expected", ERROR_EXIT);
+            if( scratch->block_cap < chunk_size) {
+                free( scratch->block_scores);
+                scratch->block_scores = (uint16_t *)alloc_check( ALLOC_ALIGN, chunk_size*sizeof( uint16_t), "main", "block_scores", ERROR_EXIT);
+                scratch->block_cap = chunk_size;
+            }
+            for( p=0; p<PATTERN_COUNT; p++) {
+                for( seed=1; seed<=TEST_SEEDS; seed++) {
+                    rng_state = 0x9E3779B97F4A7C15ULL*seed + p*KB + k;
+                    // Windows that reach past the chunk have no rank (as in the generators)
+                    fill_ranks( ranks, chunk_size-entr_win, p, pop_win);
+                    bzero( ranks+chunk_size-entr_win, (entr_win+pop_win)*sizeof( uint16_t));
+                    scores_legacy( ranks, chunk_size, expected);
+                    for( resume=0; resume<2; resume++) {
+                        case_cnt++;
+                        scores_pass( scratch, ranks, chunk_size, src, resume);
+                        for( i=0; i<chunk_size-pop_win && scratch->block_scores[i] == expected[i]; i++)
+                            ;
+                        if( i < chunk_size-pop_win) {
+                            fail_cnt++;
+                            fprintf( stderr, "FAIL: %s, pop_win %u, length %lu, seed %u%s: scores differ at %lu\n",
+                                     PATTERNS[p], pop_win, chunk_size, seed, resume ? " (resumed)" : "", i);
+                        }
+                    }
+                    // Fixed patterns are the same for every seed
+                    if( p != 0 && p != 1 && p != 10 && p != PATTERN_COUNT-1)
+                        break;
+                }
+            }
+            free( ranks);
+            free( src);
+            free( expected);
+        }
+    }
+    printf( "test_scores: %u cases, %u failed\n", case_cnt, fail_cnt);
+    return fail_cnt ? 1 : 0;
+}
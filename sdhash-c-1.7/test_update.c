@@ -0,0 +1,159 @@
+/**
+ * test_update: Differential test of resumable stream SDBFs. Data is appended with sdbf_update() in random-sized
+ * pieces; at random points, the digest & its resume state are written out & read back (sdbf_state_write() &
+ * sdbf_state_read()) and the update carries on with the copy. After every update, the digest must be the same
+ * as the one-shot digest of the data so far (make test).
+ */
+
+#include "sdbf.h"
+
+// Global parameters
+sdbf_parameters_t sdbf_sys = {
+    .thread_cnt       = 1,
+    .entr_win_size    = 64,
+    .bf_size          = 256,
+    .block_size       = 4*KB,
+    .pop_win_size     = 64,
+    .threshold        = 16,
+    .max_elem         = _MAX_ELEM_COUNT,
+    .output_threshold = 1,
+    .warnings         = FLAG_OFF,
+    .sample_size      = 0,           // sample size off
+    .hash_id          = HASH_SHA1    // feature hash (the other fields start out 0/NULL)
+};
+
+#define TEST_SMALL_SIZE     (3*MB)                      // Data appended in small pieces (a digest of ~200 BFs),
+#define TEST_JUMP_SIZE      (STREAM_CHUNK_SIZE-256*KB)  // then in one go up to near the chunk boundary,
+#define TEST_DATA_SIZE      (STREAM_CHUNK_SIZE+MB)      // & in larger pieces across it
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/**
+ * xorshift64: deterministic pseudo-random numbers.
+ */
+static uint64_t rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Test data: stretches of random bytes, text-like bytes & single-byte runs of random lengths.
+ */
+static void fill_data( uint8_t *data, uint64_t len) {
+    uint64_t i, run, kind;
+
+    for( i=0; i<len; i+=run) {
+        run = 1 + rng_next() % (64*KB);
+        run = (i+run < len) ? run : len-i;
+        kind = rng_next() % 3;
+        if( kind == 0)
+            for( uint64_t j=0; j<run; j++)
+                data[i+j] = rng_next();
+        else if( kind == 1)
+            for( uint64_t j=0; j<run; j++)
+                data[i+j] = 'a' + rng_next() % 20 + ((j % 97) ? 0 : ' '-'a');
+        else
+            memset( data+i, rng_next(), run);
+    }
+}
+
+/**
+ * Returns 1 if sdbf is the one-shot digest of data[0, len).
+ */
+static int same_digest( sdbf_t *sdbf, uint8_t *data, uint64_t len) {
+    sdbf_t *expected = sdbf_hash_buffer( data, len, "expected");
+    int result = expected->bf_count == sdbf->bf_count && expected->last_count == sdbf->last_count &&
+                 !memcmp( expected->buffer, sdbf->buffer, sdbf->bf_count*sdbf->bf_size);
+
+    sdbf_free( expected);
+    return result;
+}
+
+/**
+ * Writes out an SDBF & its resume state & reads them back; a copy of the state with a corrupt position must
+ * be rejected. Returns the copy (NULL on failure).
+ */
+static sdbf_t *round_trip( sdbf_t *sdbf) {
+    FILE *tmp = tmpfile();
+    sdbf_t *copy = NULL, *bad_copy;
+    sdbf_state_t bad_state;
+    long state_pos;
+
+    sdbf_to_stream( sdbf, tmp);
+    state_pos = ftell( tmp);
+    if( sdbf_state_write( sdbf, tmp))
+        return NULL;
+    rewind( tmp);
+    copy = sdbf_from_stream( tmp);
+    if( !copy || fseek( tmp, state_pos, SEEK_SET) || sdbf_state_read( copy, tmp)) {
+        fprintf( stderr, "FAIL: resume state of %lu bytes of data rejected\n", sdbf->state->total);
+        return NULL;
+    }
+    // Same state, but the pass is past the data
+    bad_state = *sdbf->state;
+    bad_state.rank_end = bad_state.chunk_len + 1 + rng_next() % GEN_RING_SIZE;
+    fseek( tmp, -(long)sizeof( sdbf_state_t), SEEK_END);
+    fwrite( &bad_state, sizeof( sdbf_state_t), 1, tmp);
+    rewind( tmp);
+    bad_copy = sdbf_from_stream( tmp);
+    if( fseek( tmp, state_pos, SEEK_SET) || !sdbf_state_read( bad_copy, tmp)) {
+        fprintf( stderr, "FAIL: corrupt resume state accepted\n");
+        sdbf_free( copy);
+        copy = NULL;
+    }
+    sdbf_free( bad_copy);
+    fclose( tmp);
+    return copy;
+}
+
+int main() {
+    // Padded like a mapped file
+    uint8_t *data = (uint8_t *)alloc_check( ALLOC_ZERO, TEST_DATA_SIZE+FILE_PAGE_SIZE, "main", "data", ERROR_EXIT);
+    uint32_t h, update_cnt = 0, trip_cnt = 0, fail_cnt = 0;
+
+    fill_data( data, TEST_DATA_SIZE);
+    sdbf_init();
+    for( h=0; h<HASH_COUNT; h++) {
+        uint64_t pos = 0, len;
+        sdbf_sys.hash_id = h;
+        sdbf_t *sdbf = sdbf_create( "update");
+
+        while( pos < TEST_DATA_SIZE && sdbf) {
+            // Small pieces (down to single bytes), then a jump & larger pieces across the chunk boundary
+            if( pos < TEST_SMALL_SIZE) {
+                len = (rng_next() % 4) ? 1 + rng_next() % (64*KB) : 1 + rng_next() % 64;
+                len = (pos+len < TEST_SMALL_SIZE) ? len : TEST_SMALL_SIZE-pos;
+            } else if( pos == TEST_SMALL_SIZE) {
+                len = TEST_JUMP_SIZE-pos;
+            } else {
+                len = 1 + rng_next() % (128*KB);
+                len = (pos+len < TEST_DATA_SIZE) ? len : TEST_DATA_SIZE-pos;
+            }
+            if( sdbf_update( sdbf, data+pos, len)) {
+                fprintf( stderr, "FAIL: update of %lu bytes at %lu failed\n", len, pos);
+                fail_cnt++;
+                break;
+            }
+            pos += len;
+            update_cnt++;
+            if( !same_digest( sdbf, data, pos)) {
+                fprintf( stderr, "FAIL: %s digest differs after %lu bytes\n", HASH_NAMES[h], pos);
+                fail_cnt++;
+            }
+            if( rng_next() % 3 == 0) {
+                sdbf_t *copy = round_trip( sdbf);
+                fail_cnt += !copy;
+                trip_cnt++;
+                sdbf_free( sdbf);
+                sdbf = copy;
+            }
+        }
+        if( sdbf)
+            sdbf_free( sdbf);
+    }
+    free( data);
+    printf( "test_update: %u updates, %u state round trips, %u failed\n", update_cnt, trip_cnt, fail_cnt);
+    return fail_cnt ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * test_walk: Test of the directory walker. A tree with hard links, symbolic links to files & directories in it,
+ * a loop of symbolic links, a dangling link & a too small file is walked repeatedly (the walker threads race each
+ * other for its directories): each regular file must be handed out exactly once (make test).
+ */
+
+#include "sdbf.h"
+
+// Global parameters (only warnings are used)
+sdbf_parameters_t sdbf_sys = {
+    .thread_cnt       = 1,
+    .entr_win_size    = 64,
+    .bf_size          = 256,
+    .block_size       = 4*KB,
+    .pop_win_size     = 64,
+    .threshold        = 16,
+    .max_elem         = _MAX_ELEM_COUNT,
+    .output_threshold = 1,
+    .warnings         = FLAG_OFF,
+    .sample_size      = 0,           // sample size off
+    .hash_id          = HASH_SHA1    // feature hash (the other fields start out 0/NULL)
+};
+
+#define TEST_RUNS       200     // Walks of the tree
+
+// The tree: directories (trailing '/'), files (size) & links ("->" target)
+static const struct {
+    const char *path;
+    uint64_t    size;
+    const char *target;
+    uint32_t    hard;
+} TREE[] = {
+    { "a/", 0, NULL, 0 },
+    { "a/f1", 2*KB, NULL, 0 },
+    { "a/f2", 4*KB, NULL, 0 },
+    { "a/small", 10, NULL, 0 },
+    { "a/up", 0, "..", 0 },             // loop
+    { "b/", 0, NULL, 0 },
+    { "b/c/", 0, NULL, 0 },
+    { "b/c/f3", MIN_FILE_SIZE, NULL, 0 },
+    { "h2", 0, "a/f2", 1 },             // hard link
+    { "sl", 0, "a/f1", 0 },             // symbolic link to a file in the tree
+    { "b/sl3", 0, "c/f3", 0 },
+    { "b/c/sl1", 0, "../../a/f1", 0 },
+    { "sldir", 0, "b", 0 },             // symbolic link to a directory in the tree
+    { "dangling", 0, "nowhere", 0 },
+};
+#define TREE_COUNT      (sizeof( TREE)/sizeof( TREE[0]))
+#define TREE_FILES      3       // Regular files of at least MIN_FILE_SIZE
+
+/**
+ * Creates the tree below root; returns 0 on success.
+ */
+static int tree_create( const char *root) {
+    char path[FILENAME_MAX], target[FILENAME_MAX];
+    uint32_t i;
+
+    for( i=0; i<TREE_COUNT; i++) {
+        size_t len = strlen( TREE[i].path);
+        snprintf( path, sizeof( path), "%s/%s", root, TREE[i].path);
+        if( TREE[i].path[len-1] == '/') {
+            if( mkdir( path, 0700))
+                return -1;
+        } else if( TREE[i].hard) {
+            snprintf( target, sizeof( target), "%s/%s", root, TREE[i].target);
+            if( link( target, path))
+                return -1;
+        } else if( TREE[i].target) {
+            if( symlink( TREE[i].target, path))
+                return -1;
+        } else {
+            FILE *file = fopen( path, "w");
+            uint64_t j;
+            if( !file)
+                return -1;
+            for( j=0; j<TREE[i].size; j++)
+                fputc( (int)(j*31 + i), file);
+            fclose( file);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Removes the tree below root (& root).
+ */
+static void tree_remove( const char *root) {
+    char path[FILENAME_MAX];
+    uint32_t i;
+
+    for( i=TREE_COUNT; i-- > 0; ) {
+        snprintf( path, sizeof( path), "%s/%s", root, TREE[i].path);
+        if( TREE[i].path[strlen( TREE[i].path)-1] == '/')
+            rmdir( path);
+        else
+            unlink( path);
+    }
+    rmdir( root);
+}
+
+int main() {
+    char root[] = "/tmp/test_walk.XXXXXX";
+    char *paths[1] = { root };
+    uint32_t run, i, count, found, fail_cnt = 0;
+
+    if( !mkdtemp( root) || tree_create( root)) {
+        fprintf( stderr, "ERROR: Could not create the test tree in /tmp.\n");
+        exit(-1);
+    }
+    for( run=0; run<TEST_RUNS; run++) {
+        uint64_t ino[TREE_FILES+8];
+        char **names;
+        uint64_t *sizes;
+        found = 0;
+        walk_t *walk = walk_open( paths, 1);
+        while( (count = walk_take( walk, &names, &sizes))) {
+            for( i=0; i<count; i++) {
+                struct stat file_stat;
+                uint32_t j;
+                if( stat( names[i], &file_stat) || !S_ISREG( file_stat.st_mode) || (uint64_t)file_stat.st_size != sizes[i]) {
+                    fprintf( stderr, "FAIL: run %u: '%s' is not a regular file of %lu bytes\n", run, names[i], sizes[i]);
+                    fail_cnt++;
+                } else {
+                    for( j=0; j<found && j<TREE_FILES+8 && ino[j] != (uint64_t)file_stat.st_ino; j++)
+                        ;
+                    if( j < found && j < TREE_FILES+8) {
+                        fprintf( stderr, "FAIL: run %u: '%s' handed out twice\n", run, names[i]);
+                        fail_cnt++;
+                    }
+                    if( found < TREE_FILES+8)
+                        ino[found] = file_stat.st_ino;
+                    found++;
+                }
+                free( names[i]);
+            }
+            free( names);
+            free( sizes);
+        }
+        walk_close( walk);
+        if( found != TREE_FILES) {
+            fprintf( stderr, "FAIL: run %u: %u files handed out (%u expected)\n", run, found, TREE_FILES);
+            fail_cnt++;
+        }
+    }
+    tree_remove( root);
+    printf( "test_walk: %u walks, %u failed\n", TEST_RUNS, fail_cnt);
+    return fail_cnt ? 1 : 0;
+}
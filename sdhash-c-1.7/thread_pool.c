@@ -0,0 +1,170 @@
+/**
+ * thread_pool.c: Process-wide worker pool shared by all parallel paths (generation & comparison)
+ */
+
+#include "sdbf.h"
+
+// Pool state (workers are started by pool_init() and live until pool_finalize())
+static pthread_t       *pool_threads = NULL;
+static uint32_t         pool_thread_cnt = 0;
+static pool_job_t      *queue_head = NULL;
+static pool_job_t      *queue_tail = NULL;
+static uint32_t         pool_stop = 0;
+static pthread_mutex_t  pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pool_work = PTHREAD_COND_INITIALIZER;    // Jobs queued (or shutdown)
+static pthread_cond_t   pool_done = PTHREAD_COND_INITIALIZER;    // A batch has finished
+static pthread_mutex_t  pool_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Takes the next job off the queue (pool_mutex held); NULL if there is none.
+ */
+static pool_job_t *pool_pop() {
+    pool_job_t *job = queue_head;
+    if( job) {
+        queue_head = job->next;
+        if( !queue_head)
+            queue_tail = NULL;
+    }
+    return job;
+}
+
+/**
+ * Runs a job (pool_mutex held on entry & exit) & signals its batch when it is the last one.
+ */
+static void pool_exec( pool_job_t *job) {
+    pthread_mutex_unlock( &pool_mutex);
+    job->func( job->arg);
+    pthread_mutex_lock( &pool_mutex);
+    if( !--job->batch->pending)
+        pthread_cond_broadcast( &pool_done);
+}
+
+/**
+ * Pool worker: runs queued jobs until the pool is shut down.
+ */
+static void *thread_pool_worker( void *param) {
+    pool_job_t *job;
+
+    (void)param;
+
+    pthread_mutex_lock( &pool_mutex);
+    while( !pool_stop) {
+        if( (job = pool_pop()))
+            pool_exec( job);
+        else
+            pthread_cond_wait( &pool_work, &pool_mutex);
+    }
+    pthread_mutex_unlock( &pool_mutex);
+    return NULL;
+}
+
+/**
+ * Starts thread_cnt workers (none for a single thread: jobs then run on the waiting thread); a running pool is
+ * kept as it is.
+ */
+int pool_init( uint32_t thread_cnt) {
+    uint32_t t;
+
+    pthread_mutex_lock( &pool_init_mutex);
+    if( pool_threads || thread_cnt < 2) {
+        pthread_mutex_unlock( &pool_init_mutex);
+        return 0;
+    }
+    pool_threads = (pthread_t *) alloc_check( ALLOC_ZERO, thread_cnt*sizeof( pthread_t), "pool_init", "pool_threads", ERROR_EXIT);
+    pool_stop = 0;
+    for( t=0; t<thread_cnt; t++) {
+        if( pthread_create( &pool_threads[t], NULL, thread_pool_worker, NULL)) {
+            fprintf( stderr, "ERROR: Could not create thread.\n");
+            exit(-1);
+        }
+    }
+    pool_thread_cnt = thread_cnt;
+    pthread_mutex_unlock( &pool_init_mutex);
+    return 0;
+}
+
+/**
+ * Stops & joins the workers (queued jobs are expected to have been waited for).
+ */
+void pool_finalize() {
+    uint32_t t;
+
+    if( !pool_threads)
+        return;
+    pthread_mutex_lock( &pool_mutex);
+    pool_stop = 1;
+    pthread_cond_broadcast( &pool_work);
+    pthread_mutex_unlock( &pool_mutex);
+    for( t=0; t<pool_thread_cnt; t++)
+        pthread_join( pool_threads[t], NULL);
+    free( pool_threads);
+    pool_threads = NULL;
+    pool_thread_cnt = 0;
+}
+
+/**
+ * Number of pool workers (0 if the pool is not running).
+ */
+uint32_t pool_size() {
+    return pool_thread_cnt;
+}
+
+/**
+ * Queues cnt jobs func( args + i*arg_size) as one batch; jobs (cnt entries) & batch are owned by the caller
+ * and must stay put until pool_wait() returns.
+ */
+void pool_submit( pool_batch_t *batch, pool_job_t *jobs, void *(*func)( void *), void *args, size_t arg_size, uint32_t cnt) {
+    uint32_t i;
+
+    batch->pending = cnt;
+    if( !cnt)
+        return;
+    for( i=0; i<cnt; i++) {
+        jobs[i].func = func;
+        jobs[i].arg = (uint8_t *)args + i*arg_size;
+        jobs[i].batch = batch;
+        jobs[i].next = (i < cnt-1) ? jobs+i+1 : NULL;
+    }
+    pthread_mutex_lock( &pool_mutex);
+    if( queue_tail)
+        queue_tail->next = jobs;
+    else
+        queue_head = jobs;
+    queue_tail = jobs+cnt-1;
+    pthread_cond_broadcast( &pool_work);
+    pthread_mutex_unlock( &pool_mutex);
+}
+
+/**
+ * Waits for a batch to finish; the waiting thread runs queued jobs in the meantime.
+ */
+void pool_wait( pool_batch_t *batch) {
+    pool_job_t *job;
+
+    pthread_mutex_lock( &pool_mutex);
+    while( batch->pending) {
+        if( (job = pool_pop()))
+            pool_exec( job);
+        else
+            pthread_cond_wait( &pool_done, &pool_mutex);
+    }
+    pthread_mutex_unlock( &pool_mutex);
+}
+
+/**
+ * Runs func( args + i*arg_size) for i in [0, cnt) on the pool & waits for all of them (cnt <= MAX_THREADS).
+ */
+void pool_run( void *(*func)( void *), void *args, size_t arg_size, uint32_t cnt) {
+    pool_job_t jobs[MAX_THREADS];
+    pool_batch_t batch;
+
+    assert( cnt <= MAX_THREADS);
+    if( cnt == 1 || !pool_thread_cnt) {
+        uint32_t i;
+        for( i=0; i<cnt; i++)
+            func( (uint8_t *)args + i*arg_size);
+        return;
+    }
+    pool_submit( &batch, jobs, func, args, arg_size, cnt);
+    pool_wait( &batch);
+}
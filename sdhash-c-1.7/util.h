@@ -14,6 +14,10 @@
 #define ALLOC_ONLY	1
 #define ALLOC_ZERO	2
 #define ALLOC_AUTO	3
+#define ALLOC_ALIGN	4	// Zeroed & aligned on a cache line (used for BF buffers)
+
+#define CACHE_LINE	64
+#define FILE_PAGE_SIZE  4096    // read_file() pads buffers to a multiple of this (power of 2)
 
 #define ERROR_IGNORE	0
 #define ERROR_EXIT		1
@@ -25,9 +29,12 @@ typedef struct {
     FILE     *input;
 	uint64_t  size;
 	uint8_t	 *buffer;
+    uint32_t  mapped;       // Buffer is a mapping of the file (else it belongs to the caller of read_file())
 } mapped_file_t;
 
 mapped_file_t *mmap_file( char *fname, int64_t min_file_size, uint32_t warnings);
+mapped_file_t *read_file( char *fname, int64_t min_file_size, uint32_t warnings, uint64_t map_size, uint8_t **buffer, uint64_t *buffer_cap);
+void           unmap_file( mapped_file_t *mfile);
 
 void print256( const uint8_t *buffer);
 void *alloc_check( uint32_t alloc_type, uint64_t mem_bytes, const char *fun_name, const char *var_name, uint32_t error_action);
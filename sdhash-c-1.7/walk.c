@@ -0,0 +1,305 @@
+/**
+ * walk.c: Parallel recursive directory traversal. Walker threads list directories (getdents64 where available,
+ * one fstat per directory), queue the subdirectories for each other & hand regular files, with their sizes, to
+ * the consumer as soon as they are found. Directories & files are visited once, so files reached through hard or
+ * symbolic links are hashed once & loops of symbolic links end.
+ */
+
+#include "sdbf.h"
+#include <dirent.h>
+#include <sys/syscall.h>
+
+extern sdbf_parameters_t sdbf_sys;
+
+#ifdef SYS_getdents64
+// Directory entry as returned by getdents64
+struct walk_dirent {
+    uint64_t  d_ino;
+    int64_t   d_off;
+    uint16_t  d_reclen;
+    uint8_t   d_type;
+    char      d_name[];
+};
+#endif
+
+/**
+ * Adds a directory/file identity to the set of visited ones (mutex held); returns 0 if it was there already.
+ */
+static int walk_seen( walk_t *walk, uint64_t dev, uint64_t ino) {
+    uint64_t i, mask;
+
+    if( 2*(walk->seen_count+1) > walk->seen_cap) {
+        walk_id_t *old = walk->seen;
+        uint64_t old_cap = walk->seen_cap;
+        walk->seen_cap = old_cap ? 2*old_cap : WALK_SEEN_INIT;
+        walk->seen = (walk_id_t *)alloc_check( ALLOC_ZERO, walk->seen_cap*sizeof( walk_id_t), "walk_seen", "walk->seen", ERROR_EXIT);
+        walk->seen_count = 0;
+        for( i=0; i<old_cap; i++) {
+            if( old[i].dev || old[i].ino)
+                walk_seen( walk, old[i].dev, old[i].ino);
+        }
+        free( old);
+    }
+    mask = walk->seen_cap-1;
+    for( i=((ino ^ (dev << 40) ^ (dev >> 24))*0x9E3779B97F4A7C15ULL >> 20) & mask; walk->seen[i].dev || walk->seen[i].ino; i=(i+1) & mask) {
+        if( walk->seen[i].dev == dev && walk->seen[i].ino == ino)
+            return 0;
+    }
+    walk->seen[i].dev = dev;
+    walk->seen[i].ino = ino;
+    walk->seen_count++;
+    return 1;
+}
+
+/**
+ * Hands a file to the consumer (mutex held).
+ */
+static void walk_add_file( walk_t *walk, char *name, uint64_t size) {
+    if( walk->file_count == walk->file_cap) {
+        walk->file_cap = walk->file_cap ? 2*walk->file_cap : 1024;
+        walk->names = (char **)realloc_check( walk->names, walk->file_cap*sizeof( char *));
+        walk->sizes = (uint64_t *)realloc_check( walk->sizes, walk->file_cap*sizeof( uint64_t));
+        if( !walk->names || !walk->sizes) {
+            fprintf( stderr, "ERROR: Could not allocate file list.\n");
+            exit(-1);
+        }
+    }
+    walk->names[walk->file_count] = name;
+    walk->sizes[walk->file_count] = size;
+    walk->file_count++;
+    if( walk->waiting)
+        pthread_cond_signal( &walk->found);
+}
+
+/**
+ * Queues a directory for the walker threads (takes over path).
+ */
+static void walk_push( walk_t *walk, char *path) {
+    walk_dir_t *dir = (walk_dir_t *)alloc_check( ALLOC_ONLY, sizeof( walk_dir_t), "walk_push", "dir", ERROR_EXIT);
+
+    dir->path = path;
+    pthread_mutex_lock( &walk->mutex);
+    dir->next = walk->dirs;
+    walk->dirs = dir;
+    pthread_cond_signal( &walk->work);
+    pthread_mutex_unlock( &walk->mutex);
+}
+
+/**
+ * Path of a directory entry.
+ */
+static char *walk_path( const char *dir, const char *name) {
+    size_t len = strlen( dir);
+    char *path = (char *)alloc_check( ALLOC_ONLY, len+strlen( name)+2, "walk_path", "path", ERROR_EXIT);
+
+    sprintf( path, (len && dir[len-1] == '/') ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+/**
+ * A regular file found in a directory (file_stat: of the link target, for a symbolic link): too small files are
+ * dropped here, files seen before (through another hard or symbolic link), too.
+ */
+static void walk_file( walk_t *walk, char *path, const struct stat *file_stat) {
+    if( file_stat->st_size < MIN_FILE_SIZE) {
+        if( sdbf_sys.warnings)
+            fprintf( stderr, "Warning: File '%s' too small (%ld). Skipping.\n", path, file_stat->st_size);
+        free( path);
+        return;
+    }
+    pthread_mutex_lock( &walk->mutex);
+    if( !walk_seen( walk, file_stat->st_dev, file_stat->st_ino))
+        free( path);
+    else
+        walk_add_file( walk, path, file_stat->st_size);
+    pthread_mutex_unlock( &walk->mutex);
+}
+
+/**
+ * One directory entry. The entry type comes with the entry (on most file systems); only regular files (for
+ * their size) & symbolic links (which are followed) are stat-ed, relative to the open directory.
+ */
+static void walk_entry( walk_t *walk, int dir_fd, const char *dir, const char *name, uint32_t type) {
+    struct stat file_stat;
+    int stat_done = 0;
+
+    if( name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+        return;
+    if( type == DT_UNKNOWN || type == DT_LNK) {
+        if( fstatat( dir_fd, name, &file_stat, 0)) {
+            if( sdbf_sys.warnings)
+                fprintf( stderr, "Warning: Could not stat file '%s/%s'. Skipping.\n", dir, name);
+            return;
+        }
+        stat_done = 1;
+        type = S_ISDIR( file_stat.st_mode) ? DT_DIR : S_ISREG( file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if( type == DT_DIR) {
+        walk_push( walk, walk_path( dir, name));
+    } else if( type == DT_REG) {
+        if( !stat_done && fstatat( dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW)) {
+            if( sdbf_sys.warnings)
+                fprintf( stderr, "Warning: Could not stat file '%s/%s'. Skipping.\n", dir, name);
+            return;
+        }
+        walk_file( walk, walk_path( dir, name), &file_stat);
+    }
+}
+
+/**
+ * Lists a directory (unless it has been listed before).
+ */
+static void walk_list( walk_t *walk, const char *path, uint8_t *buffer) {
+    struct stat dir_stat;
+    int fd = open( path, O_RDONLY | O_DIRECTORY), fresh;
+
+    if( fd < 0 || fstat( fd, &dir_stat)) {
+        if( sdbf_sys.warnings)
+            fprintf( stderr, "Warning: Could not open directory '%s'. Skipping.\n", path);
+        if( fd >= 0)
+            close( fd);
+        return;
+    }
+    pthread_mutex_lock( &walk->mutex);
+    fresh = walk_seen( walk, dir_stat.st_dev, dir_stat.st_ino);
+    pthread_mutex_unlock( &walk->mutex);
+    if( !fresh) {
+        close( fd);
+        return;
+    }
+#ifdef SYS_getdents64
+    long got, pos;
+    while( (got = syscall( SYS_getdents64, fd, buffer, WALK_BUF_SIZE)) > 0) {
+        for( pos=0; pos<got; ) {
+            struct walk_dirent *entry = (struct walk_dirent *)(buffer+pos);
+            walk_entry( walk, fd, path, entry->d_name, entry->d_type);
+            pos += entry->d_reclen;
+        }
+    }
+    if( got < 0 && sdbf_sys.warnings)
+        fprintf( stderr, "Warning: Could not read directory '%s'.\n", path);
+    close( fd);
+#else
+    DIR *dir = fdopendir( fd);
+    struct dirent *entry;
+    if( !dir) {
+        close( fd);
+        return;
+    }
+    while( (entry = readdir( dir)))
+        walk_entry( walk, fd, path, entry->d_name, entry->d_type);
+    closedir( dir);
+#endif
+}
+
+/**
+ * Walker thread: lists queued directories until none are left & no other walker can queue more.
+ */
+static void *thread_walker( void *param) {
+    walk_t *walk = (walk_t *)param;
+    uint8_t *buffer = (uint8_t *)alloc_check( ALLOC_ONLY, WALK_BUF_SIZE, "thread_walker", "buffer", ERROR_EXIT);
+    walk_dir_t *dir;
+
+    pthread_mutex_lock( &walk->mutex);
+    while( 1) {
+        while( !walk->dirs && walk->busy)
+            pthread_cond_wait( &walk->work, &walk->mutex);
+        if( !walk->dirs)
+            break;
+        dir = walk->dirs;
+        walk->dirs = dir->next;
+        walk->busy++;
+        pthread_mutex_unlock( &walk->mutex);
+
+        walk_list( walk, dir->path, buffer);
+        free( dir->path);
+        free( dir);
+
+        pthread_mutex_lock( &walk->mutex);
+        if( !--walk->busy && !walk->dirs) {
+            walk->done = 1;
+            pthread_cond_broadcast( &walk->work);
+            pthread_cond_broadcast( &walk->found);
+        }
+    }
+    pthread_mutex_unlock( &walk->mutex);
+    free( buffer);
+    return NULL;
+}
+
+/**
+ * Start walking a list of paths: directories are traversed recursively (following symbolic links), anything
+ * else (incl. '-') goes to the consumer as is.
+ */
+walk_t *walk_open( char **paths, uint32_t path_count) {
+    walk_t *walk = (walk_t *)alloc_check( ALLOC_ZERO, sizeof( walk_t), "walk_open", "walk", ERROR_EXIT);
+    struct stat file_stat;
+    uint32_t i;
+
+    pthread_mutex_init( &walk->mutex, NULL);
+    pthread_cond_init( &walk->work, NULL);
+    pthread_cond_init( &walk->found, NULL);
+    for( i=0; i<path_count; i++) {
+        int found = strcmp( paths[i], STDIN_ARG) && !stat( paths[i], &file_stat);
+        if( found && S_ISDIR( file_stat.st_mode)) {
+            walk_push( walk, strdup( paths[i]));
+        } else {
+            pthread_mutex_lock( &walk->mutex);
+            walk_add_file( walk, strdup( paths[i]), (found && S_ISREG( file_stat.st_mode)) ? file_stat.st_size : 0);
+            pthread_mutex_unlock( &walk->mutex);
+        }
+    }
+    if( !walk->dirs) {
+        walk->done = 1;
+        return walk;
+    }
+    for( i=0; i<WALK_THREADS; i++) {
+        if( pthread_create( &walk->threads[i], NULL, thread_walker, (void *)walk)) {
+            fprintf( stderr, "ERROR: Could not create thread.\n");
+            exit(-1);
+        }
+    }
+    walk->thread_cnt = WALK_THREADS;
+    return walk;
+}
+
+/**
+ * Takes all of the files found since the last call (waits for at least one): returns their number (0 once the
+ * traversal is complete) & hands over the arrays of names & sizes. All of it (incl. the names) is the caller's
+ * to free; SDBFs refer to their file names.
+ */
+uint32_t walk_take( walk_t *walk, char ***names, uint64_t **sizes) {
+    uint32_t count;
+
+    pthread_mutex_lock( &walk->mutex);
+    while( !walk->file_count && !walk->done) {
+        walk->waiting = 1;
+        pthread_cond_wait( &walk->found, &walk->mutex);
+    }
+    walk->waiting = 0;
+    count = walk->file_count;
+    *names = walk->names;
+    *sizes = walk->sizes;
+    walk->names = NULL;
+    walk->sizes = NULL;
+    walk->file_count = walk->file_cap = 0;
+    pthread_mutex_unlock( &walk->mutex);
+    return count;
+}
+
+/**
+ * Wait for the walker threads & release the traversal state (files not taken yet are dropped).
+ */
+void walk_close( walk_t *walk) {
+    uint32_t i;
+
+    for( i=0; i<walk->thread_cnt; i++)
+        pthread_join( walk->threads[i], NULL);
+    pthread_mutex_destroy( &walk->mutex);
+    pthread_cond_destroy( &walk->work);
+    pthread_cond_destroy( &walk->found);
+    free( walk->names);
+    free( walk->sizes);
+    free( walk->seen);
+    free( walk);
+}
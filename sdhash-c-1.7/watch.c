@@ -0,0 +1,417 @@
+/**
+ * watch.c: Watch mode. Directory trees are hashed as with -R, then watched with inotify: files that are created,
+ * written or moved in are hashed once they have not changed for WATCH_DEBOUNCE_MS, in batches (see
+ * sdbf_hash_batch()), & their digests written out right away. New subdirectories are watched (& their files
+ * hashed) as they appear. The trees are only traversed again if the kernel's event queue overflows (& then only
+ * the files changed since the previous traversal began are hashed). Symbolic links to directories below the
+ * given ones are not followed.
+ */
+
+#include "sdbf.h"
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#endif
+
+extern sdbf_parameters_t sdbf_sys;
+
+#ifdef __linux__
+
+#define WATCH_EVENTS  (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO)
+#define WATCH_NS( ts) ((uint64_t)(ts).tv_sec*1000000000 + (ts).tv_nsec)
+
+// Set by SIGINT/SIGTERM: files still waiting are hashed & the run ends
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal( int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+/**
+ * Monotonic time in ms.
+ */
+static uint64_t watch_now() {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/**
+ * Index slot of a path: its file or, if it is not waiting, an empty slot.
+ */
+static uint32_t watch_slot( watch_t *watch, const char *path) {
+    uint64_t fp[2];
+    uint32_t slot, mask = watch->index_cap-1;
+
+    xxh3_fingerprint( (const uint8_t *)path, strlen( path), fp);
+    for( slot=(fp[0] ^ fp[1]) & mask; watch->index[slot]; slot=(slot+1) & mask) {
+        if( !strcmp( watch->files[watch->index[slot]-1].path, path))
+            break;
+    }
+    return slot;
+}
+
+/**
+ * Rebuilds the index of the waiting files (with room for at least twice as many).
+ */
+static void watch_reindex( watch_t *watch) {
+    uint32_t i;
+
+    while( watch->index_cap < 2*(watch->file_count+1))
+        watch->index_cap *= 2;
+    free( watch->index);
+    watch->index = (uint32_t *)alloc_check( ALLOC_ZERO, watch->index_cap*sizeof( uint32_t), "watch_reindex", "watch->index", ERROR_EXIT);
+    for( i=0; i<watch->file_count; i++)
+        watch->index[watch_slot( watch, watch->files[i].path)] = i+1;
+}
+
+/**
+ * A file changed (takes over path): it is hashed once it has been left alone for WATCH_DEBOUNCE_MS.
+ */
+static void watch_pend( watch_t *watch, char *path) {
+    uint32_t slot = watch_slot( watch, path);
+
+    if( watch->index[slot]) {
+        watch->files[watch->index[slot]-1].due = watch_now() + WATCH_DEBOUNCE_MS;
+        free( path);
+        return;
+    }
+    if( watch->file_count == watch->file_cap) {
+        watch->file_cap = watch->file_cap ? 2*watch->file_cap : WATCH_INDEX_INIT/2;
+        watch->files = (watch_file_t *)realloc_check( watch->files, watch->file_cap*sizeof( watch_file_t));
+        if( !watch->files) {
+            fprintf( stderr, "ERROR: Could not allocate file list.\n");
+            exit(-1);
+        }
+    }
+    watch->files[watch->file_count].path = path;
+    watch->files[watch->file_count].due = watch_now() + WATCH_DEBOUNCE_MS;
+    watch->file_count++;
+    if( 2*watch->file_count > watch->index_cap)
+        watch_reindex( watch);
+    else
+        watch->index[slot] = watch->file_count;
+}
+
+/**
+ * Slot of a file in the set of written out ones: its entry or, if it is not there, an empty slot.
+ */
+static uint64_t watch_emit_slot( watch_t *watch, uint64_t dev, uint64_t ino) {
+    uint64_t i, mask = watch->emit_cap-1;
+
+    for( i=((ino ^ (dev << 40) ^ (dev >> 24))*0x9E3779B97F4A7C15ULL >> 20) & mask; watch->emitted[i].dev || watch->emitted[i].ino; i=(i+1) & mask) {
+        if( watch->emitted[i].dev == dev && watch->emitted[i].ino == ino)
+            break;
+    }
+    return i;
+}
+
+/**
+ * Rebuilds the set of written out files with the ones changed at or after since (ns) only (& with room for at
+ * least twice as many).
+ */
+static void watch_prune( watch_t *watch, uint64_t since) {
+    watch_emit_t *old = watch->emitted;
+    uint64_t i, old_cap = watch->emit_cap, count = 0;
+
+    for( i=0; i<old_cap; i++)
+        count += (old[i].dev || old[i].ino) && old[i].ctime >= since;
+    for( watch->emit_cap=WATCH_INDEX_INIT; watch->emit_cap < 2*(count+1); watch->emit_cap*=2)
+        ;
+    watch->emitted = (watch_emit_t *)alloc_check( ALLOC_ZERO, watch->emit_cap*sizeof( watch_emit_t), "watch_prune", "watch->emitted", ERROR_EXIT);
+    watch->emit_count = count;
+    for( i=0; i<old_cap; i++) {
+        if( (old[i].dev || old[i].ino) && old[i].ctime >= since)
+            watch->emitted[watch_emit_slot( watch, old[i].dev, old[i].ino)] = old[i];
+    }
+    free( old);
+}
+
+/**
+ * A file is written out: returns 1 if it was written out before in the same state (size, modification & change
+ * time, which renames update, too), else records its state & returns 0.
+ */
+static int watch_emitted( watch_t *watch, const struct stat *file_stat) {
+    uint64_t slot;
+
+    if( 2*(watch->emit_count+1) > watch->emit_cap)
+        watch_prune( watch, 0);
+    slot = watch_emit_slot( watch, file_stat->st_dev, file_stat->st_ino);
+    watch_emit_t *entry = watch->emitted+slot;
+    if( entry->dev || entry->ino) {
+        if( entry->size == (uint64_t)file_stat->st_size && entry->mtime == WATCH_NS( file_stat->st_mtim) &&
+            entry->ctime == WATCH_NS( file_stat->st_ctim))
+            return 1;
+    } else {
+        watch->emit_count++;
+    }
+    entry->dev = file_stat->st_dev;
+    entry->ino = file_stat->st_ino;
+    entry->size = file_stat->st_size;
+    entry->mtime = WATCH_NS( file_stat->st_mtim);
+    entry->ctime = WATCH_NS( file_stat->st_ctim);
+    return 0;
+}
+
+/**
+ * Path of a directory entry.
+ */
+static char *watch_path( const char *dir, const char *name) {
+    size_t len = strlen( dir);
+    char *path = (char *)alloc_check( ALLOC_ONLY, len+strlen( name)+2, "watch_path", "path", ERROR_EXIT);
+
+    sprintf( path, (len && dir[len-1] == '/') ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+/**
+ * Watches a directory & its subdirectories (takes over path); with pend, the files in them are queued, too
+ * (a directory that appears while watching may have been filled before it was watched). Subdirectories are
+ * always listed, even below a directory watched already: after lost events, some may not be watched yet.
+ */
+static void watch_dir( watch_t *watch, char *path, uint32_t pend) {
+    struct dirent *entry;
+    struct stat file_stat;
+    DIR *dir;
+    int wd = inotify_add_watch( watch->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+
+    if( wd < 0) {
+        if( sdbf_sys.warnings)
+            fprintf( stderr, "Warning: Could not watch directory '%s'. Skipping.\n", path);
+        free( path);
+        return;
+    }
+    if( (uint32_t)wd >= watch->dir_cap) {
+        uint32_t old_cap = watch->dir_cap;
+        watch->dir_cap = 2*wd+64;
+        watch->dirs = (char **)realloc_check( watch->dirs, watch->dir_cap*sizeof( char *));
+        if( !watch->dirs) {
+            fprintf( stderr, "ERROR: Could not allocate directory list.\n");
+            exit(-1);
+        }
+        bzero( watch->dirs+old_cap, (watch->dir_cap-old_cap)*sizeof( char *));
+    }
+    // Watched already under the same name: keep that one
+    if( watch->dirs[wd] && !strcmp( watch->dirs[wd], path)) {
+        free( path);
+        path = watch->dirs[wd];
+    } else {
+        free( watch->dirs[wd]);
+        watch->dirs[wd] = path;
+    }
+    if( !(dir = opendir( path)))
+        return;
+    while( (entry = readdir( dir))) {
+        uint32_t type = entry->d_type;
+        if( entry->d_name[0] == '.' && (!entry->d_name[1] || (entry->d_name[1] == '.' && !entry->d_name[2])))
+            continue;
+        char *sub = watch_path( path, entry->d_name);
+        if( type == DT_UNKNOWN && !lstat( sub, &file_stat))
+            type = S_ISDIR( file_stat.st_mode) ? DT_DIR : S_ISREG( file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+        if( type == DT_DIR)
+            watch_dir( watch, sub, pend);
+        else if( type == DT_REG && pend)
+            watch_pend( watch, sub);
+        else
+            free( sub);
+    }
+    closedir( dir);
+}
+
+/**
+ * Hashes the waiting files that are due (all of them, with all) & writes their digests out.
+ */
+static int watch_flush( watch_t *watch, uint32_t all) {
+    struct stat file_stat;
+    char **names = (char **)alloc_check( ALLOC_ONLY, (watch->file_count+1)*sizeof( char *), "watch_flush", "names", ERROR_EXIT);
+    uint64_t now = watch_now();
+    uint32_t i, kept = 0, count = 0;
+    int32_t result = 0;
+
+    for( i=0; i<watch->file_count; i++) {
+        if( all || watch->files[i].due <= now) {
+            names[count] = watch->files[i].path;
+            if( !stat( names[count], &file_stat))
+                watch_emitted( watch, &file_stat);
+            count++;
+        } else
+            watch->files[kept++] = watch->files[i];
+    }
+    if( count) {
+        watch->file_count = kept;
+        watch_reindex( watch);
+        result = sdbf_hash_batch( names, NULL, count, watch->gen_mode, watch->dd_block_size, watch->dual);
+        fflush( stdout);
+        watch->batch_cnt++;
+        watch->file_cnt += count;
+    }
+    free( names);
+    return result;
+}
+
+/**
+ * Traverses the trees & hashes their files (at the start & after lost events): after lost events, only the
+ * files changed (ctime, which renames update, too) since the previous traversal began, whose digests might be
+ * missing, & not written out since in the state they are in. Files waiting are covered by the traversal.
+ */
+static int watch_scan( watch_t *watch, char **paths, uint32_t path_count) {
+    struct stat file_stat;
+    struct timespec start;
+    uint64_t *sizes;
+    char **names;
+    uint64_t since;
+    uint32_t i, count, kept;
+    int32_t result = 0;
+
+    for( i=0; i<watch->file_count; i++)
+        free( watch->files[i].path);
+    watch->file_count = 0;
+    watch_reindex( watch);
+    // Watched first, so that no change is missed while the trees are hashed
+    clock_gettime( CLOCK_REALTIME, &start);
+    // ctime has a granularity of a second (or coarser, on some file systems)
+    since = start.tv_sec-2;
+    for( i=0; i<path_count; i++)
+        watch_dir( watch, strdup( paths[i]), 0);
+    walk_t *walk = walk_open( paths, path_count);
+    while( (count = walk_take( walk, &names, &sizes))) {
+        for( i=0, kept=0; i<count; i++) {
+            int found = !stat( names[i], &file_stat);
+            if( watch->since && (!found || (uint64_t)file_stat.st_ctime < watch->since || watch_emitted( watch, &file_stat))) {
+                free( names[i]);
+                continue;
+            }
+            // The next traversal only looks at files changed from now on
+            if( !watch->since && found && (uint64_t)file_stat.st_ctime >= since)
+                watch_emitted( watch, &file_stat);
+            names[kept] = names[i];
+            sizes[kept++] = sizes[i];
+        }
+        if( kept)
+            result += sdbf_hash_batch( names, sizes, kept, watch->gen_mode, watch->dd_block_size, watch->dual);
+        fflush( stdout);
+        free( names);
+        free( sizes);
+    }
+    walk_close( walk);
+    watch->since = since;
+    watch_prune( watch, since*1000000000);
+    return result;
+}
+
+/**
+ * Handles a buffer of inotify events; returns 1 if events were lost.
+ */
+static int watch_events( watch_t *watch, uint8_t *buffer, ssize_t len) {
+    ssize_t pos;
+
+    for( pos=0; pos<len; pos+=sizeof( struct inotify_event) + ((struct inotify_event *)(buffer+pos))->len) {
+        struct inotify_event *event = (struct inotify_event *)(buffer+pos);
+        if( event->mask & IN_Q_OVERFLOW)
+            return 1;
+        if( event->wd < 0 || (uint32_t)event->wd >= watch->dir_cap || !watch->dirs[event->wd])
+            continue;
+        if( event->mask & IN_IGNORED) {
+            free( watch->dirs[event->wd]);
+            watch->dirs[event->wd] = NULL;
+        } else if( event->len) {
+            char *path = watch_path( watch->dirs[event->wd], event->name);
+            if( !(event->mask & IN_ISDIR))
+                watch_pend( watch, path);
+            else if( event->mask & (IN_CREATE | IN_MOVED_TO))
+                watch_dir( watch, path, 1);
+            else
+                free( path);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hash the files in a list of directory trees, then keep hashing the files that are created or changed in them
+ * (stream, dd (dd_block_size > 0) or dual method) until SIGINT/SIGTERM. Returns the number of digests.
+ */
+int watch_files( char **paths, uint32_t path_count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual) {
+    watch_t *watch = (watch_t *)alloc_check( ALLOC_ZERO, sizeof( watch_t), "watch_files", "watch", ERROR_EXIT);
+    uint8_t *buffer = (uint8_t *)alloc_check( ALLOC_ALIGN, WATCH_BUF_SIZE, "watch_files", "buffer", ERROR_EXIT);
+    struct sigaction action;
+    struct stat dir_stat;
+    struct pollfd pfd;
+    int32_t result = 0;
+    uint32_t i;
+
+    for( i=0; i<path_count; i++) {
+        if( stat( paths[i], &dir_stat) || !S_ISDIR( dir_stat.st_mode)) {
+            fprintf( stderr, "ERROR: Watch mode (-W) only applies to directories ('%s').\n", paths[i]);
+            exit(-1);
+        }
+    }
+    if( (watch->fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf( stderr, "ERROR: Could not start watching (inotify).\n");
+        exit(-1);
+    }
+    watch->gen_mode = gen_mode;
+    watch->dd_block_size = dd_block_size;
+    watch->dual = dual;
+    watch->index_cap = WATCH_INDEX_INIT;
+    bzero( &action, sizeof( action));
+    action.sa_handler = watch_signal;
+    sigaction( SIGINT, &action, NULL);
+    sigaction( SIGTERM, &action, NULL);
+
+    result += watch_scan( watch, paths, path_count);
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+    while( !watch_stop) {
+        // Sleep until an event comes in or the next waiting file is due
+        uint64_t now = watch_now(), due = UINT64_MAX;
+        for( i=0; i<watch->file_count; i++)
+            due = (watch->files[i].due < due) ? watch->files[i].due : due;
+        if( poll( &pfd, 1, (due == UINT64_MAX) ? -1 : (due > now) ? (int)(due-now) : 0) > 0) {
+            ssize_t len;
+            uint32_t lost = 0;
+            while( !lost && (len = read( watch->fd, buffer, WATCH_BUF_SIZE)) > 0)
+                lost = watch_events( watch, buffer, len);
+            if( lost) {
+                if( sdbf_sys.warnings)
+                    fprintf( stderr, "Warning: Watch events lost (queue overflow); hashing the trees again.\n");
+                while( read( watch->fd, buffer, WATCH_BUF_SIZE) > 0)
+                    ;
+                watch->rescan_cnt++;
+                result += watch_scan( watch, paths, path_count);
+                continue;
+            }
+        }
+        result += watch_flush( watch, 0);
+    }
+    result += watch_flush( watch, 1);
+    if( sdbf_sys.verbose)
+        fprintf( stderr, "watch: %lu files hashed in %lu batches, %lu rescans\n", watch->file_cnt, watch->batch_cnt, watch->rescan_cnt);
+
+    close( watch->fd);
+    for( i=0; i<watch->dir_cap; i++)
+        free( watch->dirs[i]);
+    free( watch->dirs);
+    free( watch->files);
+    free( watch->index);
+    free( watch->emitted);
+    free( watch);
+    free( buffer);
+    return result;
+}
+
+#else
+
+/**
+ * Watch mode needs inotify.
+ */
+int watch_files( char **paths, uint32_t path_count, uint32_t gen_mode, uint32_t dd_block_size, uint32_t dual) {
+    fprintf( stderr, "ERROR: Watch mode (-W) is only available on Linux.\n");
+    exit(-1);
+}
+
+#endif
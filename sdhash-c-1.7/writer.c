@@ -0,0 +1,119 @@
+/**
+ * writer.c: Ordered output of digests. Hashing workers hand finished digests to a dedicated writer thread,
+ * which writes (& releases) them in input order, or in completion order; output starts with the first digest.
+ * A worker that would take the memory held by waiting digests over the budget waits for the writer, unless its
+ * digest is the next one due or, while the writer waits for that one, all of the other workers are waiting already
+ * (so the order always moves on).
+ */
+
+#include "sdbf.h"
+
+extern sdbf_parameters_t sdbf_sys;
+
+/**
+ * Memory held by a digest.
+ */
+static uint64_t writer_size( sdbf_t *sdbf) {
+    return sdbf ? sizeof( sdbf_t) + (uint64_t)sdbf->bf_count*sdbf->bf_size : 0;
+}
+
+/**
+ * Writer thread: writes the slots in order, as they are filled.
+ */
+static void *thread_writer( void *param) {
+    writer_t *writer = (writer_t *)param;
+    sdbf_t *sdbf;
+
+    pthread_mutex_lock( &writer->mutex);
+    while( writer->next < writer->count) {
+        while( !writer->filled[writer->next])
+            pthread_cond_wait( &writer->ready, &writer->mutex);
+        sdbf = writer->slots[writer->next];
+        writer->slots[writer->next] = NULL;
+        pthread_mutex_unlock( &writer->mutex);
+
+        uint64_t size = writer_size( sdbf);
+        if( sdbf) {
+            sdbf_to_stream( sdbf, writer->out);
+            sdbf_free( sdbf);
+        }
+
+        pthread_mutex_lock( &writer->mutex);
+        writer->bytes -= size;
+        writer->next++;
+        if( writer->blocked)
+            pthread_cond_broadcast( &writer->space);
+    }
+    pthread_mutex_unlock( &writer->mutex);
+    fflush( writer->out);
+    return NULL;
+}
+
+/**
+ * Start writing count digests (handed over by up to producers threads) to out, with a budget in bytes for
+ * the ones waiting to be written.
+ */
+writer_t *writer_open( FILE *out, uint32_t count, uint32_t producers, uint32_t ordered, uint64_t budget) {
+    writer_t *writer = (writer_t *)alloc_check( ALLOC_ZERO, sizeof( writer_t), "writer_open", "writer", ERROR_EXIT);
+
+    writer->out = out;
+    writer->count = count;
+    writer->producers = producers;
+    writer->ordered = ordered;
+    writer->budget = budget;
+    writer->slots = (sdbf_t **)alloc_check( ALLOC_ZERO, (count+1)*sizeof( sdbf_t *), "writer_open", "writer->slots", ERROR_EXIT);
+    writer->filled = (uint8_t *)alloc_check( ALLOC_ZERO, count+1, "writer_open", "writer->filled", ERROR_EXIT);
+    pthread_mutex_init( &writer->mutex, NULL);
+    pthread_cond_init( &writer->ready, NULL);
+    pthread_cond_init( &writer->space, NULL);
+    if( pthread_create( &writer->thread, NULL, thread_writer, (void *)writer)) {
+        fprintf( stderr, "ERROR: Could not create thread.\n");
+        exit(-1);
+    }
+    return writer;
+}
+
+/**
+ * Hand over the digest of input number index (NULL if the file was skipped); the writer takes it over.
+ * Waits while the budget is used up (see above).
+ */
+void writer_put( writer_t *writer, uint32_t index, sdbf_t *sdbf) {
+    uint64_t size = writer_size( sdbf);
+    uint32_t slot;
+
+    pthread_mutex_lock( &writer->mutex);
+    if( writer->bytes && writer->bytes+size > writer->budget) {
+        writer->wait_cnt++;
+        while( writer->bytes && writer->bytes+size > writer->budget &&
+               (!writer->ordered || (index != writer->next && (writer->filled[writer->next] || writer->blocked+1 < writer->producers)))) {
+            writer->blocked++;
+            pthread_cond_wait( &writer->space, &writer->mutex);
+            writer->blocked--;
+        }
+    }
+    slot = writer->ordered ? index : writer->arrived;
+    writer->slots[slot] = sdbf;
+    writer->filled[slot] = 1;
+    writer->arrived++;
+    writer->bytes += size;
+    writer->peak = (writer->bytes > writer->peak) ? writer->bytes : writer->peak;
+    if( slot == writer->next)
+        pthread_cond_signal( &writer->ready);
+    pthread_mutex_unlock( &writer->mutex);
+}
+
+/**
+ * Wait for all of the digests to be written (all of them must have been handed over) & release the writer.
+ */
+void writer_close( writer_t *writer) {
+    pthread_join( writer->thread, NULL);
+    if( sdbf_sys.verbose)
+        fprintf( stderr, "writer: %d digests, peak %.1f MB waiting (budget %.1f MB), %ld producer waits\n", writer->count,
+                 (double)writer->peak/MB, (double)writer->budget/MB, writer->wait_cnt);
+    pthread_mutex_destroy( &writer->mutex);
+    pthread_cond_destroy( &writer->ready);
+    pthread_cond_destroy( &writer->space);
+    free( writer->slots);
+    free( writer->filled);
+    free( writer);
+}
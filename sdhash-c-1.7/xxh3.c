@@ -0,0 +1,97 @@
+/**
+ * xxh3.c: Fast (non-cryptographic) feature hash for the "xxh3" digest variant
+ */
+
+#include "sdbf.h"
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME_MX1   0x165667919E3779F9ULL
+
+// XXH3 default secret (a 64-byte input only touches the first 64 bytes)
+static const uint8_t XXH3_SECRET[64] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c
+};
+
+static inline uint64_t xxh_read64( const uint8_t *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint64_t xxh_mul128_fold64( uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a*b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh3_mix16( const uint8_t *data, const uint8_t *secret) {
+    return xxh_mul128_fold64( xxh_read64( data) ^ xxh_read64( secret), xxh_read64( data+8) ^ xxh_read64( secret+8));
+}
+
+static inline uint64_t xxh3_avalanche( uint64_t h) {
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+/**
+ * Hashes one 64-byte feature: XXH3-128 (seed 0) supplies words 0-3 (low half first); word 4, which
+ * 128 bits cannot cover, is taken from an avalanche of the two halves.
+ */
+static inline void xxh3_hash_64( const uint8_t *data, uint32_t *hash) {
+    uint64_t acc_lo = 64*XXH_PRIME64_1, acc_hi = 0, lo, hi;
+
+    // XXH3_len_17to128_128b() for len == 64, unrolled
+    acc_lo += xxh3_mix16( data+16, XXH3_SECRET+32);
+    acc_lo ^= xxh_read64( data+32) + xxh_read64( data+40);
+    acc_hi += xxh3_mix16( data+32, XXH3_SECRET+48);
+    acc_hi ^= xxh_read64( data+16) + xxh_read64( data+24);
+    acc_lo += xxh3_mix16( data, XXH3_SECRET);
+    acc_lo ^= xxh_read64( data+48) + xxh_read64( data+56);
+    acc_hi += xxh3_mix16( data+48, XXH3_SECRET+16);
+    acc_hi ^= xxh_read64( data) + xxh_read64( data+8);
+    lo = xxh3_avalanche( acc_lo + acc_hi);
+    hi = 0 - xxh3_avalanche( acc_lo*XXH_PRIME64_1 + acc_hi*XXH_PRIME64_4 + 64*XXH_PRIME64_2);
+
+    hash[0] = (uint32_t)lo;
+    hash[1] = (uint32_t)(lo >> 32);
+    hash[2] = (uint32_t)hi;
+    hash[3] = (uint32_t)(hi >> 32);
+    hash[4] = (uint32_t)xxh3_avalanche( lo ^ hi);
+}
+
+/**
+ * Computes the xxh3 feature hashes of count 64-byte features (5 words per feature, as for sha1_batch_64()).
+ */
+void xxh3_batch_64( const uint8_t **data, uint32_t count, uint32_t *hashes) {
+    uint32_t i;
+    for( i=0; i<count; i++)
+        xxh3_hash_64( data[i], hashes+5*i);
+}
+
+/**
+ * 128-bit content fingerprint of a buffer of any length (used to spot repeated dd blocks). Four lanes of 
+ * XXH3 16-byte mixes, each chained through a multiply, are avalanched into fp[0] and fp[1]. This is not 
+ * XXH3-128 itself, and a fingerprint match is a candidate only--callers compare the contents.
+ */
+void xxh3_fingerprint( const uint8_t *data, uint64_t len, uint64_t *fp) {
+    uint64_t acc[4] = { len*XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_4, XXH_PRIME_MX1 };
+    uint64_t pos;
+    uint8_t  last[64];
+    uint32_t k;
+
+    for( pos=0; pos+64<=len; pos+=64)
+        for( k=0; k<4; k++)
+            acc[k] = (acc[k] ^ xxh3_mix16( data+pos+16*k, XXH3_SECRET+16*k))*XXH_PRIME64_1;
+    if( pos < len) {
+        bzero( last, 64);
+        memcpy( last, data+pos, len-pos);
+        for( k=0; k<4; k++)
+            acc[k] = (acc[k] ^ xxh3_mix16( last+16*k, XXH3_SECRET+16*k))*XXH_PRIME64_1;
+    }
+    fp[0] = xxh3_avalanche( acc[0] + acc[1]*XXH_PRIME64_2);
+    fp[1] = xxh3_avalanche( acc[2] + acc[3]*XXH_PRIME64_4);
+}